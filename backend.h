@@ -0,0 +1,281 @@
+#ifndef __BACKEND_H_
+#define __BACKEND_H_
+
+#include <errno.h>    /* errno, ENOMEM */
+#include <stddef.h>   /* size_t, ptrdiff_t */
+#include <stdint.h>   /* uintptr_t */
+#include <sys/mman.h> /* mmap, munmap */
+#include <unistd.h>   /* sbrk, brk */
+
+#include "os.h"
+
+/*
+ * OS backends. A backend gives a heap a contiguous range of memory
+ * with a break at its end, like sbrk(2) does for the program's heap.
+ * Which backend a heap uses decides where the memory comes from:
+ *
+ * - SBRK_BACKEND moves the program break.
+ * - MMAP_BACKEND reserves address space up front and commits it as
+ *   the break moves up, at least BACKEND_COMMIT_STEP bytes at a time.
+ *   Growing can't fail because another mapping is in the way.
+ * - BUFFER_BACKEND hands out memory that the caller provides, such as
+ *   a static or pinned buffer. Nothing of it is ever given to the OS.
+ * - HUGETLB_BACKEND maps a region of huge pages from the preallocated
+ *   pool (MAP_HUGETLB) up front. If the pool is empty, it asks for
+ *   transparent huge pages instead.
+ *
+ * RESERVE sets up the range, GROW and SHRINK move the break, COMMIT
+ * makes pages usable and RELEASE gives them back (returning -1 if
+ * they are kept), and DESTROY gives the whole range back. Apart from
+ * SBRK_BACKEND, backends move their break with REGION_GROW and
+ * REGION_SHRINK, which call COMMIT and RELEASE for the pages that
+ * the break passes.
+ */
+
+#define BACKEND_COMMIT_STEP ((size_t)1 << 20)
+
+typedef struct Backend Backend;
+
+typedef struct {
+  const char *name;
+  /* Set up the range, aligned to ALIGN. Return 0 on success. */
+  int (*reserve)(Backend *b, size_t align);
+  /* Move the break by INCR bytes. Return the old one, like sbrk. */
+  void *(*grow)(Backend *b, ptrdiff_t incr);
+  /* Move the break down to ADDR. Return 0 on success, like brk. */
+  int (*shrink)(Backend *b, void *addr);
+  int (*commit)(Backend *b, void *start, size_t len);
+  int (*release)(Backend *b, void *start, size_t len);
+  void (*destroy)(Backend *b);
+} BackendOps;
+
+struct Backend {
+  const BackendOps *ops;
+  size_t size;  /* Bytes to reserve, or the size of BUF. */
+  char *buf;    /* The caller's memory for BUFFER_BACKEND. */
+  char *base;   /* Start of the range, or NULL before RESERVE. */
+  char *end;    /* End of the range, or NULL if it has none. */
+  char *brk;    /* End of the memory that is in use. */
+  char *commit; /* End of the memory that can be used. */
+};
+
+/*
+ * A backend before RESERVE. Every field is given, so that C++ code
+ * that includes this header builds without warnings.
+ */
+Backend backend_make(const BackendOps *ops, size_t size, char *buf) {
+  Backend b = {ops, size, buf, NULL, NULL, NULL, NULL};
+  return b;
+}
+
+/*
+ * Move the break of B to ADDR, committing or releasing the pages
+ * in between. Return 0 on success, like brk.
+ */
+int region_brk(Backend *b, void *addr) {
+  char *new_brk = (char *)addr;
+  if (b->base == NULL || new_brk < b->base || new_brk > b->end) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  char *need = (char *)page_up((uintptr_t)new_brk);
+  if (need > b->commit) {
+    char *commit = b->commit + BACKEND_COMMIT_STEP;
+    if (commit < need)
+      commit = need;
+    if (commit > b->end)
+      commit = b->end;
+    if (b->ops->commit(b, b->commit, commit - b->commit) != 0)
+      return -1;
+    b->commit = commit;
+  } else if (need < b->commit &&
+             b->ops->release(b, need, b->commit - need) == 0) {
+    b->commit = need;
+  }
+
+  b->brk = new_brk;
+  return 0;
+}
+
+void *region_grow(Backend *b, ptrdiff_t incr) {
+  char *old = b->brk;
+  if (incr != 0 && region_brk(b, old + incr) != 0)
+    return (void *)-1;
+  return old;
+}
+
+int region_shrink(Backend *b, void *addr) { return region_brk(b, addr); }
+
+/* Used by backends whose memory is usable from the start. */
+int region_commit(Backend *b, void *start, size_t len) {
+  (void)b, (void)start, (void)len;
+  return 0;
+}
+
+/* Used by backends that keep all of their memory. */
+int region_keep(Backend *b, void *start, size_t len) {
+  (void)b, (void)start, (void)len;
+  return -1;
+}
+
+/* The program break. */
+
+int sbrk_reserve(Backend *b, size_t align) {
+  /* Move the break up to the next multiple of ALIGN. */
+  uintptr_t brk_now = (uintptr_t)sbrk(0);
+  uintptr_t start = (brk_now + align - 1) & ~(align - 1);
+  if (start != brk_now && sbrk(start - brk_now) == (void *)-1)
+    return -1;
+  b->base = b->brk = b->commit = (char *)start;
+  b->end = NULL;
+  return 0;
+}
+
+void *sbrk_grow(Backend *b, ptrdiff_t incr) {
+  void *old = sbrk(incr);
+  if (old != (void *)-1)
+    b->brk = (char *)old + incr;
+  return old;
+}
+
+int sbrk_shrink(Backend *b, void *addr) {
+  if (brk(addr) != 0)
+    return -1;
+  b->brk = (char *)addr;
+  return 0;
+}
+
+/* Pages below the break can be purged, but not given back. */
+int sbrk_release(Backend *b, void *start, size_t len) {
+  (void)b;
+  purge_pages(start, len);
+  return 0;
+}
+
+void sbrk_destroy(Backend *b) { b->base = b->end = b->brk = b->commit = NULL; }
+
+static const BackendOps sbrk_ops = {
+    "sbrk",       sbrk_reserve,  sbrk_grow,   sbrk_shrink,
+    region_commit, sbrk_release, sbrk_destroy,
+};
+
+Backend sbrk_backend(void) { return backend_make(&sbrk_ops, 0, NULL); }
+
+/* Reserved address space. */
+
+int mmap_reserve(Backend *b, size_t align) {
+  size_t size = page_up(b->size);
+  if (align < page_size())
+    align = page_size();
+  char *start = map_reserved(size, align);
+  if (start == NULL)
+    return -1;
+  b->base = b->brk = b->commit = start;
+  b->end = start + size;
+  return 0;
+}
+
+int mmap_commit(Backend *b, void *start, size_t len) {
+  (void)b;
+  return commit_pages(start, len);
+}
+
+int mmap_release(Backend *b, void *start, size_t len) {
+  (void)b;
+  return decommit_pages(start, len);
+}
+
+void mmap_destroy(Backend *b) {
+  if (b->base != NULL)
+    munmap(b->base, b->end - b->base);
+  b->base = b->end = b->brk = b->commit = NULL;
+}
+
+static const BackendOps mmap_ops = {
+    "mmap",      mmap_reserve, region_grow,  region_shrink,
+    mmap_commit, mmap_release, mmap_destroy,
+};
+
+/* Reserve SIZE bytes of address space when the heap is first used. */
+Backend mmap_backend(size_t size) {
+  return backend_make(&mmap_ops, size, NULL);
+}
+
+/* The caller's buffer. */
+
+int buffer_reserve(Backend *b, size_t align) {
+  uintptr_t start = ((uintptr_t)b->buf + align - 1) & ~(align - 1);
+  if (start >= (uintptr_t)b->buf + b->size)
+    return -1;
+  b->base = b->brk = (char *)start;
+  b->end = b->commit = b->buf + b->size;
+  return 0;
+}
+
+void buffer_destroy(Backend *b) {
+  b->base = b->end = b->brk = b->commit = NULL;
+}
+
+static const BackendOps buffer_ops = {
+    "buffer",      buffer_reserve, region_grow,    region_shrink,
+    region_commit, region_keep,    buffer_destroy,
+};
+
+/* Use the LEN bytes at BUF. They must stay valid while the heap is. */
+Backend buffer_backend(void *buf, size_t len) {
+  return backend_make(&buffer_ops, len, (char *)buf);
+}
+
+/* Preallocated huge pages. */
+
+int hugetlb_reserve(Backend *b, size_t align) {
+  size_t size = huge_page_up(b->size);
+  char *start = NULL;
+#ifdef MAP_HUGETLB
+  /* Huge page mappings are aligned to the huge page size. */
+  if (align <= HUGE_PAGE_SIZE) {
+    start = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                             MAP_POPULATE,
+                         -1, 0);
+    if (start == MAP_FAILED)
+      start = NULL;
+  }
+#endif
+  if (start == NULL) {
+    /* No huge pages in the pool. */
+    if (align < HUGE_PAGE_SIZE)
+      align = HUGE_PAGE_SIZE;
+    start = map_reserved(size, align);
+    if (start == NULL)
+      return -1;
+    if (commit_pages(start, size) != 0) {
+      munmap(start, size);
+      return -1;
+    }
+    advise_huge_pages(start, size);
+    prefault_pages(start, size);
+  }
+  b->base = b->brk = start;
+  b->end = b->commit = start + size;
+  return 0;
+}
+
+void hugetlb_destroy(Backend *b) {
+  if (b->base != NULL)
+    munmap(b->base, b->end - b->base);
+  b->base = b->end = b->brk = b->commit = NULL;
+}
+
+static const BackendOps hugetlb_ops = {
+    "hugetlb",     hugetlb_reserve, region_grow,     region_shrink,
+    region_commit, region_keep,     hugetlb_destroy,
+};
+
+/* Map SIZE bytes (rounded up to huge pages) when the heap is first used. */
+Backend hugetlb_backend(size_t size) {
+  return backend_make(&hugetlb_ops, size, NULL);
+}
+
+#endif /* __BACKEND_H_ */
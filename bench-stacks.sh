@@ -0,0 +1,9 @@
+#!/bin/env bash
+
+# Compare the lock-free stacks in segregated_free_list.c to
+# the same stacks behind mutexes, with many threads at once.
+
+gcc -O2 -pthread -DBENCH_STACKS segregated_free_list.c && ./a.out
+gcc -O2 -pthread -DBENCH_STACKS -DSTACK_LOCKED segregated_free_list.c && ./a.out
+
+rm a.out
@@ -0,0 +1,35 @@
+#!/bin/env bash
+
+# Build the std::pmr adapters in memory_resource.hpp and run
+# their tests. Every allocator is compiled into an object of its
+# own. Only the functions that the adapters need stay global, and
+# they are renamed to carry the allocator's name as a prefix.
+
+set -e
+
+# build FILE PREFIX SYMBOL[=NAME]...
+build() {
+    local file="$1" prefix="$2" args=()
+    shift 2
+    for sym in "$@"; do
+        local name="${sym#*=}"
+        sym="${sym%%=*}"
+        args+=(--redefine-sym "$sym=${prefix}_$name"
+               --keep-global-symbol="${prefix}_$name")
+    done
+    gcc -O2 -pthread -fPIC -c "$file.c" -o "$file.o"
+    objcopy "${args[@]}" "$file.o"
+}
+
+build free_list free_list heap_create heap_destroy heap_reset \
+      heap_alloc heap_free
+build explicit_free_list explicit arena_create arena_destroy arena_reset \
+      arena_alloc wfree=free
+build segregated_free_list segregated heap_create heap_destroy heap_reset \
+      heap_alloc heap_free
+
+g++ -std=c++17 -O2 -pthread memory_resource.cpp \
+    free_list.o explicit_free_list.o segregated_free_list.o -o pmr
+./pmr
+
+rm pmr free_list.o explicit_free_list.o segregated_free_list.o
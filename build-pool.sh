@@ -0,0 +1,10 @@
+#!/bin/env bash
+
+# Build the object pools in object_pool.hpp and run their tests.
+
+set -e
+
+g++ -std=c++17 -O2 -pthread object_pool.cpp -o pool
+./pool
+
+rm pool
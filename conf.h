@@ -0,0 +1,379 @@
+#ifndef __CONF_H_
+#define __CONF_H_
+
+#include <pthread.h> /* pthread_once */
+#include <stddef.h>  /* size_t, offsetof */
+#include <stdint.h>  /* uint64_t */
+#include <stdlib.h>  /* getenv */
+#include <string.h>  /* strlen, strncmp */
+
+#include "dbg.h"
+
+/*
+ * Runtime configuration shared by all allocators.
+ *
+ * The defaults below are what the allocators used to hard-code.
+ * They can be changed without recompiling by setting the MALLOC_CONF
+ * environment variable to a comma separated list of KEY:VALUE pairs:
+ *
+ *   MALLOC_CONF="fit:next,min_split:32,classes:1|8|64|256"
+ *
+ * The string is parsed on the first allocation. Parsing must not
+ * allocate (we might be the allocator that would be called), so
+ * everything is done in place on the string that getenv(3) returns.
+ */
+
+/* How to search for free blocks. */
+#define FIRST_FIT 0
+#define NEXT_FIT 1
+#define BEST_FIT 2
+
+#ifndef SEARCH_MODE
+#define SEARCH_MODE BEST_FIT
+#endif
+
+/* The maximum number of size classes that can be configured. */
+#define CONF_MAX_CLASSES 16
+
+typedef struct {
+  /* Search strategy used by free_list.c. One of the *_FIT constants. */
+  int fit;
+  /*
+   * The minimum number of bytes that the remainder of a
+   * split must hold. Smaller remainders aren't split off.
+   */
+  size_t min_split;
+  /*
+   * Minimum block sizes (in words) of the buckets in
+   * segregated_free_list.c. Sorted in ascending order.
+   */
+  size_t classes[CONF_MAX_CLASSES];
+  int nclasses;
+  /*
+   * Give memory at the top of the heap back to the OS once
+   * a free block of at least this many bytes sits there.
+   * 0 turns automatic trimming off.
+   */
+  size_t trim_threshold;
+  /*
+   * Print what's still on the heap when the process exits (see report.h).
+   * If PROF_SAMPLE isn't 0, every PROF_SAMPLE-th allocation made through
+   * malloc & co. remembers where it came from for that report.
+   */
+  int leak_report;
+  size_t prof_sample;
+  /*
+   * Number of arenas in explicit_free_list.c; 0 means one per CPU.
+   * Threads are assigned to arenas round-robin, unless PERCPU_ARENA
+   * is set. Then every allocation uses the arena of the current CPU.
+   */
+  size_t narenas;
+  int percpu_arena;
+  /*
+   * Blocks of each small size class that explicit_free_list.c keeps
+   * on every CPU (see pcpu.h). At most 64; 0 turns the caches off.
+   */
+  size_t pcpu_cache;
+  /*
+   * The most blocks of each small size class that a thread of
+   * explicit_free_list.c keeps for itself (0 turns thread caches off),
+   * how many blocks are moved at once between a thread cache and the
+   * rest of the heap, and the bytes all thread caches together may hold.
+   * Per-CPU caches take precedence if both are on. The background
+   * thread flushes the caches of threads that have been idle for
+   * TCACHE_IDLE milliseconds.
+   */
+  size_t tcache;
+  size_t tcache_batch;
+  size_t tcache_max;
+  size_t tcache_idle;
+  /*
+   * Allocations of up to this many bytes come from lock-free stacks
+   * in segregated_free_list.c (at most 256; 0 turns them off).
+   */
+  size_t stack_max;
+  /*
+   * Run a background thread in explicit_free_list.c that merges,
+   * purges and trims free blocks every BG_INTERVAL milliseconds,
+   * using no more than BG_BUDGET percent of a CPU.
+   */
+  int background_thread;
+  size_t bg_interval;
+  size_t bg_budget;
+  /*
+   * Keep up to this many bytes from the OS in reserve, so that the
+   * heap can grow without a system call (see headroom.h). 0 turns
+   * that off. With HEADROOM_PREFAULT, the reserve is faulted in, too,
+   * but only by the background thread of explicit_free_list.c.
+   */
+  size_t headroom;
+  int headroom_prefault;
+  /*
+   * Ask for transparent huge pages for the chunks of explicit_free_list.c,
+   * keep large blocks out of the chunks that small blocks are packed in
+   * and only purge whole huge pages.
+   */
+  int thp;
+  /*
+   * Purge the pages of free blocks gradually, over DECAY milliseconds
+   * (0 turns that off; see decay.h). With PURGE_LAZY, pages are purged
+   * with MADV_FREE instead of MADV_DONTNEED.
+   */
+  size_t decay;
+  int purge_lazy;
+  /*
+   * Reserve this many bytes of address space when the heap is first
+   * used and commit them as it grows, instead of growing it with sbrk
+   * or mmap (see backend.h). 0 turns that off.
+   */
+  size_t vm_reserve;
+  /*
+   * Give blocks of this many bytes or more a mapping of their own
+   * in explicit_free_list.c, so that REALLOC can resize them with
+   * mremap instead of copying them. 0 turns that off.
+   */
+  size_t mmap_threshold;
+  /*
+   * Fault in all memory the heap gets from the OS right away, so that
+   * allocations don't take page faults on it later. PREFAULT_HEAP bytes
+   * of heap are set up and faulted in when the heap is first used.
+   */
+  int prefault;
+  size_t prefault_heap;
+} Conf;
+
+static Conf conf = {
+    .fit = SEARCH_MODE,
+    .min_split = sizeof(uint64_t),
+    .classes = {1, 16, 32, 64, 128},
+    .nclasses = 5,
+    .trim_threshold = 0,
+    .leak_report = 0,
+    .prof_sample = 0,
+    .narenas = 0,
+    .percpu_arena = 0,
+    .pcpu_cache = 0,
+    .tcache = 0,
+    .tcache_batch = 8,
+    .tcache_max = 1 << 20,
+    .tcache_idle = 1000,
+    .stack_max = 0,
+    .background_thread = 0,
+    .bg_interval = 100,
+    .bg_budget = 10,
+    .headroom = 0,
+    .headroom_prefault = 0,
+    .thp = 0,
+    .decay = 0,
+    .purge_lazy = 0,
+    .vm_reserve = 0,
+    .mmap_threshold = 0,
+    .prefault = 0,
+    .prefault_heap = 0,
+};
+
+/* How the value of an option is parsed. */
+typedef enum { CONF_SIZE, CONF_BOOL, CONF_FIT, CONF_CLASSES } ConfType;
+
+typedef struct {
+  const char *name;
+  ConfType type;
+  size_t offset; /* Offset of the field in CONF. */
+} ConfOpt;
+
+static const ConfOpt conf_opts[] = {
+    {"fit", CONF_FIT, offsetof(Conf, fit)},
+    {"min_split", CONF_SIZE, offsetof(Conf, min_split)},
+    {"classes", CONF_CLASSES, offsetof(Conf, classes)},
+    {"trim_threshold", CONF_SIZE, offsetof(Conf, trim_threshold)},
+    {"leak_report", CONF_BOOL, offsetof(Conf, leak_report)},
+    {"prof_sample", CONF_SIZE, offsetof(Conf, prof_sample)},
+    {"narenas", CONF_SIZE, offsetof(Conf, narenas)},
+    {"percpu_arena", CONF_BOOL, offsetof(Conf, percpu_arena)},
+    {"pcpu_cache", CONF_SIZE, offsetof(Conf, pcpu_cache)},
+    {"tcache", CONF_SIZE, offsetof(Conf, tcache)},
+    {"tcache_batch", CONF_SIZE, offsetof(Conf, tcache_batch)},
+    {"tcache_max", CONF_SIZE, offsetof(Conf, tcache_max)},
+    {"tcache_idle", CONF_SIZE, offsetof(Conf, tcache_idle)},
+    {"stack_max", CONF_SIZE, offsetof(Conf, stack_max)},
+    {"background_thread", CONF_BOOL, offsetof(Conf, background_thread)},
+    {"bg_interval", CONF_SIZE, offsetof(Conf, bg_interval)},
+    {"bg_budget", CONF_SIZE, offsetof(Conf, bg_budget)},
+    {"headroom", CONF_SIZE, offsetof(Conf, headroom)},
+    {"headroom_prefault", CONF_BOOL, offsetof(Conf, headroom_prefault)},
+    {"thp", CONF_BOOL, offsetof(Conf, thp)},
+    {"decay", CONF_SIZE, offsetof(Conf, decay)},
+    {"purge_lazy", CONF_BOOL, offsetof(Conf, purge_lazy)},
+    {"vm_reserve", CONF_SIZE, offsetof(Conf, vm_reserve)},
+    {"mmap_threshold", CONF_SIZE, offsetof(Conf, mmap_threshold)},
+    {"prefault", CONF_BOOL, offsetof(Conf, prefault)},
+    {"prefault_heap", CONF_SIZE, offsetof(Conf, prefault_heap)},
+};
+
+#define CONF_NOPTS (sizeof(conf_opts) / sizeof(conf_opts[0]))
+
+/* Return the option called NAME (LEN bytes long) or NULL. */
+const ConfOpt *conf_find(const char *name, size_t len) {
+  for (size_t i = 0; i < CONF_NOPTS; i++) {
+    if (strlen(conf_opts[i].name) == len &&
+        strncmp(conf_opts[i].name, name, len) == 0)
+      return &conf_opts[i];
+  }
+  return NULL;
+}
+
+/*
+ * Parse LEN bytes at STR as a size. A size is a decimal number
+ * that may be followed by one of the suffixes k, m or g.
+ * Return 0 on success and -1 if STR isn't a valid size.
+ */
+int conf_parse_size(const char *str, size_t len, size_t *out) {
+  size_t n = 0;
+  size_t i = 0;
+
+  if (len == 0)
+    return -1;
+
+  for (; i < len && str[i] >= '0' && str[i] <= '9'; i++)
+    n = n * 10 + (str[i] - '0');
+
+  if (i == 0)
+    return -1;
+
+  if (i + 1 == len) {
+    switch (str[i]) {
+    case 'k': case 'K': n <<= 10; break;
+    case 'm': case 'M': n <<= 20; break;
+    case 'g': case 'G': n <<= 30; break;
+    default: return -1;
+    }
+  } else if (i != len) {
+    return -1;
+  }
+
+  *out = n;
+  return 0;
+}
+
+/* Parse a boolean: "true" or "false". */
+int conf_parse_bool(const char *str, size_t len, int *out) {
+  if (len == 4 && strncmp(str, "true", 4) == 0)
+    *out = 1;
+  else if (len == 5 && strncmp(str, "false", 5) == 0)
+    *out = 0;
+  else
+    return -1;
+  return 0;
+}
+
+/* Parse a search strategy: "first", "next" or "best". */
+int conf_parse_fit(const char *str, size_t len, int *out) {
+  if (len == 5 && strncmp(str, "first", 5) == 0)
+    *out = FIRST_FIT;
+  else if (len == 4 && strncmp(str, "next", 4) == 0)
+    *out = NEXT_FIT;
+  else if (len == 4 && strncmp(str, "best", 4) == 0)
+    *out = BEST_FIT;
+  else
+    return -1;
+  return 0;
+}
+
+/*
+ * Parse a list of size classes separated by '|', e.g. "1|16|32".
+ * The classes must be strictly ascending and the first one must
+ * be at least one word. CONF is only changed if the whole list is valid.
+ */
+int conf_parse_classes(const char *str, size_t len, Conf *c) {
+  size_t classes[CONF_MAX_CLASSES];
+  int n = 0;
+  size_t i = 0;
+
+  while (i < len) {
+    size_t j = i;
+    while (j < len && str[j] != '|')
+      j++;
+
+    if (n == CONF_MAX_CLASSES)
+      return -1;
+    if (conf_parse_size(str + i, j - i, &classes[n]) < 0)
+      return -1;
+    if (classes[n] == 0 || (n > 0 && classes[n] <= classes[n - 1]))
+      return -1;
+
+    n++;
+    i = j + 1;
+  }
+
+  if (n == 0)
+    return -1;
+
+  memcpy(c->classes, classes, sizeof(classes));
+  c->nclasses = n;
+  return 0;
+}
+
+/* Set the option OPT in C to the LEN bytes at VAL. */
+int conf_set(Conf *c, const ConfOpt *opt, const char *val, size_t len) {
+  void *field = ((char *)c) + opt->offset;
+
+  switch (opt->type) {
+  case CONF_SIZE:
+    return conf_parse_size(val, len, (size_t *)field);
+  case CONF_BOOL:
+    return conf_parse_bool(val, len, (int *)field);
+  case CONF_FIT:
+    return conf_parse_fit(val, len, (int *)field);
+  case CONF_CLASSES:
+    return conf_parse_classes(val, len, c);
+  }
+  return -1;
+}
+
+/*
+ * Apply all options in the string STR to C. Options that are
+ * unknown or have an invalid value are reported and skipped.
+ */
+void conf_parse(Conf *c, const char *str) {
+  while (*str != '\0') {
+    const char *key = str;
+    while (*str != '\0' && *str != ':' && *str != ',')
+      str++;
+    size_t key_len = str - key;
+
+    const char *val = str;
+    size_t val_len = 0;
+    if (*str == ':') {
+      val = ++str;
+      while (*str != '\0' && *str != ',')
+        str++;
+      val_len = str - val;
+    }
+
+    if (key_len > 0) {
+      const ConfOpt *opt = conf_find(key, key_len);
+      if (opt == NULL)
+        dbg("MALLOC_CONF: unknown option '%.*s'\n", (int)key_len, key);
+      else if (conf_set(c, opt, val, val_len) < 0)
+        dbg("MALLOC_CONF: invalid value '%.*s' for '%s'\n", (int)val_len, val,
+            opt->name);
+    }
+
+    if (*str == ',')
+      str++;
+  }
+}
+
+void conf_read_env(void) {
+  const char *env = getenv("MALLOC_CONF");
+  if (env != NULL)
+    conf_parse(&conf, env);
+}
+
+/* Read MALLOC_CONF once. Call this before using CONF. */
+void conf_init(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, conf_read_env);
+}
+
+#endif /* __CONF_H_ */
@@ -0,0 +1,261 @@
+#ifndef __CTL_H_
+#define __CTL_H_
+
+#include <errno.h>  /* ENOENT, EINVAL, EPERM */
+#include <stddef.h> /* size_t, ptrdiff_t */
+#include <string.h> /* memcpy, strcmp, strncmp */
+
+#include "conf.h"
+
+/*
+ * A namespaced interface to read and change the state of an allocator
+ * at runtime. It works like jemalloc's mallctl(3). Every allocator
+ * defines
+ *
+ *   int mallctl(const char *name, void *oldp, size_t *oldlenp,
+ *               void *newp, size_t newlen);
+ *
+ * If OLDP is not NULL, the current value of NAME is copied to it and
+ * *OLDLENP must be the size of the value. If NEWP is not NULL, NAME is
+ * set to the NEWLEN bytes at NEWP. Commands like "arena.0.purge" take
+ * neither. 0 is returned on success, otherwise ENOENT (unknown name),
+ * EINVAL (wrong size or value) or EPERM (read-only).
+ *
+ * Names under "opt." are the options from conf.h and are shared by
+ * all allocators. Most of them are read-only (see CTL_OPT_WRITABLE).
+ * The rest comes from a table in each allocator.
+ */
+
+/*
+ * Handler of a name. IDX is the number that took
+ * the place of '#' in the name, if there is one.
+ */
+typedef int (*CtlFn)(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                     size_t newlen);
+
+typedef struct {
+  const char *name; /* A '#' matches a decimal number, e.g. "arena.#.purge" */
+  CtlFn fn;
+} CtlEntry;
+
+#define CTL_LEN(table) (sizeof(table) / sizeof(table[0]))
+
+/*
+ * Return 1 if NAME matches PATTERN and 0 otherwise. The
+ * number that matches a '#' in PATTERN is stored in IDX.
+ */
+int ctl_match(const char *pattern, const char *name, size_t *idx) {
+  while (*pattern != '\0') {
+    if (*pattern == '#') {
+      if (*name < '0' || *name > '9')
+        return 0;
+      *idx = 0;
+      while (*name >= '0' && *name <= '9')
+        *idx = *idx * 10 + (*name++ - '0');
+      pattern++;
+    } else if (*pattern++ != *name++) {
+      return 0;
+    }
+  }
+  return *name == '\0';
+}
+
+/* Copy the value VAL of LEN bytes to OLDP if the caller asked for it. */
+int ctl_read(void *oldp, size_t *oldlenp, const void *val, size_t len) {
+  if (oldp == NULL)
+    return 0;
+  if (oldlenp == NULL || *oldlenp != len)
+    return EINVAL;
+  memcpy(oldp, val, len);
+  return 0;
+}
+
+/* Copy the new value at NEWP to VAL if the caller passed one. */
+int ctl_write(void *newp, size_t newlen, void *val, size_t len) {
+  if (newp == NULL)
+    return 0;
+  if (newlen != len)
+    return EINVAL;
+  memcpy(val, newp, len);
+  return 0;
+}
+
+/* Handler for values that can't be changed. */
+int ctl_read_only(void *oldp, size_t *oldlenp, void *newp, const void *val,
+                  size_t len) {
+  if (newp != NULL)
+    return EPERM;
+  return ctl_read(oldp, oldlenp, val, len);
+}
+
+/*
+ * The options that can be changed while the heap is in use. The
+ * others decide how the heap is laid out or which caches and threads
+ * exist, and other threads read them without a lock, so they are
+ * read-only, like jemalloc's "opt." names. These two are only
+ * compared against block sizes, so a new value takes effect on the
+ * next allocation or free.
+ */
+static const char *const ctl_opt_writable[] = {"trim_threshold",
+                                               "mmap_threshold"};
+
+/* Return 1 if the option NAME can be written and 0 otherwise. */
+int ctl_opt_is_writable(const char *name) {
+  for (size_t i = 0; i < CTL_LEN(ctl_opt_writable); i++) {
+    if (strcmp(ctl_opt_writable[i], name) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Read or write the option NAME from conf.h. Sizes are size_t,
+ * booleans (0 or 1) and "fit" are ints. "classes" is an array of
+ * size_t; its size in bytes is stored in *OLDLENP. Writing an option
+ * that isn't in CTL_OPT_WRITABLE fails with EPERM.
+ */
+int ctl_opt(const char *name, void *oldp, size_t *oldlenp, void *newp,
+            size_t newlen) {
+  const ConfOpt *opt = conf_find(name, strlen(name));
+  if (opt == NULL)
+    return ENOENT;
+  if (newp != NULL && !ctl_opt_is_writable(name))
+    return EPERM;
+
+  void *field = ((char *)&conf) + opt->offset;
+
+  switch (opt->type) {
+  case CONF_SIZE: {
+    size_t old = *(size_t *)field;
+    if (newp != NULL) {
+      if (newlen != sizeof(size_t))
+        return EINVAL;
+      /* Other threads read it without a lock. */
+      __atomic_store_n((size_t *)field, *(size_t *)newp, __ATOMIC_RELAXED);
+    }
+    return ctl_read(oldp, oldlenp, &old, sizeof(size_t));
+  }
+  case CONF_BOOL:
+  case CONF_FIT:
+    return ctl_read(oldp, oldlenp, field, sizeof(int));
+  case CONF_CLASSES: {
+    size_t len = conf.nclasses * sizeof(size_t);
+    if (oldp != NULL && (oldlenp == NULL || *oldlenp < len))
+      return EINVAL;
+    if (oldp != NULL) {
+      memcpy(oldp, conf.classes, len);
+      *oldlenp = len;
+    }
+    return 0;
+  }
+  }
+  return ENOENT;
+}
+
+/* Numbers that every allocator reports under "stats.". */
+typedef struct {
+  size_t allocated; /* Bytes in used blocks (without headers). */
+  size_t free;      /* Bytes in free blocks (without headers). */
+  size_t mapped;    /* Bytes the heap got from the OS. */
+} HeapStats;
+
+/*
+ * Every allocator implements these. PURGE_ARENA releases the pages
+ * inside free blocks and TRIM_ARENA gives free memory at the top of
+ * the heap back to the OS. DECAY_ARENA purges as many pages as the
+ * "decay" option calls for right now (see decay.h). All return the
+ * number of bytes released, or -1 if there is no arena IDX.
+ */
+void heap_stats(HeapStats *st);
+ptrdiff_t purge_arena(size_t idx);
+ptrdiff_t trim_arena(size_t idx);
+ptrdiff_t decay_arena(size_t idx);
+
+int ctl_stats_allocated(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                        size_t newlen) {
+  (void)idx, (void)newlen;
+  HeapStats st;
+  heap_stats(&st);
+  return ctl_read_only(oldp, oldlenp, newp, &st.allocated, sizeof(size_t));
+}
+
+int ctl_stats_free(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                   size_t newlen) {
+  (void)idx, (void)newlen;
+  HeapStats st;
+  heap_stats(&st);
+  return ctl_read_only(oldp, oldlenp, newp, &st.free, sizeof(size_t));
+}
+
+int ctl_stats_mapped(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                     size_t newlen) {
+  (void)idx, (void)newlen;
+  HeapStats st;
+  heap_stats(&st);
+  return ctl_read_only(oldp, oldlenp, newp, &st.mapped, sizeof(size_t));
+}
+
+/* The number of bytes released is returned through OLDP. */
+int ctl_arena_purge(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                    size_t newlen) {
+  (void)newlen;
+  if (newp != NULL)
+    return EPERM;
+  ptrdiff_t released = purge_arena(idx);
+  if (released < 0)
+    return ENOENT;
+  size_t n = released;
+  return ctl_read(oldp, oldlenp, &n, sizeof(size_t));
+}
+
+int ctl_arena_trim(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                   size_t newlen) {
+  (void)newlen;
+  if (newp != NULL)
+    return EPERM;
+  ptrdiff_t released = trim_arena(idx);
+  if (released < 0)
+    return ENOENT;
+  size_t n = released;
+  return ctl_read(oldp, oldlenp, &n, sizeof(size_t));
+}
+
+int ctl_arena_decay(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                    size_t newlen) {
+  (void)newlen;
+  if (newp != NULL)
+    return EPERM;
+  ptrdiff_t released = decay_arena(idx);
+  if (released < 0)
+    return ENOENT;
+  size_t n = released;
+  return ctl_read(oldp, oldlenp, &n, sizeof(size_t));
+}
+
+/* The names that all allocators have. Put this in their CtlEntry tables. */
+#define CTL_COMMON                                                             \
+  {"stats.allocated", ctl_stats_allocated}, {"stats.free", ctl_stats_free},    \
+      {"stats.mapped", ctl_stats_mapped},                                      \
+      {"arena.#.purge", ctl_arena_purge}, {"arena.#.trim", ctl_arena_trim},    \
+      {"arena.#.decay", ctl_arena_decay}
+
+/* Look NAME up in TABLE (of N entries) and call its handler. */
+int ctl_dispatch(const CtlEntry *table, size_t n, const char *name,
+                 void *oldp, size_t *oldlenp, void *newp, size_t newlen) {
+  if (name == NULL)
+    return ENOENT;
+
+  conf_init();
+
+  if (strncmp(name, "opt.", 4) == 0)
+    return ctl_opt(name + 4, oldp, oldlenp, newp, newlen);
+
+  for (size_t i = 0; i < n; i++) {
+    size_t idx = 0;
+    if (ctl_match(table[i].name, name, &idx))
+      return table[i].fn(idx, oldp, oldlenp, newp, newlen);
+  }
+  return ENOENT;
+}
+
+#endif /* __CTL_H_ */
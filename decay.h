@@ -0,0 +1,109 @@
+#ifndef __DECAY_H_
+#define __DECAY_H_
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint64_t */
+#include <string.h> /* memmove, memset */
+#include <time.h>   /* clock_gettime */
+
+#include "conf.h"
+#include "os.h"
+
+/*
+ * Decay. Purging the pages of free blocks right away means that the
+ * next allocations that get those blocks fault the pages in again.
+ * Never purging them keeps memory that the program might not need
+ * anymore. With the "decay" option, pages are purged gradually
+ * instead, like jemalloc's "dirty_decay_ms" does it.
+ *
+ * Time is divided into DECAY_EPOCHS epochs per "decay" milliseconds.
+ * Of the bytes that were freed K epochs ago, the share that may stay
+ * unpurged falls along a smooth curve, from all of them (K = 0) to
+ * none (K = DECAY_EPOCHS). Together, these shares give the number of
+ * dirty bytes that may be left. The allocators count the whole pages
+ * of every block they free with DECAY_FREED. Once per epoch, DECAY_DUE
+ * returns 1, and they purge free blocks until no more than DECAY_LIMIT
+ * dirty bytes are left.
+ *
+ * Pages are purged with MADV_DONTNEED, or with MADV_FREE if the
+ * "purge_lazy" option is set. The kernel takes pages of the latter
+ * kind only when it runs low on memory, so it's cheaper if they are
+ * used again soon.
+ */
+
+#define DECAY_EPOCHS 32
+
+typedef struct {
+  uint64_t epoch;   /* When the current epoch began, in nanoseconds. */
+  uint64_t checked; /* The epoch of the last call to DECAY_DUE. */
+  /* Bytes freed in the current epoch ([0]) and in the ones before. */
+  size_t freed[DECAY_EPOCHS];
+} Decay;
+
+uint64_t decay_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t decay_epoch_ns(void) {
+  uint64_t ns = conf.decay * 1000000ull / DECAY_EPOCHS;
+  return ns > 0 ? ns : 1;
+}
+
+/* Move D forward to NOW, dropping what was freed too long ago. */
+void decay_advance(Decay *d, uint64_t now) {
+  if (d->epoch == 0 || now < d->epoch) {
+    d->epoch = now;
+    return;
+  }
+
+  uint64_t n = (now - d->epoch) / decay_epoch_ns();
+  if (n == 0)
+    return;
+  if (n >= DECAY_EPOCHS) {
+    memset(d->freed, 0, sizeof(d->freed));
+  } else {
+    memmove(&d->freed[n], d->freed, (DECAY_EPOCHS - n) * sizeof(size_t));
+    memset(d->freed, 0, n * sizeof(size_t));
+  }
+  d->epoch += n * decay_epoch_ns();
+}
+
+/* Count BYTES in whole pages that were freed at NOW. */
+void decay_freed(Decay *d, size_t bytes, uint64_t now) {
+  decay_advance(d, now);
+  d->freed[0] += bytes;
+}
+
+/* Return 1 if a new epoch has begun since the last call. */
+int decay_due(Decay *d, uint64_t now) {
+  decay_advance(d, now);
+  if (d->checked == d->epoch)
+    return 0;
+  d->checked = d->epoch;
+  return 1;
+}
+
+/* The number of dirty bytes that may stay unpurged at NOW. */
+size_t decay_limit(Decay *d, uint64_t now) {
+  decay_advance(d, now);
+
+  /* 1 - smoothstep(K / E) = (E^3 - 3 K^2 E + 2 K^3) / E^3 */
+  const uint64_t e = DECAY_EPOCHS;
+  size_t limit = 0;
+  for (uint64_t k = 0; k < DECAY_EPOCHS; k++) {
+    uint64_t share = e * e * e - 3 * k * k * e + 2 * k * k * k;
+    limit += d->freed[k] * share / (e * e * e);
+  }
+  return limit;
+}
+
+/* Purge the whole pages in the range of LEN bytes at START. */
+size_t decay_purge(void *start, size_t len) {
+  if (conf.purge_lazy)
+    return lazy_purge_pages(start, len);
+  return purge_pages(start, len);
+}
+
+#endif /* __DECAY_H_ */
@@ -4,13 +4,31 @@
  * Thassilo Schulze, 03/03/2024
  */
 
-#include <assert.h> /* assert */
-#include <stddef.h> /* ptrdiff_t, size_t, NULL */
-#include <stdint.h> /* intptr_t */
-#include <string.h> /* memcpy */
-#include <unistd.h> /* sbrk */
+#define _GNU_SOURCE /* dladdr, sched_getcpu */
 
+#include <assert.h>     /* assert */
+#include <pthread.h>    /* pthread_create */
+#include <sched.h>      /* sched_getcpu */
+#include <stdatomic.h>  /* atomic_size_t */
+#include <stddef.h>     /* ptrdiff_t, size_t, NULL */
+#include <stdint.h>     /* intptr_t */
+#include <string.h>     /* memcpy */
+#include <sys/mman.h>   /* mmap, munmap */
+#include <sys/wait.h>   /* waitpid */
+#include <time.h>       /* clock_gettime */
+#include <unistd.h>     /* sysconf */
+
+#include "backend.h"
+#include "conf.h"
+#include "ctl.h"
 #include "dbg.h"
+#include "decay.h"
+#include "headroom.h"
+#include "mutex.h"
+#include "os.h"
+#include "pcpu.h"
+#include "report.h"
+#include "shared.h"
 
 typedef intptr_t word_t;
 
@@ -21,7 +39,7 @@ struct BlockHdr {
   BlockHdr *prev;
   /*
    * NEXT points in the direction of the block that was added
-   * most recently. This means, "it points towards GLOBAL_FREE_LIST"
+   * most recently. This means, "it points towards FREE_LIST"
    * (so to speak) since that's where blocks are added. If a block
    * is the first one in the list, NEXT is NULL. If it's the last
    * one, PREV is NULL.
@@ -30,22 +48,332 @@ struct BlockHdr {
    *
    *   prev   next     prev   next     prev   next
    * +------+------+ +------+------+ +------+------+
-   * | NULL |      | |      |      | |      | NULL |  <- GLOBAL_FREE_LIST
+   * | NULL |      | |      |      | |      | NULL |  <- FREE_LIST
    * +------+------+ +------+------+ +------+------+
    *            ^-------^       ^-------^
    */
+  int purged; /* Set if the block is free and its pages were purged. */
+};
+
+/*
+ * Arenas. Each arena is a heap of its own, with its own lock, free
+ * list and memory from the OS. Threads are spread over the arenas,
+ * so they rarely have to wait for each other.
+ *
+ * Arenas get memory from the OS in chunks. A chunk is CHUNK_SIZE
+ * bytes large and aligned to CHUNK_SIZE. It starts with a header that
+ * points to the arena that owns it. Blocks are carved out of the rest
+ * of the chunk, from the bottom up. So, rounding the address of a
+ * block down to a multiple of CHUNK_SIZE gives the header of its
+ * chunk. That's how a block finds its way back into the arena it came
+ * from, no matter which thread frees it. A block that doesn't fit
+ * into a chunk gets a chunk of its own, which is MAPPED for it alone
+ * (see MAP_HUGE_BLOCK). Nothing else is ever carved from it, since
+ * the header of a block past its first CHUNK_SIZE bytes couldn't be
+ * found.
+ *
+ * A chunk is as large as a transparent huge page, so with the "thp"
+ * option, every chunk can be backed by huge pages. Then, a block of
+ * THP_LARGE bytes or more is carved from a chunk of its own kind, so
+ * that small blocks are packed into as few huge pages (and TLB
+ * entries) as possible. Purging leaves alone huge pages that are
+ * only partly free.
+ *
+ * With the "mmap_threshold" option, large blocks get a chunk of their
+ * own instead, which is MAPPED for them alone and belongs to no arena
+ * (see MAP_BLOCK).
+ */
+
+#define CHUNK_SIZE HUGE_PAGE_SIZE
+#define THP_LARGE ((size_t)16 << 10)
+#define ARENA_MAX 64
+
+typedef struct Arena Arena;
+typedef struct Chunk Chunk;
+
+struct Chunk {
+  Arena *arena; /* Owner of this chunk. */
+  Chunk *next;  /* The next chunk of the same arena. */
+  size_t size;  /* Bytes mapped for this chunk, including the header. */
+  char *top;    /* End of the last block. Above is unused memory. */
+  char *dirty;  /* Memory from TOP up to here may still be in use. */
+  int mapped;   /* Set if the chunk holds a single block of its own. */
+  int large;    /* Set if it's in the arena's LARGE list ("thp"). */
+};
+
+struct Arena {
+  Mutex lock;
+  BlockHdr *free_list; /* Doubly linked list of unused blocks. */
+  Chunk *chunks;       /* New blocks are carved from the first chunk. */
+  Chunk *large;        /* The same for large blocks, with "thp". */
+  Chunk *huge;         /* Chunks of blocks that don't fit into one. */
+  /*
+   * Blocks that threads of other arenas have freed. This is a stack
+   * that is pushed to without holding LOCK (see REMOTE_FREE).
+   */
+  _Atomic(BlockHdr *) remote_frees;
+  Decay decay; /* Bytes freed over time, for the "decay" option. */
+  int created; /* Set if ARENA_CREATE made it (see there). */
 };
 
-/* Doubly linked list of unused blocks. */
-static BlockHdr *global_free_list = NULL;
-/* The first block on the heap. */
-static BlockHdr *init = NULL;
+static Arena arenas[ARENA_MAX];
+/* The number of arenas in use. */
+static size_t narenas = 0;
+/* The arena of this thread. It's picked on its first allocation. */
+static __thread Arena *thread_arena = NULL;
+/* The created arena that serves this thread's allocations, if any. */
+static __thread Arena *scope_arena = NULL;
+/* Set while the background thread runs (see BACKGROUND_MAIN). */
+static atomic_int background_running = 0;
+
+/* Defined further down. */
+void prefault_arenas(void);
+word_t *arena_alloc(Arena *arena, ptrdiff_t size);
+
+void setup_arenas(void) {
+  conf_init();
+
+  narenas = conf.narenas;
+  if (narenas == 0)
+    narenas = sysconf(_SC_NPROCESSORS_ONLN);
+  if (narenas < 1)
+    narenas = 1;
+  if (narenas > ARENA_MAX)
+    narenas = ARENA_MAX;
+
+  for (size_t i = 0; i < ARENA_MAX; i++)
+    mutex_init(&arenas[i].lock);
+  if (conf.prefault_heap > 0)
+    prefault_arenas();
+}
+
+void init_arenas(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, setup_arenas);
+}
+
+/*
+ * Return the arena that the calling thread allocates from.
+ * Threads are assigned round-robin, or, with the "percpu_arena"
+ * option, each allocation uses the arena of the current CPU.
+ */
+Arena *choose_arena(void) {
+  static atomic_size_t next_arena = 0;
+
+  if (conf.percpu_arena) {
+    int cpu = sched_getcpu();
+    if (cpu >= 0)
+      return &arenas[cpu % narenas];
+  }
+
+  if (thread_arena == NULL)
+    thread_arena = &arenas[atomic_fetch_add(&next_arena, 1) % narenas];
+  return thread_arena;
+}
+
+/*
+ * Chunks can come from a backend (see backend.h). With the
+ * "vm_reserve" option, they are carved from a range of address space
+ * that is reserved when the first chunk is needed, from the bottom up.
+ * Mapping a chunk then costs one mprotect, and chunks don't end up
+ * between other mappings. A chunk that goes back below the top of the
+ * range is released and left as a hole, which later chunks are taken
+ * from before the range grows. When the top chunk goes back, the break
+ * goes down past the holes right below it, too. The whole range is
+ * released once all of its chunks are back. If the range is used up,
+ * chunks come from mmap again. A backend that is set with
+ * SET_CHUNK_BACKEND is all the memory there is, though.
+ */
+static Mutex reserve_lock = MUTEX_INITIALIZER;
+static Backend default_chunk_backend;
+static Backend *chunk_backend = NULL;
+/* Bytes of CHUNK_BACKEND that chunks use. */
+static size_t reserve_used = 0;
+
+/*
+ * The holes below the break of CHUNK_BACKEND, by address. Adjacent
+ * holes are merged. A hole that doesn't fit in anymore is lost until
+ * the whole range is released.
+ */
+#define RESERVE_HOLES 64
+
+typedef struct {
+  char *start;
+  size_t size;
+} ReserveHole;
+
+static ReserveHole reserve_holes[RESERVE_HOLES];
+static size_t reserve_nholes = 0;
+
+/* Remove hole I. */
+void remove_reserve_hole(size_t i) {
+  memmove(&reserve_holes[i], &reserve_holes[i + 1],
+          (reserve_nholes - i - 1) * sizeof(ReserveHole));
+  reserve_nholes--;
+}
+
+/* Add the SIZE bytes at START to the holes. */
+void add_reserve_hole(char *start, size_t size) {
+  size_t i = 0;
+  while (i < reserve_nholes && reserve_holes[i].start < start)
+    i++;
+  ReserveHole *prev = i > 0 ? &reserve_holes[i - 1] : NULL;
+  ReserveHole *next = i < reserve_nholes ? &reserve_holes[i] : NULL;
+
+  if (prev != NULL && prev->start + prev->size == start) {
+    prev->size += size;
+    if (next != NULL && start + size == next->start) {
+      prev->size += next->size;
+      remove_reserve_hole(i);
+    }
+  } else if (next != NULL && start + size == next->start) {
+    next->start = start;
+    next->size += size;
+  } else if (reserve_nholes < RESERVE_HOLES) {
+    memmove(&reserve_holes[i + 1], &reserve_holes[i],
+            (reserve_nholes - i) * sizeof(ReserveHole));
+    reserve_holes[i] = (ReserveHole){start, size};
+    reserve_nholes++;
+  }
+}
+
+/* Take SIZE bytes from the first hole that is large enough, or NULL. */
+char *take_reserve_hole(Backend *b, size_t size) {
+  for (size_t i = 0; i < reserve_nholes; i++) {
+    ReserveHole *h = &reserve_holes[i];
+    if (h->size < size)
+      continue;
+    char *start = h->start;
+    if (b->ops->commit(b, start, size) != 0)
+      return NULL;
+    h->start += size;
+    h->size -= size;
+    if (h->size == 0)
+      remove_reserve_hole(i);
+    return start;
+  }
+  return NULL;
+}
+
+/* Take SIZE bytes (a multiple of CHUNK_SIZE) from the backend, or NULL. */
+char *reserve_chunk(size_t size) {
+  mutex_lock(&reserve_lock);
+  if (chunk_backend == NULL && conf.vm_reserve > 0) {
+    default_chunk_backend =
+        mmap_backend((conf.vm_reserve + CHUNK_SIZE - 1) & ~(CHUNK_SIZE - 1));
+    chunk_backend = &default_chunk_backend;
+  }
+  Backend *b = chunk_backend;
+  char *start = NULL;
+  if (b != NULL && (b->base != NULL || b->ops->reserve(b, CHUNK_SIZE) == 0)) {
+    start = take_reserve_hole(b, size);
+    if (start == NULL) {
+      start = b->ops->grow(b, size);
+      if (start != (char *)-1 && ((uintptr_t)start & (CHUNK_SIZE - 1)) != 0) {
+        /* Someone else has moved the program break. */
+        b->ops->shrink(b, start);
+        start = (char *)-1;
+      }
+      if (start == (char *)-1)
+        start = NULL;
+    }
+    if (start != NULL)
+      reserve_used += size;
+  }
+  mutex_unlock(&reserve_lock);
+  return start;
+}
+
+/* Give the chunk of SIZE bytes at START back to the OS. */
+void unmap_chunk(void *start, size_t size) {
+  char *c = start;
+  mutex_lock(&reserve_lock);
+  Backend *b = chunk_backend;
+  if (b != NULL && b->base != NULL && c >= b->base && c < b->brk) {
+    reserve_used -= size;
+    if (reserve_used == 0) {
+      b->ops->shrink(b, b->base);
+      reserve_nholes = 0;
+    } else if (c + size == b->brk) {
+      /* A hole right below C is now at the top. */
+      ReserveHole *last =
+          reserve_nholes > 0 ? &reserve_holes[reserve_nholes - 1] : NULL;
+      if (last != NULL && last->start + last->size == c) {
+        c = last->start;
+        reserve_nholes--;
+      }
+      b->ops->shrink(b, c);
+    } else {
+      b->ops->release(b, c, size);
+      add_reserve_hole(c, size);
+    }
+  } else {
+    munmap(start, size);
+  }
+  mutex_unlock(&reserve_lock);
+}
+
+/*
+ * Take chunks from B from now on, or from the default backend if B
+ * is NULL. This fails (returning -1) while chunks of the current
+ * backend are in use.
+ */
+int set_chunk_backend(Backend *b) {
+  mutex_lock(&reserve_lock);
+  int err = -1;
+  if (reserve_used == 0) {
+    if (chunk_backend != NULL)
+      chunk_backend->ops->destroy(chunk_backend);
+    chunk_backend = b;
+    err = 0;
+  }
+  mutex_unlock(&reserve_lock);
+  return err;
+}
+
+/* Defined further down. */
+void clear_huge_blocks(Arena *arena);
+
+/* The first chunk of ARENA, going through CHUNKS and then LARGE. */
+Chunk *first_chunk(Arena *arena) {
+  return arena->chunks != NULL ? arena->chunks : arena->large;
+}
+
+/* The chunk of ARENA after CHUNK, in the order of FIRST_CHUNK. */
+Chunk *next_chunk(Arena *arena, Chunk *chunk) {
+  if (chunk->next == NULL && !chunk->large)
+    return arena->large;
+  return chunk->next;
+}
+
+/* Unmap all chunks of ARENA, which frees all of its blocks at once. */
+void clear_arena(Arena *arena) {
+  Chunk *chunk = first_chunk(arena);
+  while (chunk != NULL) {
+    Chunk *next = next_chunk(arena, chunk);
+    unmap_chunk(chunk, chunk->size);
+    chunk = next;
+  }
+  arena->chunks = NULL;
+  arena->large = NULL;
+  clear_huge_blocks(arena);
+  arena->free_list = NULL;
+  arena->remote_frees = NULL;
+  arena->decay = (Decay){0};
+}
 
+/*
+ * Give all memory back to the OS. This is for tests;
+ * no other thread may use the heap at the same time.
+ */
 void reset_heap(void) {
-  if (init != NULL)
-    brk(init);
-  init = NULL;
-  global_free_list = NULL;
+  for (size_t i = 0; i < ARENA_MAX; i++)
+    clear_arena(&arenas[i]);
+  if (pcpu_caches != NULL)
+    memset(pcpu_caches, 0, pcpu_ncpus * sizeof(PcpuCache));
+  /* Spare chunks might still be in the reserve. */
+  if (reserve_used == 0 && chunk_backend == &default_chunk_backend)
+    set_chunk_backend(NULL);
 }
 
 /* Return a pointer to the memory allocated for the given block header. */
@@ -57,6 +385,14 @@ word_t *user_mem(BlockHdr *blk) {
 /* Return a pointer to the block header of the given memory pointer. */
 BlockHdr *mem_hdr(word_t *mem) { return ((BlockHdr *)mem) - 1; }
 
+/* Return the chunk that contains BLK. */
+Chunk *chunk_of(BlockHdr *blk) {
+  return (Chunk *)((uintptr_t)blk & ~(CHUNK_SIZE - 1));
+}
+
+/* Return the arena that owns BLK. */
+Arena *arena_of(BlockHdr *blk) { return chunk_of(blk)->arena; }
+
 /* Add a block to the front of a list. */
 void add_block(BlockHdr *blk, BlockHdr **list) {
   assert(blk != NULL);
@@ -101,6 +437,16 @@ void remove_block(BlockHdr *blk, BlockHdr **list) {
     next->prev = prev;
   if (prev != NULL)
     prev->next = next;
+
+  /* Links point nowhere while the block isn't in a list. */
+  blk->next = NULL;
+  blk->prev = NULL;
+}
+
+/* Check if BLK is in the free list of its arena. */
+int is_free(BlockHdr *blk) {
+  return blk->next != NULL || blk->prev != NULL ||
+         blk == arena_of(blk)->free_list;
 }
 
 /*
@@ -109,12 +455,18 @@ void remove_block(BlockHdr *blk, BlockHdr **list) {
  * that has enough bytes is returned. If there is no such block,
  * NULL is returned.
  */
-BlockHdr *find_block(ptrdiff_t size) {
-  BlockHdr *blk = global_free_list;
+BlockHdr *find_block(Arena *arena, ptrdiff_t size) {
+  BlockHdr *blk = arena->free_list;
   BlockHdr *best_blk = NULL;
+  /* Purged blocks would have to be faulted in again, so they come last. */
+  BlockHdr *best_purged = NULL;
 
   while (blk != NULL) {
-    if (blk->size == size) {
+    if (blk->purged) {
+      if (blk->size >= size &&
+          (best_purged == NULL || blk->size < best_purged->size))
+        best_purged = blk;
+    } else if (blk->size == size) {
       return blk;
     } else if (blk->size > size) {
       if (best_blk == NULL || blk->size < best_blk->size) {
@@ -124,7 +476,7 @@ BlockHdr *find_block(ptrdiff_t size) {
     blk = blk->prev;
   }
 
-  return best_blk;
+  return best_blk != NULL ? best_blk : best_purged;
 }
 
 /*
@@ -138,11 +490,12 @@ void split_block(BlockHdr *blk, ptrdiff_t size) {
   assert(blk->size >= size);
 
   ptrdiff_t real_size = sizeof(BlockHdr) + size;
-  if ((size_t)blk->size < real_size + sizeof(word_t))
+  if ((size_t)blk->size < real_size + conf.min_split)
     return;
 
   BlockHdr *rem = (BlockHdr *)(((ptrdiff_t)blk) + real_size);
   rem->size = blk->size - real_size;
+  rem->purged = blk->purged;
   blk->size = size;
 
   /*
@@ -152,71 +505,492 @@ void split_block(BlockHdr *blk, ptrdiff_t size) {
   rem->prev = blk->prev;
   blk->prev = rem;
   rem->next = blk;
+  if (rem->prev != NULL)
+    rem->prev->next = rem;
+}
+
+/* Map SIZE bytes (a multiple of the page size) aligned to CHUNK_SIZE. */
+char *mmap_aligned(size_t size) {
+  /*
+   * mmap only guarantees page alignment. So, map CHUNK_SIZE more
+   * bytes than needed and cut off what's around the aligned chunk.
+   */
+  char *map = mmap(NULL, size + CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+  char *start = (char *)(((uintptr_t)map + CHUNK_SIZE - 1) & ~(CHUNK_SIZE - 1));
+  if (start != map)
+    munmap(map, start - map);
+  munmap(start + size, (map + CHUNK_SIZE) - start);
+  return start;
+}
+
+/* Map SIZE bytes (a multiple of CHUNK_SIZE) for a chunk. */
+char *map_aligned(size_t size) {
+  char *start = NULL;
+  if (conf.vm_reserve > 0 || chunk_backend != NULL)
+    start = reserve_chunk(size);
+  if (start == NULL &&
+      (chunk_backend == NULL || chunk_backend == &default_chunk_backend))
+    start = mmap_aligned(size);
+  if (start != NULL && conf.thp)
+    advise_huge_pages(start, size);
+  if (start != NULL && conf.prefault)
+    prefault_pages(start, size);
+  return start;
+}
+
+/*
+ * Spare chunks. With the "headroom" option, the background thread maps
+ * chunks ahead of time (see headroom.h), so that an arena that runs out
+ * of room rarely has to wait for mmap. Spares are linked through their
+ * first word.
+ */
+static Mutex spare_lock = MUTEX_INITIALIZER;
+static void *spare_chunks = NULL;
+static size_t nspare = 0;
+static Headroom headroom = {0, 0};
+
+/* Take a spare chunk if there is one. */
+char *take_spare_chunk(void) {
+  mutex_lock(&spare_lock);
+  char *chunk = spare_chunks;
+  if (chunk != NULL) {
+    spare_chunks = *(void **)chunk;
+    nspare--;
+  }
+  headroom.used += CHUNK_SIZE;
+  mutex_unlock(&spare_lock);
+  return chunk;
+}
+
+/*
+ * Bring the number of spare chunks up (or down) to what the
+ * growth of the heap since the last call asks for.
+ */
+void refill_spare_chunks(void) {
+  if (conf.headroom == 0)
+    return;
+
+  mutex_lock(&spare_lock);
+  size_t target = headroom_target(&headroom, CHUNK_SIZE) / CHUNK_SIZE;
+  while (nspare > target) {
+    char *chunk = spare_chunks;
+    spare_chunks = *(void **)chunk;
+    nspare--;
+    unmap_chunk(chunk, CHUNK_SIZE);
+  }
+  size_t missing = target - nspare;
+  mutex_unlock(&spare_lock);
+
+  /* Map outside of the lock, so arenas can take spares meanwhile. */
+  for (size_t i = 0; i < missing; i++) {
+    char *chunk = map_aligned(CHUNK_SIZE);
+    if (chunk == NULL)
+      break;
+    headroom_prefault(chunk, CHUNK_SIZE);
+    mutex_lock(&spare_lock);
+    *(void **)chunk = spare_chunks;
+    spare_chunks = chunk;
+    nspare++;
+    mutex_unlock(&spare_lock);
+  }
+}
+
+/*
+ * Map a new chunk for ARENA and make it the chunk that blocks are
+ * carved from, or, if LARGE is set, the chunk that large blocks are
+ * carved from. What's left in the chunk it replaces becomes a free
+ * block. Return NULL to signal "Out of memory".
+ */
+Chunk *map_chunk(Arena *arena, int large) {
+  size_t chunk_size = CHUNK_SIZE;
+
+  char *start = NULL;
+  if (conf.headroom > 0)
+    start = take_spare_chunk();
+  if (start == NULL)
+    start = map_aligned(chunk_size);
+  if (start == NULL)
+    return NULL;
+
+  Chunk *old = large ? arena->large : arena->chunks;
+  if (old != NULL) {
+    size_t rest = ((char *)old + old->size) - old->top;
+    if (rest >= sizeof(BlockHdr) + sizeof(word_t)) {
+      BlockHdr *blk = (BlockHdr *)old->top;
+      blk->size = rest - sizeof(BlockHdr);
+      blk->purged = 0;
+      old->top += rest;
+      old->dirty = old->top;
+      add_block(blk, &arena->free_list);
+    }
+  }
+
+  Chunk *chunk = (Chunk *)start;
+  chunk->arena = arena;
+  chunk->size = chunk_size;
+  chunk->top = (char *)(chunk + 1);
+  chunk->dirty = chunk->top;
+  chunk->mapped = 0;
+  /* Small blocks are never carved from a chunk for large ones. */
+  chunk->large = large;
+  Chunk **list = large ? &arena->large : &arena->chunks;
+  chunk->next = *list;
+  *list = chunk;
+  return chunk;
+}
+
+/*
+ * With the "prefault_heap" option, give every arena a chunk with its
+ * share of that many bytes when the heap is first used, and fault the
+ * chunks in. Then, the first allocations take no page faults.
+ */
+void prefault_arenas(void) {
+  size_t share = conf.prefault_heap / narenas;
+  for (size_t i = 0; i < narenas; i++) {
+    mutex_lock(&arenas[i].lock);
+    /* All but the last chunk become free blocks. */
+    for (size_t mapped = 0; mapped < share; mapped += CHUNK_SIZE) {
+      Chunk *chunk = map_chunk(&arenas[i], 0);
+      if (chunk == NULL)
+        break;
+      prefault_pages(chunk, chunk->size);
+    }
+    mutex_unlock(&arenas[i].lock);
+  }
 }
 
 /*
  * Request memory from the OS to allocate SIZE bytes plus
  * the bytes that are occupied by the block metadata.
+ * The block is carved from the current chunk of ARENA (for
+ * its size), and a new chunk is mapped if it doesn't fit.
  * Return that memory or NULL to signal "Out of memory".
  */
-BlockHdr *request_block_from_os(ptrdiff_t size) {
+BlockHdr *request_block_from_os(Arena *arena, ptrdiff_t size) {
   assert((size_t)size >= sizeof(word_t));
 
   /* We need to allocate memory for the block's header and its content. */
   ptrdiff_t real_size = sizeof(BlockHdr) + size;
 
-  BlockHdr *blk = sbrk(0);
+  int large = conf.thp && (size_t)real_size >= THP_LARGE;
+  Chunk *chunk = large ? arena->large : arena->chunks;
+  if (chunk == NULL || chunk->top + real_size > (char *)chunk + chunk->size) {
+    chunk = map_chunk(arena, large);
+    if (chunk == NULL)
+      return NULL; /* Out of memory. */
+  }
+
+  BlockHdr *blk = (BlockHdr *)chunk->top;
+  chunk->top += real_size;
+  if (chunk->dirty < chunk->top)
+    chunk->dirty = chunk->top;
+  return blk;
+}
+
+/*
+ * Mapped blocks. A block of "mmap_threshold" bytes or more is put
+ * right after the header of a chunk that's mapped for it alone. Freeing
+ * it unmaps the chunk, so its memory never sits in a free list. When
+ * REALLOC grows it, the pages of the chunk are remapped with mremap,
+ * in place or to a new address, without copying any of its contents.
+ */
+static atomic_size_t mapped_bytes = 0;     /* The size of all those chunks. */
+static atomic_size_t mapped_allocated = 0; /* The size of their blocks. */
+
+/* The number of bytes to map for a block of SIZE bytes of its own. */
+size_t mapped_size(size_t size) {
+  return page_up(sizeof(Chunk) + sizeof(BlockHdr) + size);
+}
+
+/* Set up the only block of the mapped chunk CHUNK. */
+BlockHdr *mapped_block(Chunk *chunk, size_t map_size) {
+  chunk->arena = NULL;
+  chunk->next = NULL;
+  chunk->size = map_size;
+  chunk->top = chunk->dirty = (char *)chunk + map_size;
+  chunk->mapped = 1;
+
+  BlockHdr *blk = (BlockHdr *)(chunk + 1);
+  /* The rest of the last page is part of the block, too. */
+  blk->size = map_size - sizeof(Chunk) - sizeof(BlockHdr);
+  blk->purged = 0;
+  blk->prev = NULL;
+  blk->next = NULL;
+  return blk;
+}
+
+/* Map a block of at least SIZE bytes of its own, or return NULL. */
+BlockHdr *map_block(size_t size) {
+  size_t map_size = mapped_size(size);
+  Chunk *chunk = (Chunk *)mmap_aligned(map_size);
+  if (chunk == NULL)
+    return NULL;
+
+  if (conf.prefault)
+    prefault_pages(chunk, map_size);
+  BlockHdr *blk = mapped_block(chunk, map_size);
+  atomic_fetch_add(&mapped_bytes, map_size);
+  atomic_fetch_add(&mapped_allocated, blk->size);
+  dbg("Mapping %td bytes at %p\n", blk->size, user_mem(blk));
+  return blk;
+}
+
+/*
+ * Huge blocks. A block of ARENA that doesn't fit into a chunk is the
+ * only block of a chunk like the ones above. But the chunk comes from
+ * the chunk backend, points to ARENA and is kept in the arena's HUGE
+ * list, so that resetting the arena unmaps it, too. The caller must
+ * hold the arena's lock.
+ */
+BlockHdr *map_huge_block(Arena *arena, size_t size) {
+  size_t map_size = (mapped_size(size) + CHUNK_SIZE - 1) & ~(CHUNK_SIZE - 1);
+  Chunk *chunk = (Chunk *)map_aligned(map_size);
+  if (chunk == NULL)
+    return NULL;
+
+  BlockHdr *blk = mapped_block(chunk, map_size);
+  chunk->arena = arena;
+  chunk->next = arena->huge;
+  arena->huge = chunk;
+  atomic_fetch_add(&mapped_bytes, map_size);
+  atomic_fetch_add(&mapped_allocated, blk->size);
+  dbg("Mapping %td bytes at %p\n", blk->size, user_mem(blk));
+  return blk;
+}
 
-  if (init == NULL)
-    init = blk;
+/* Take CHUNK, a huge block's, out of the list of its arena. */
+void unlink_huge_chunk(Chunk *chunk) {
+  Arena *arena = chunk->arena;
+  mutex_lock(&arena->lock);
+  Chunk **link = &arena->huge;
+  while (*link != chunk)
+    link = &(*link)->next;
+  *link = chunk->next;
+  mutex_unlock(&arena->lock);
+}
 
-  if (sbrk(real_size) == (void *)-1) {
-    return NULL; /* Out of memory. */
+/* Unmap the mapped block BLK. */
+void unmap_block(BlockHdr *blk) {
+  Chunk *chunk = chunk_of(blk);
+  atomic_fetch_sub(&mapped_bytes, chunk->size);
+  atomic_fetch_sub(&mapped_allocated, blk->size);
+  if (chunk->arena != NULL) {
+    unlink_huge_chunk(chunk);
+    unmap_chunk(chunk, chunk->size);
   } else {
-    return blk;
+    munmap(chunk, chunk->size);
   }
 }
 
-/* Align the given size by rounding it up to the nearest word boundary. */
-ptrdiff_t align(ptrdiff_t size) {
-  return (size + (sizeof(word_t) - 1)) & ~(sizeof(word_t) - 1);
+/* Unmap all huge blocks of ARENA. The caller must hold the arena's lock. */
+void clear_huge_blocks(Arena *arena) {
+  while (arena->huge != NULL) {
+    Chunk *chunk = arena->huge;
+    arena->huge = chunk->next;
+    atomic_fetch_sub(&mapped_bytes, chunk->size);
+    atomic_fetch_sub(&mapped_allocated, ((BlockHdr *)(chunk + 1))->size);
+    unmap_chunk(chunk, chunk->size);
+  }
 }
 
 /*
- * Allocate a contiguous block of heap memory that has
- * a size of at least SIZE bytes.
- * Return NULL if the size is less than or equal to 0
- * or if the allocation has failed.
+ * Resize the mapped block BLK to at least SIZE bytes. Its chunk might
+ * move, but it stays aligned to CHUNK_SIZE. Return the block or NULL
+ * if the chunk couldn't be resized; then BLK stays as it was.
  */
-word_t *alloc(ptrdiff_t size) {
-  if (size <= 0)
+BlockHdr *remap_block(BlockHdr *blk, size_t size) {
+  Chunk *chunk = chunk_of(blk);
+  size_t old_size = chunk->size;
+  size_t old_blk_size = blk->size;
+  size_t map_size = mapped_size(size);
+  if (map_size == old_size)
+    return blk;
+
+  chunk = remap_aligned(chunk, old_size, map_size, CHUNK_SIZE);
+  if (chunk == NULL)
     return NULL;
+  if (conf.prefault && map_size > old_size)
+    prefault_pages((char *)chunk + old_size, map_size - old_size);
+  blk = mapped_block(chunk, map_size);
+  atomic_fetch_add(&mapped_bytes, map_size);
+  atomic_fetch_sub(&mapped_bytes, old_size);
+  atomic_fetch_add(&mapped_allocated, blk->size);
+  atomic_fetch_sub(&mapped_allocated, old_blk_size);
+  dbg("Remapping %td bytes at %p\n", blk->size, user_mem(blk));
+  return blk;
+}
 
-  size = align(size);
+/* Align the given size by rounding it up to the nearest word boundary. */
+ptrdiff_t align(ptrdiff_t size) {
+  return (size + (sizeof(word_t) - 1)) & ~(sizeof(word_t) - 1);
+}
+
+/* Defined further down. */
+void reclaim_remote_frees(Arena *arena);
+word_t *tcache_alloc(int cls);
+void init_background_thread(void);
 
+/*
+ * Take a block of SIZE bytes from ARENA, re-using a free block if
+ * possible. The caller must hold the arena's lock.
+ * Return NULL if the OS is out of memory.
+ */
+BlockHdr *alloc_block(Arena *arena, ptrdiff_t size) {
   /*
    * Either we find and re-use a block that has already
    * been allocated or we request new memory from the OS.
    */
   BlockHdr *blk = NULL;
-  if ((blk = find_block(size)) != NULL) {
+  if (sizeof(Chunk) + sizeof(BlockHdr) + size > CHUNK_SIZE) {
+    return map_huge_block(arena, size);
+  } else if ((blk = find_block(arena, size)) != NULL) {
     split_block(blk, size);
-    remove_block(blk, &global_free_list);
+    remove_block(blk, &arena->free_list);
+    blk->purged = 0;
     dbg("Re-using %td bytes at %p\n", size, user_mem(blk));
-    return user_mem(blk);
+    return blk;
   } else {
-    blk = request_block_from_os(size);
+    blk = request_block_from_os(arena, size);
+    if (blk == NULL)
+      return NULL;
     blk->size = size;
+    blk->purged = 0;
     /* Links point nowhere while the block is used. */
     blk->prev = NULL;
     blk->next = NULL;
     dbg("Allocating %td bytes at %p\n", size, user_mem(blk));
-    return user_mem(blk);
+    return blk;
   }
+}
 
-  return NULL;
+/*
+ * Allocate a contiguous block of heap memory that has
+ * a size of at least SIZE bytes.
+ * Return NULL if the size is less than or equal to 0
+ * or if the allocation has failed.
+ */
+word_t *alloc(ptrdiff_t size) {
+  init_arenas();
+  init_background_thread();
+
+  if (size <= 0)
+    return NULL;
+
+  /* Inside a scope, everything comes from the scope's arena. */
+  if (scope_arena != NULL)
+    return arena_alloc(scope_arena, size);
+
+  size = align(size);
+
+  if (conf.mmap_threshold > 0 && (size_t)size >= conf.mmap_threshold) {
+    BlockHdr *blk = map_block(size);
+    return blk == NULL ? NULL : user_mem(blk);
+  }
+
+  /* Small blocks come from the cache of the current CPU or thread first. */
+  if (conf.pcpu_cache == 0 && conf.tcache > 0 &&
+      (size_t)size <= PCPU_MAX_SIZE) {
+    word_t *mem = tcache_alloc(pcpu_alloc_class(size));
+    if (mem != NULL)
+      return mem;
+  }
+
+  if (conf.pcpu_cache > 0 && (size_t)size <= PCPU_MAX_SIZE && pcpu_init()) {
+    int cls = pcpu_alloc_class(size);
+    BlockHdr *cached = pcpu_pop(cls);
+    if (cached != NULL) {
+      dbg("Re-using %td bytes at %p\n", cached->size, user_mem(cached));
+      return user_mem(cached);
+    }
+    /* Large enough to serve any allocation of its class once it's cached. */
+    size = pcpu_class_size(cls);
+  }
+
+  Arena *arena = choose_arena();
+  mutex_lock(&arena->lock);
+  reclaim_remote_frees(arena);
+  BlockHdr *blk = alloc_block(arena, size);
+  mutex_unlock(&arena->lock);
+
+  return blk == NULL ? NULL : user_mem(blk);
+}
+
+/*
+ * Created arenas. Apart from the arenas that threads are spread over,
+ * a program can create arenas of its own, e.g. one per subsystem, so
+ * that their blocks don't fragment each other's chunks. ARENA_ALLOC
+ * allocates from such an arena, and WFREE gives blocks back to it as
+ * to any other. Its blocks never pass through the thread and CPU
+ * caches, and the only ones with chunks of their own are huge blocks,
+ * which stay in the arena's list. So ARENA_RESET frees all of them at
+ * once by unmapping the arena's chunks. The background thread
+ * and the heap statistics leave created arenas alone.
+ */
+
+/* Create an empty arena. Return NULL if the OS has no memory for it. */
+Arena *arena_create(void) {
+  init_arenas();
+  Arena *arena = mmap(NULL, sizeof(Arena), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (arena == MAP_FAILED)
+    return NULL;
+  mutex_init(&arena->lock);
+  arena->created = 1;
+  return arena;
+}
+
+/* Allocate SIZE bytes from ARENA, which ARENA_CREATE made. */
+word_t *arena_alloc(Arena *arena, ptrdiff_t size) {
+  if (size <= 0)
+    return NULL;
+  size = align(size);
+
+  mutex_lock(&arena->lock);
+  reclaim_remote_frees(arena);
+  BlockHdr *blk = alloc_block(arena, size);
+  mutex_unlock(&arena->lock);
+  return blk == NULL ? NULL : user_mem(blk);
+}
+
+/*
+ * Free all blocks of ARENA at once. No other thread may
+ * use the arena at the same time.
+ */
+void arena_reset(Arena *arena) {
+  mutex_lock(&arena->lock);
+  clear_arena(arena);
+  mutex_unlock(&arena->lock);
+}
+
+/* Give ARENA and all of its memory back. */
+void arena_destroy(Arena *arena) {
+  arena_reset(arena);
+  pthread_mutex_destroy(&arena->lock.lock);
+  munmap(arena, sizeof(Arena));
+}
+
+/*
+ * Scopes. Between ARENA_SCOPE_ENTER and ARENA_SCOPE_LEAVE, everything
+ * that the calling thread allocates with ALLOC (and so with malloc,
+ * calloc and realloc) comes from a created arena, even in code that
+ * knows nothing about it, such as a library that a request handler
+ * calls. Blocks are freed into the arena they came from, inside the
+ * scope or not. Once the request is done, ARENA_RESET frees all of
+ * them at once. Scopes nest: ARENA_SCOPE_ENTER returns the arena of
+ * the scope around the new one (or NULL), which ARENA_SCOPE_LEAVE
+ * takes to go back to it.
+ */
+Arena *arena_scope_enter(Arena *arena) {
+  Arena *outer = scope_arena;
+  scope_arena = arena;
+  return outer;
 }
 
+void arena_scope_leave(Arena *outer) { scope_arena = outer; }
+
 /*
  * Check if BLKB is adjacent in memory to BLKA.
  * I.e., BLKA comes and is followed by BLKB.
@@ -240,53 +1014,1155 @@ p   * to the free list. This means that this block is always the
 
   if (blk->prev != NULL && is_adjacent(blk, blk->prev)) {
     blk->size += sizeof(BlockHdr) + blk->prev->size;
+    blk->purged &= blk->prev->purged;
     remove_block(blk->prev, list);
   }
 
   if (blk->prev != NULL && is_adjacent(blk->prev, blk)) {
     blk->prev->size += sizeof(BlockHdr) + blk->size;
+    blk->prev->purged &= blk->purged;
     remove_block(blk, list);
   }
 }
 
-/* Free a pointer to some words of memory. "wfree" <=> "word free". */
-void wfree(word_t *mem) {
-  if (mem == NULL)
-    return;
+/* Check if BLK is the last block in its chunk. */
+int is_top(BlockHdr *blk) {
+  return (char *)user_mem(blk) + blk->size == chunk_of(blk)->top;
+}
 
-  dbg("Freeing %p\n", mem);
+/*
+ * Give free blocks at the top of ARENA's chunks back to the OS.
+ * The pages above the top of a chunk are purged, and chunks that
+ * end up empty are unmapped (except the ones blocks are carved
+ * from). The caller must hold the arena's lock.
+ * Return the number of bytes that were released.
+ */
+ptrdiff_t trim_heap(Arena *arena) {
+  ptrdiff_t released = 0;
+  BlockHdr *blk = arena->free_list;
 
-  BlockHdr *blk = mem_hdr(mem);
-  add_block(blk, &global_free_list);
-  merge_block(blk, &global_free_list);
-}
+  while (blk != NULL) {
+    if (is_top(blk)) {
+      chunk_of(blk)->top = (char *)blk;
+      remove_block(blk, &arena->free_list);
+      /* The block below might have become the top. */
+      blk = arena->free_list;
+    } else {
+      blk = blk->prev;
+    }
+  }
 
-void *malloc(size_t size) { return alloc(size); }
+  /* The first chunk of either list is the one blocks are carved from. */
+  for (int large = 0; large <= 1; large++) {
+    Chunk **list = large ? &arena->large : &arena->chunks;
+    Chunk **link = list;
+    while (*link != NULL) {
+      Chunk *chunk = *link;
+      if (chunk != *list && chunk->top == (char *)(chunk + 1)) {
+        *link = chunk->next;
+        released += chunk->size;
+        unmap_chunk(chunk, chunk->size);
+      } else {
+        /* Nothing above TOP is used, so the last dirty page can go, too. */
+        char *end = (char *)page_up((uintptr_t)chunk->dirty);
+        if (conf.thp) {
+          /* The same goes for the last dirty huge page, but not for TOP's. */
+          end = (char *)huge_page_up((uintptr_t)chunk->dirty);
+          released += purge_huge_pages(chunk->top, end - chunk->top);
+          char *kept = (char *)huge_page_up((uintptr_t)chunk->top);
+          if (chunk->dirty > kept)
+            chunk->dirty = kept;
+        } else {
+          released += purge_pages(chunk->top, end - chunk->top);
+          chunk->dirty = chunk->top;
+        }
+        link = &chunk->next;
+      }
+    }
+  }
 
-void free(void *mem) { return wfree(mem); }
+  return released;
+}
 
-void *realloc(void *mem, size_t size) {
-  if (mem == NULL)
-    return malloc(size);
+/* Purge the pages of the free block BLK (only whole huge pages with "thp"). */
+size_t purge_block(BlockHdr *blk) {
+  blk->purged = 1;
+  if (conf.thp)
+    return purge_huge_pages(user_mem(blk), blk->size);
+  return decay_purge(user_mem(blk), blk->size);
+}
 
-  BlockHdr *blk = mem_hdr(mem);
-  if ((size_t)blk->size >= size) {
-    return mem;
-  } else {
-    void *new_mem = malloc(size);
-    if (new_mem == NULL)
-      return NULL;
-    memcpy(new_mem, mem, blk->size);
-    free(mem);
-    return new_mem;
+/*
+ * Purge free blocks of ARENA, the ones that were freed first
+ * first, until no more dirty bytes are left than DECAY_LIMIT
+ * allows. The caller must hold the arena's lock.
+ * Return the number of bytes that were purged.
+ */
+ptrdiff_t decay_heap(Arena *arena, uint64_t now) {
+  size_t dirty = 0;
+  BlockHdr *oldest = NULL;
+  for (BlockHdr *blk = arena->free_list; blk != NULL; blk = blk->prev) {
+    if (!blk->purged)
+      dirty += whole_pages(user_mem(blk), blk->size);
+    oldest = blk;
   }
+
+  size_t limit = decay_limit(&arena->decay, now);
+  ptrdiff_t released = 0;
+  for (BlockHdr *blk = oldest; blk != NULL && dirty > limit; blk = blk->next) {
+    size_t bytes = whole_pages(user_mem(blk), blk->size);
+    if (!blk->purged && bytes > 0) {
+      released += purge_block(blk);
+      dirty -= bytes;
+    }
+  }
+  return released;
 }
 
-void *calloc(size_t n, size_t size) {
-  /*
-   * If N and SIZE are suitably small, skip the division-based
-   * overflow test (for speed). Assuming the minimum width of
-   * size_t is 32 bits, two factors that are both less than 2^16
+/*
+ * Put BLK back into the free list of ARENA, which must be
+ * the arena that owns it. The caller must hold the arena's lock.
+ */
+void free_block(Arena *arena, BlockHdr *blk) {
+  size_t freed = whole_pages(user_mem(blk), blk->size);
+  blk->purged = 0;
+  add_block(blk, &arena->free_list);
+
+  uint64_t now = 0;
+  if (conf.decay > 0 && freed > 0) {
+    now = decay_now();
+    decay_freed(&arena->decay, freed, now);
+  }
+
+  /* Merging, trimming and purging are left to the background thread. */
+  if (background_running && !arena->created)
+    return;
+  merge_block(blk, &arena->free_list);
+
+  /* After merging, the freed memory is at the start of the list. */
+  if (conf.trim_threshold > 0 &&
+      (size_t)arena->free_list->size >= conf.trim_threshold &&
+      is_top(arena->free_list))
+    trim_heap(arena);
+
+  if (now != 0 && decay_due(&arena->decay, now))
+    decay_heap(arena, now);
+}
+
+/*
+ * Free BLK on behalf of a thread that doesn't allocate from ARENA.
+ * Instead of waiting for the arena's lock, the block is pushed onto
+ * the arena's REMOTE_FREES stack with a compare-and-swap. The link is
+ * stored in the block's memory; the header stays as it was while the
+ * block was used. The arena's own threads move the blocks into the
+ * free list later (see RECLAIM_REMOTE_FREES).
+ */
+void remote_free(Arena *arena, BlockHdr *blk) {
+  BlockHdr **link = (BlockHdr **)user_mem(blk);
+  BlockHdr *head =
+      atomic_load_explicit(&arena->remote_frees, memory_order_relaxed);
+  do {
+    *link = head;
+  } while (!atomic_compare_exchange_weak_explicit(&arena->remote_frees, &head,
+                                                  blk, memory_order_release,
+                                                  memory_order_relaxed));
+}
+
+/*
+ * Free all blocks that other threads have pushed onto the REMOTE_FREES
+ * stack of ARENA. The whole stack is taken at once, so popping can't run
+ * into the ABA problem. The caller must hold the arena's lock.
+ */
+void reclaim_remote_frees(Arena *arena) {
+  if (atomic_load_explicit(&arena->remote_frees, memory_order_relaxed) == NULL)
+    return;
+
+  BlockHdr *blk =
+      atomic_exchange_explicit(&arena->remote_frees, NULL, memory_order_acquire);
+  while (blk != NULL) {
+    BlockHdr *next = *(BlockHdr **)user_mem(blk);
+    free_block(arena, blk);
+    blk = next;
+  }
+}
+
+/* Try to keep BLK in the cache of the current CPU. Return 1 if it was. */
+int cache_block(BlockHdr *blk) {
+  int cls = pcpu_free_class(blk->size);
+  if (cls < 0 || !pcpu_init())
+    return 0;
+  size_t cap = conf.pcpu_cache < PCPU_MAX_CAP ? conf.pcpu_cache : PCPU_MAX_CAP;
+  return pcpu_push(cls, blk, cap) == 0;
+}
+
+/* Give BLK back to the arena that owns it. */
+void release_block(BlockHdr *blk) {
+  Arena *arena = arena_of(blk);
+  if (arena != choose_arena() && !arena->created) {
+    remote_free(arena, blk);
+    return;
+  }
+
+  mutex_lock(&arena->lock);
+  reclaim_remote_frees(arena);
+  free_block(arena, blk);
+  mutex_unlock(&arena->lock);
+}
+
+/*
+ * Thread caches. With the "tcache" option, every thread keeps free
+ * small blocks in bins of its own, one for each size class of pcpu.h.
+ * Allocating from a bin and freeing into it takes no shared lock. Like
+ * remote frees, blocks in a bin are linked through their memory.
+ *
+ * Bins exchange blocks with the rest of the heap in batches of
+ * "tcache_batch" blocks: an empty bin is refilled with a whole batch,
+ * and a bin that holds more blocks than its capacity gives a batch away.
+ * Batches pass through the central transfer cache, which keeps a few
+ * of them for each class under one lock. So, a batch that one thread
+ * frees can be picked up as a whole by the next thread that runs out.
+ * Only if the transfer cache is empty (or full) do blocks come from
+ * (or go back to) the arenas, and then also a batch per lock.
+ *
+ * The caches of all threads are kept in a list. When a thread exits,
+ * a destructor for TCACHE_KEY gives its blocks back, and the
+ * background thread flushes the caches of threads that haven't used
+ * them for "tcache_idle" milliseconds. So, blocks only stay cached
+ * for threads that are still allocating. Since the background thread
+ * reaches into the caches of other threads, each cache has a lock.
+ * Only its owner and the background thread ever take it, so it's
+ * hardly ever contended.
+ *
+ * The capacity of each bin adapts to how the thread uses its class.
+ * It starts at one batch. Every time a bin runs empty, it grows by a
+ * batch, up to "tcache" blocks. A bin that keeps overflowing belongs
+ * to a thread that frees more than it allocates, so it shrinks again.
+ * The capacity of all bins of all threads together is limited to
+ * "tcache_max" bytes. A bin that would grow beyond that takes the
+ * capacity from the bin of its thread with the fewest misses.
+ */
+
+#define TRANSFER_MAX 32 /* Batches per class in the transfer cache. */
+/* Overflows of a full bin until its capacity shrinks. */
+#define TCACHE_MAX_OVERFLOWS 3
+
+typedef struct {
+  BlockHdr *head; /* Linked through the memory of the blocks. */
+  size_t count;
+} BlockList;
+
+typedef struct {
+  Mutex lock;
+  BlockList batches[TRANSFER_MAX];
+  size_t nbatches;
+} TransferClass;
+
+typedef struct TCache TCache;
+struct TCache {
+  Mutex lock;
+  BlockList bins[PCPU_CLASSES];
+  size_t caps[PCPU_CLASSES];
+  /* How often each bin ran empty or overflowed. */
+  size_t misses[PCPU_CLASSES];
+  size_t overflows[PCPU_CLASSES];
+  /* The number of allocations and frees that used the cache. */
+  size_t ops;
+  /* Set once the thread has exited; the cache isn't used after that. */
+  int dead;
+  int registered;
+  /* What the background thread saw last (see SCAVENGE_TCACHES). */
+  size_t seen_ops;
+  uint64_t idle_since;
+  TCache *prev, *next;
+};
+
+static __thread TCache tcache = {.lock = MUTEX_INITIALIZER};
+/* The caches of all threads that have used theirs. */
+static TCache *tcaches = NULL;
+static Mutex tcaches_lock = MUTEX_INITIALIZER;
+static pthread_key_t tcache_key;
+/* The capacity of all bins of all threads, in bytes. */
+static atomic_size_t tcache_capacity = 0;
+static TransferClass transfer[PCPU_CLASSES] = {
+    [0 ... PCPU_CLASSES - 1] = {.lock = MUTEX_INITIALIZER}};
+
+void list_push(BlockList *list, BlockHdr *blk) {
+  *(BlockHdr **)user_mem(blk) = list->head;
+  list->head = blk;
+  list->count++;
+}
+
+BlockHdr *list_pop(BlockList *list) {
+  BlockHdr *blk = list->head;
+  if (blk != NULL) {
+    list->head = *(BlockHdr **)user_mem(blk);
+    list->count--;
+  }
+  return blk;
+}
+
+size_t tcache_batch(void) {
+  return conf.tcache_batch > 0 ? conf.tcache_batch : 1;
+}
+
+/*
+ * Give all blocks in LIST back to their arenas. The blocks of this
+ * thread's arena are freed while holding its lock once, the others
+ * are handed to their arenas as remote frees.
+ */
+void release_blocks(BlockList *list) {
+  Arena *arena = choose_arena();
+  mutex_lock(&arena->lock);
+  reclaim_remote_frees(arena);
+
+  BlockHdr *blk;
+  while ((blk = list_pop(list)) != NULL) {
+    if (arena_of(blk) == arena)
+      free_block(arena, blk);
+    else
+      remote_free(arena_of(blk), blk);
+  }
+  mutex_unlock(&arena->lock);
+}
+
+/*
+ * Refill the empty BIN of class CLS with a batch from the transfer
+ * cache or, if it has none, with new blocks from this thread's arena.
+ */
+void fill_bin(int cls, BlockList *bin) {
+  TransferClass *t = &transfer[cls];
+  mutex_lock(&t->lock);
+  if (t->nbatches > 0) {
+    *bin = t->batches[--t->nbatches];
+    mutex_unlock(&t->lock);
+    return;
+  }
+  mutex_unlock(&t->lock);
+
+  Arena *arena = choose_arena();
+  mutex_lock(&arena->lock);
+  reclaim_remote_frees(arena);
+  for (size_t i = 0; i < tcache_batch(); i++) {
+    BlockHdr *blk = alloc_block(arena, pcpu_class_size(cls));
+    if (blk == NULL)
+      break;
+    list_push(bin, blk);
+  }
+  mutex_unlock(&arena->lock);
+}
+
+/*
+ * Move a batch of blocks out of BIN of class CLS, into the
+ * transfer cache if it has room and to the arenas otherwise.
+ */
+void drain_bin(int cls, BlockList *bin) {
+  BlockList batch = {NULL, 0};
+  while (batch.count < tcache_batch() && bin->count > 0)
+    list_push(&batch, list_pop(bin));
+
+  TransferClass *t = &transfer[cls];
+  mutex_lock(&t->lock);
+  if (t->nbatches < TRANSFER_MAX) {
+    t->batches[t->nbatches++] = batch;
+    mutex_unlock(&t->lock);
+    return;
+  }
+  mutex_unlock(&t->lock);
+  release_blocks(&batch);
+}
+
+/* Take BYTES of capacity if that stays within "tcache_max". */
+int reserve_capacity(size_t bytes) {
+  size_t old = tcache_capacity;
+  do {
+    if (old + bytes > conf.tcache_max)
+      return 0;
+  } while (!atomic_compare_exchange_weak(&tcache_capacity, &old, old + bytes));
+  return 1;
+}
+
+/*
+ * Set the capacity of bin CLS of TC to CAP blocks and give away the
+ * blocks that don't fit anymore. The caller must hold TC's lock.
+ */
+void set_capacity(TCache *tc, int cls, size_t cap) {
+  BlockList *bin = &tc->bins[cls];
+  tcache_capacity -= tc->caps[cls] * pcpu_class_size(cls);
+  tcache_capacity += cap * pcpu_class_size(cls);
+  tc->caps[cls] = cap;
+  while (bin->count > cap)
+    drain_bin(cls, bin);
+}
+
+/* The capacity of a bin of a thread that just started or was idle. */
+size_t initial_capacity(void) {
+  return tcache_batch() < conf.tcache ? tcache_batch() : conf.tcache;
+}
+
+/*
+ * Grow bin CLS of TC by a batch, unless it's full already. If that
+ * would exceed "tcache_max", take the capacity from the bins with the
+ * fewest misses instead.
+ */
+void grow_bin(TCache *tc, int cls) {
+  size_t cap = tc->caps[cls] + tcache_batch();
+  if (cap > conf.tcache)
+    cap = conf.tcache;
+  if (cap <= tc->caps[cls])
+    return;
+
+  size_t bytes = (cap - tc->caps[cls]) * pcpu_class_size(cls);
+  int stolen = 0;
+  while (!reserve_capacity(bytes)) {
+    int victim = -1;
+    for (int i = 0; i < PCPU_CLASSES; i++) {
+      if (i != cls && tc->caps[i] > initial_capacity() &&
+          (victim < 0 || tc->misses[i] < tc->misses[victim]))
+        victim = i;
+    }
+    if (victim < 0)
+      return;
+    size_t shrunk = tc->caps[victim] - tcache_batch();
+    if (shrunk < initial_capacity())
+      shrunk = initial_capacity();
+    set_capacity(tc, victim, shrunk);
+    stolen = 1;
+  }
+  tc->caps[cls] = cap;
+
+  /* Let recent misses count more than old ones. */
+  if (stolen)
+    for (int i = 0; i < PCPU_CLASSES; i++)
+      tc->misses[i] /= 2;
+}
+
+/* Give all blocks in the bins of TC back. The caller must hold its lock. */
+size_t flush_bins(TCache *tc) {
+  size_t n = 0;
+  for (int cls = 0; cls < PCPU_CLASSES; cls++) {
+    n += tc->bins[cls].count;
+    if (tc->bins[cls].count > 0)
+      release_blocks(&tc->bins[cls]);
+  }
+  return n;
+}
+
+/* The destructor of TCACHE_KEY. It runs when a thread exits. */
+void tcache_thread_exit(void *arg) {
+  TCache *tc = arg;
+
+  mutex_lock(&tcaches_lock);
+  if (tc->prev != NULL)
+    tc->prev->next = tc->next;
+  else
+    tcaches = tc->next;
+  if (tc->next != NULL)
+    tc->next->prev = tc->prev;
+  mutex_unlock(&tcaches_lock);
+
+  /* Other destructors may still free blocks; those skip the cache. */
+  mutex_lock(&tc->lock);
+  tc->dead = 1;
+  flush_bins(tc);
+  for (int cls = 0; cls < PCPU_CLASSES; cls++)
+    set_capacity(tc, cls, 0);
+  mutex_unlock(&tc->lock);
+}
+
+void setup_tcache_key(void) {
+  pthread_key_create(&tcache_key, tcache_thread_exit);
+}
+
+/*
+ * Lock this thread's cache, adding it to the list of caches first
+ * if it's used for the first time. Return NULL if the thread is
+ * exiting and blocks should bypass the cache.
+ */
+TCache *lock_tcache(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  TCache *tc = &tcache;
+
+  if (tc->dead)
+    return NULL;
+  if (!tc->registered) {
+    pthread_once(&once, setup_tcache_key);
+    tc->registered = 1;
+    for (int cls = 0; cls < PCPU_CLASSES; cls++)
+      set_capacity(tc, cls, initial_capacity());
+    pthread_setspecific(tcache_key, tc);
+    mutex_lock(&tcaches_lock);
+    tc->next = tcaches;
+    if (tcaches != NULL)
+      tcaches->prev = tc;
+    tcaches = tc;
+    mutex_unlock(&tcaches_lock);
+  }
+
+  mutex_lock(&tc->lock);
+  tc->ops++;
+  return tc;
+}
+
+word_t *tcache_alloc(int cls) {
+  TCache *tc = lock_tcache();
+  if (tc == NULL)
+    return NULL;
+
+  BlockList *bin = &tc->bins[cls];
+  if (bin->count == 0) {
+    tc->misses[cls]++;
+    grow_bin(tc, cls);
+    fill_bin(cls, bin);
+  }
+
+  BlockHdr *blk = list_pop(bin);
+  mutex_unlock(&tc->lock);
+  if (blk == NULL)
+    return NULL;
+  dbg("Re-using %td bytes at %p\n", blk->size, user_mem(blk));
+  return user_mem(blk);
+}
+
+/* Put BLK into this thread's cache. Return 1 if it was small enough. */
+int tcache_free(BlockHdr *blk) {
+  int cls = pcpu_free_class(blk->size);
+  if (cls < 0)
+    return 0;
+
+  TCache *tc = lock_tcache();
+  if (tc == NULL)
+    return 0;
+
+  BlockList *bin = &tc->bins[cls];
+  list_push(bin, blk);
+  /* Only running empty makes a bin grow; overflowing makes it shrink. */
+  if (bin->count > tc->caps[cls]) {
+    if (++tc->overflows[cls] > TCACHE_MAX_OVERFLOWS) {
+      tc->overflows[cls] = 0;
+      set_capacity(tc, cls, initial_capacity());
+    }
+    if (bin->count > tc->caps[cls])
+      drain_bin(cls, bin);
+  }
+  mutex_unlock(&tc->lock);
+  return 1;
+}
+
+/*
+ * Give the blocks in this thread's cache back to their arenas.
+ * Return the number of blocks that were flushed.
+ */
+size_t flush_tcache(void) {
+  mutex_lock(&tcache.lock);
+  size_t n = flush_bins(&tcache);
+  mutex_unlock(&tcache.lock);
+  return n;
+}
+
+/*
+ * Give the blocks in the caches of all threads back to their arenas.
+ * Return the number of blocks that were flushed.
+ */
+size_t flush_tcaches(void) {
+  size_t n = 0;
+  mutex_lock(&tcaches_lock);
+  for (TCache *tc = tcaches; tc != NULL; tc = tc->next) {
+    mutex_lock(&tc->lock);
+    n += flush_bins(tc);
+    mutex_unlock(&tc->lock);
+  }
+  mutex_unlock(&tcaches_lock);
+  return n;
+}
+
+/*
+ * Flush the caches of threads that haven't allocated or freed since
+ * "tcache_idle" milliseconds before NOW (in CLOCK_MONOTONIC
+ * nanoseconds). A cache that's locked is in use and is skipped.
+ * Return the number of blocks that were flushed.
+ */
+size_t scavenge_tcaches(uint64_t now) {
+  size_t n = 0;
+  mutex_lock(&tcaches_lock);
+  for (TCache *tc = tcaches; tc != NULL; tc = tc->next) {
+    if (mutex_trylock(&tc->lock) != 0)
+      continue;
+    if (tc->ops != tc->seen_ops) {
+      tc->seen_ops = tc->ops;
+      tc->idle_since = now;
+    } else if (now - tc->idle_since >= conf.tcache_idle * 1000000ull) {
+      n += flush_bins(tc);
+      for (int cls = 0; cls < PCPU_CLASSES; cls++)
+        set_capacity(tc, cls, initial_capacity());
+    }
+    mutex_unlock(&tc->lock);
+  }
+  mutex_unlock(&tcaches_lock);
+  return n;
+}
+
+/* Give all batches in the transfer cache back to the arenas. */
+void flush_transfer_cache(void) {
+  for (int cls = 0; cls < PCPU_CLASSES; cls++) {
+    TransferClass *t = &transfer[cls];
+    mutex_lock(&t->lock);
+    while (t->nbatches > 0)
+      release_blocks(&t->batches[--t->nbatches]);
+    mutex_unlock(&t->lock);
+  }
+}
+
+/* Free a pointer to some words of memory. "wfree" <=> "word free". */
+void wfree(word_t *mem) {
+  if (mem == NULL)
+    return;
+
+  dbg("Freeing %p\n", mem);
+  sample_free(mem);
+
+  BlockHdr *blk = mem_hdr(mem);
+  if (chunk_of(blk)->mapped) {
+    unmap_block(blk);
+    return;
+  }
+  /* Blocks of created arenas must not end up in another arena's hands. */
+  if (arena_of(blk)->created) {
+    release_block(blk);
+    return;
+  }
+  if (conf.pcpu_cache > 0) {
+    if (cache_block(blk))
+      return;
+  } else if (conf.tcache > 0 && tcache_free(blk)) {
+    return;
+  }
+  release_block(blk);
+}
+
+/*
+ * Give the blocks in the cache of the current CPU back to their arenas.
+ * The caches of other CPUs can't be emptied from here: that would race
+ * with the critical sections running on those CPUs.
+ * Return the number of blocks that were flushed.
+ */
+size_t flush_pcpu_cache(void) {
+  size_t n = 0;
+  if (!pcpu_init())
+    return 0;
+
+  for (int cls = 0; cls < PCPU_CLASSES; cls++) {
+    BlockHdr *blk;
+    while ((blk = pcpu_pop(cls)) != NULL) {
+      release_block(blk);
+      n++;
+    }
+  }
+  return n;
+}
+
+/*
+ * Call FN with ARG on every block of every arena. Each arena
+ * is locked while its blocks are visited.
+ */
+void walk_heap(void (*fn)(BlockHdr *blk, void *arg), void *arg) {
+  for (size_t i = 0; i < narenas; i++) {
+    mutex_lock(&arenas[i].lock);
+    reclaim_remote_frees(&arenas[i]);
+    /* In a chunk, blocks are contiguous from the header up to TOP. */
+    for (Chunk *chunk = first_chunk(&arenas[i]); chunk != NULL;
+         chunk = next_chunk(&arenas[i], chunk)) {
+      for (BlockHdr *blk = (BlockHdr *)(chunk + 1); (char *)blk < chunk->top;
+           blk = (BlockHdr *)((ptrdiff_t)user_mem(blk) + blk->size))
+        fn(blk, arg);
+    }
+    mutex_unlock(&arenas[i].lock);
+  }
+}
+
+void stats_block(BlockHdr *blk, void *arg) {
+  HeapStats *st = arg;
+  if (is_free(blk))
+    st->free += blk->size;
+  else
+    st->allocated += blk->size;
+}
+
+void heap_stats(HeapStats *st) {
+  st->allocated = st->free = st->mapped = 0;
+  walk_heap(stats_block, st);
+
+  for (size_t i = 0; i < narenas; i++) {
+    mutex_lock(&arenas[i].lock);
+    for (Chunk *chunk = first_chunk(&arenas[i]); chunk != NULL;
+         chunk = next_chunk(&arenas[i], chunk))
+      st->mapped += chunk->size;
+    mutex_unlock(&arenas[i].lock);
+  }
+  st->allocated += atomic_load(&mapped_allocated);
+  st->mapped += atomic_load(&mapped_bytes);
+}
+
+void report_heap_block(BlockHdr *blk, void *arg) {
+  report_block(arg, blk->size, !is_free(blk));
+}
+
+/*
+ * Count the blocks in the caches of all CPUs as cached rather than
+ * live. Other CPUs' caches can't be flushed (see FLUSH_PCPU_CACHE),
+ * but they can be read. If threads are still running, the counts are
+ * only a snapshot.
+ */
+void report_pcpu_caches(Report *r) {
+  if (pcpu_caches == NULL)
+    return;
+  for (int cpu = 0; cpu < pcpu_ncpus; cpu++) {
+    PcpuCache *c = &pcpu_caches[cpu];
+    for (int cls = 0; cls < PCPU_CLASSES; cls++) {
+      size_t count = __atomic_load_n(&c->count[cls], __ATOMIC_RELAXED);
+      for (size_t i = 0; i < count && i < PCPU_MAX_CAP; i++)
+        report_cached(r, ((BlockHdr *)c->slots[cls][i])->size);
+    }
+  }
+}
+
+/* Print the blocks that are on the heap right now (see report.h). */
+void heap_report(void) {
+  static Report r; /* Too large for some thread stacks. */
+  memset(&r, 0, sizeof(r));
+  walk_heap(report_heap_block, &r);
+  report_pcpu_caches(&r);
+  report_print(&r);
+}
+
+/* With the "leak_report" option, print what was never freed. */
+__attribute__((destructor)) void heap_report_at_exit(void) {
+  if (conf.leak_report) {
+    /* Cached blocks would count as live otherwise. */
+    flush_tcaches();
+    flush_transfer_cache();
+    heap_report();
+  }
+}
+
+ptrdiff_t purge_arena(size_t idx) {
+  init_arenas();
+  if (idx >= narenas)
+    return -1;
+
+  Arena *arena = &arenas[idx];
+  ptrdiff_t released = 0;
+  mutex_lock(&arena->lock);
+  reclaim_remote_frees(arena);
+  for (BlockHdr *blk = arena->free_list; blk != NULL; blk = blk->prev) {
+    /* Blocks that were purged before have no pages left to give back. */
+    if (blk->purged || whole_pages(user_mem(blk), blk->size) == 0)
+      continue;
+    if (conf.thp)
+      released += purge_huge_pages(user_mem(blk), blk->size);
+    else
+      released += purge_pages(user_mem(blk), blk->size);
+    blk->purged = 1;
+  }
+  mutex_unlock(&arena->lock);
+  return released;
+}
+
+ptrdiff_t trim_arena(size_t idx) {
+  init_arenas();
+  if (idx >= narenas)
+    return -1;
+
+  Arena *arena = &arenas[idx];
+  mutex_lock(&arena->lock);
+  reclaim_remote_frees(arena);
+  ptrdiff_t released = trim_heap(arena);
+  mutex_unlock(&arena->lock);
+  return released;
+}
+
+ptrdiff_t decay_arena(size_t idx) {
+  init_arenas();
+  if (idx >= narenas)
+    return -1;
+
+  Arena *arena = &arenas[idx];
+  mutex_lock(&arena->lock);
+  reclaim_remote_frees(arena);
+  ptrdiff_t released = decay_heap(arena, decay_now());
+  mutex_unlock(&arena->lock);
+  return released;
+}
+
+/*
+ * The background thread. With the "background_thread" option (or
+ * after writing 1 to "background_thread" with mallctl), FREE_BLOCK only
+ * puts blocks into the free list. Everything that used to follow
+ * is done by a thread of its own, every "bg_interval" milliseconds:
+ * it merges adjacent free blocks, trims the top of the heap and
+ * purges the pages of the remaining free blocks (with "decay", only
+ * as many as decay.h allows). The time between passes grows if a
+ * pass takes more than "bg_budget" percent of a CPU.
+ */
+
+static pthread_t background_thread;
+/* Protects starting and stopping the thread and wakes it up to stop. */
+static Mutex background_lock = MUTEX_INITIALIZER;
+static pthread_cond_t background_cond = PTHREAD_COND_INITIALIZER;
+static atomic_size_t background_passes = 0;
+
+/*
+ * Merge all free blocks of ARENA that lie next to each other. Blocks
+ * in a chunk are contiguous, so unlike MERGE_BLOCK, this finds all
+ * neighbors, not just the ones in the free list next to a block.
+ * The caller must hold the arena's lock.
+ */
+void coalesce_arena(Arena *arena) {
+  for (Chunk *chunk = first_chunk(arena); chunk != NULL;
+       chunk = next_chunk(arena, chunk)) {
+    BlockHdr *blk = (BlockHdr *)(chunk + 1);
+    while ((char *)blk < chunk->top) {
+      BlockHdr *next = (BlockHdr *)((char *)user_mem(blk) + blk->size);
+      if (is_free(blk) && (char *)next < chunk->top && is_free(next)) {
+        remove_block(next, &arena->free_list);
+        blk->size += sizeof(BlockHdr) + next->size;
+        blk->purged &= next->purged;
+      } else {
+        blk = next;
+      }
+    }
+  }
+}
+
+uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Do the work that FREE_BLOCK leaves to the background thread. */
+void background_pass(void) {
+  for (size_t i = 0; i < narenas; i++) {
+    Arena *arena = &arenas[i];
+    mutex_lock(&arena->lock);
+    reclaim_remote_frees(arena);
+    coalesce_arena(arena);
+    mutex_unlock(&arena->lock);
+    trim_arena(i);
+    if (conf.decay > 0)
+      decay_arena(i);
+    else
+      purge_arena(i);
+  }
+  refill_spare_chunks();
+  if (conf.tcache > 0)
+    scavenge_tcaches(monotonic_ns());
+  background_passes++;
+}
+
+uint64_t thread_cpu_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * How long to sleep after a pass that took USED nanoseconds of CPU
+ * time, so that the thread stays within its budget.
+ */
+uint64_t background_sleep_ns(uint64_t used) {
+  uint64_t sleep = conf.bg_interval * 1000000ull;
+  if (conf.bg_budget > 0 && conf.bg_budget < 100) {
+    uint64_t min = used * (100 - conf.bg_budget) / conf.bg_budget;
+    if (sleep < min)
+      sleep = min;
+  }
+  return sleep;
+}
+
+void *background_main(void *arg) {
+  (void)arg;
+  uint64_t sleep = background_sleep_ns(0);
+
+  mutex_lock(&background_lock);
+  while (background_running) {
+    struct timespec wake;
+    clock_gettime(CLOCK_REALTIME, &wake);
+    wake.tv_sec += sleep / 1000000000;
+    wake.tv_nsec += sleep % 1000000000;
+    if (wake.tv_nsec >= 1000000000) {
+      wake.tv_sec++;
+      wake.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&background_cond, &background_lock.lock, &wake);
+    if (!background_running)
+      break;
+
+    mutex_unlock(&background_lock);
+    uint64_t start = thread_cpu_ns();
+    background_pass();
+    sleep = background_sleep_ns(thread_cpu_ns() - start);
+    mutex_lock(&background_lock);
+  }
+  mutex_unlock(&background_lock);
+  return NULL;
+}
+
+/* A child process doesn't inherit the thread, so it frees inline again. */
+void background_atfork_child(void) { background_running = 0; }
+
+void background_register_atfork(void) {
+  pthread_atfork(NULL, NULL, background_atfork_child);
+}
+
+/* Return 0 on success and -1 if the thread couldn't be created. */
+int start_background_thread(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, background_register_atfork);
+
+  int err = 0;
+  mutex_lock(&background_lock);
+  if (!background_running) {
+    background_running = 1;
+    if (pthread_create(&background_thread, NULL, background_main, NULL) != 0) {
+      background_running = 0;
+      err = -1;
+    }
+  }
+  mutex_unlock(&background_lock);
+  return err;
+}
+
+void stop_background_thread(void) {
+  mutex_lock(&background_lock);
+  if (!background_running) {
+    mutex_unlock(&background_lock);
+    return;
+  }
+  background_running = 0;
+  pthread_cond_signal(&background_cond);
+  mutex_unlock(&background_lock);
+  pthread_join(background_thread, NULL);
+  /* Merge what was freed since the last pass; FREE_BLOCK does it again now. */
+  background_pass();
+}
+
+/*
+ * Start the thread on the first allocation if the option is set.
+ * This can't happen in SETUP_ARENAS: creating a thread allocates.
+ */
+void init_background_thread(void) {
+  static atomic_int tried = 0;
+  if (conf.background_thread && !atomic_exchange(&tried, 1))
+    start_background_thread();
+}
+
+/* Write 1 to start the background thread and 0 to stop it. */
+int ctl_background_thread(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                          size_t newlen) {
+  (void)idx;
+  int old = background_running;
+  if (newp != NULL) {
+    if (newlen != sizeof(int))
+      return EINVAL;
+    int on = *(int *)newp;
+    if (on != 0 && on != 1)
+      return EINVAL;
+    if (!on)
+      stop_background_thread();
+    else if (start_background_thread() < 0)
+      return EAGAIN;
+  }
+  return ctl_read(oldp, oldlenp, &old, sizeof(int));
+}
+
+int ctl_background_passes(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                          size_t newlen) {
+  (void)idx, (void)newlen;
+  size_t passes = background_passes;
+  return ctl_read_only(oldp, oldlenp, newp, &passes, sizeof(size_t));
+}
+
+int ctl_narenas(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                size_t newlen) {
+  (void)idx, (void)newlen;
+  init_arenas();
+  return ctl_read_only(oldp, oldlenp, newp, &narenas, sizeof(size_t));
+}
+
+/*
+ * How the locks of an arena, transfer class, the spare chunks, the
+ * reserve, the list of thread caches, the background thread and the
+ * allocation samples are used. For "stats.locks.tcache", the locks
+ * of the caches of all running threads are summed up.
+ */
+int ctl_locks_arena(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                    size_t newlen) {
+  (void)newlen;
+  init_arenas();
+  if (idx >= narenas)
+    return ENOENT;
+  MutexStats st;
+  mutex_stats(&arenas[idx].lock, &st);
+  return ctl_read_only(oldp, oldlenp, newp, &st, sizeof(st));
+}
+
+int ctl_locks_transfer(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                       size_t newlen) {
+  (void)newlen;
+  if (idx >= PCPU_CLASSES)
+    return ENOENT;
+  MutexStats st;
+  mutex_stats(&transfer[idx].lock, &st);
+  return ctl_read_only(oldp, oldlenp, newp, &st, sizeof(st));
+}
+
+int ctl_locks_spare(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                    size_t newlen) {
+  (void)idx, (void)newlen;
+  MutexStats st;
+  mutex_stats(&spare_lock, &st);
+  return ctl_read_only(oldp, oldlenp, newp, &st, sizeof(st));
+}
+
+int ctl_locks_reserve(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                      size_t newlen) {
+  (void)idx, (void)newlen;
+  MutexStats st;
+  mutex_stats(&reserve_lock, &st);
+  return ctl_read_only(oldp, oldlenp, newp, &st, sizeof(st));
+}
+
+int ctl_locks_tcache(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                     size_t newlen) {
+  (void)idx, (void)newlen;
+  MutexStats st = {0};
+  mutex_lock(&tcaches_lock);
+  for (TCache *tc = tcaches; tc != NULL; tc = tc->next)
+    mutex_stats_add(&tc->lock, &st);
+  mutex_unlock(&tcaches_lock);
+  return ctl_read_only(oldp, oldlenp, newp, &st, sizeof(st));
+}
+
+int ctl_locks_tcaches(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                      size_t newlen) {
+  (void)idx, (void)newlen;
+  MutexStats st;
+  mutex_stats(&tcaches_lock, &st);
+  return ctl_read_only(oldp, oldlenp, newp, &st, sizeof(st));
+}
+
+int ctl_locks_background(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                         size_t newlen) {
+  (void)idx, (void)newlen;
+  MutexStats st;
+  mutex_stats(&background_lock, &st);
+  return ctl_read_only(oldp, oldlenp, newp, &st, sizeof(st));
+}
+
+int ctl_locks_sample(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                     size_t newlen) {
+  (void)idx, (void)newlen;
+  MutexStats st;
+  mutex_stats(&sample_lock, &st);
+  return ctl_read_only(oldp, oldlenp, newp, &st, sizeof(st));
+}
+
+/* The number of blocks flushed is returned through OLDP. */
+int ctl_pcpu_flush(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                   size_t newlen) {
+  (void)idx, (void)newlen;
+  if (newp != NULL)
+    return EPERM;
+  size_t n = flush_pcpu_cache();
+  return ctl_read(oldp, oldlenp, &n, sizeof(size_t));
+}
+
+/* The number of blocks flushed is returned through OLDP. */
+int ctl_tcache_flush(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                     size_t newlen) {
+  (void)idx, (void)newlen;
+  if (newp != NULL)
+    return EPERM;
+  size_t n = flush_tcache();
+  return ctl_read(oldp, oldlenp, &n, sizeof(size_t));
+}
+
+static const CtlEntry ctl_table[] = {
+    CTL_COMMON,
+    {"arenas.narenas", ctl_narenas},
+    {"pcpu.flush", ctl_pcpu_flush},
+    {"tcache.flush", ctl_tcache_flush},
+    {"background_thread", ctl_background_thread},
+    {"stats.background_thread.passes", ctl_background_passes},
+    {"stats.locks.arena.#", ctl_locks_arena},
+    {"stats.locks.transfer.#", ctl_locks_transfer},
+    {"stats.locks.spare", ctl_locks_spare},
+    {"stats.locks.reserve", ctl_locks_reserve},
+    {"stats.locks.tcache", ctl_locks_tcache},
+    {"stats.locks.tcaches", ctl_locks_tcaches},
+    {"stats.locks.background", ctl_locks_background},
+    {"stats.locks.sample", ctl_locks_sample},
+};
+
+int mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp,
+            size_t newlen) {
+  return ctl_dispatch(ctl_table, CTL_LEN(ctl_table), name, oldp, oldlenp, newp,
+                      newlen);
+}
+
+/*
+ * The C interface. Allocations made through it are sampled
+ * for the leak report, using the caller's address as their site.
+ */
+
+void *malloc(size_t size) {
+  void *mem = alloc(size);
+  sample_alloc(mem, size, __builtin_return_address(0));
+  return mem;
+}
+
+void free(void *mem) { return wfree(mem); }
+
+void *realloc(void *mem, size_t size) {
+  if (mem == NULL) {
+    mem = alloc(size);
+    sample_alloc(mem, size, __builtin_return_address(0));
+    return mem;
+  }
+
+  BlockHdr *blk = mem_hdr(mem);
+  /* Huge blocks are in their arena's list, which remapping would break. */
+  if (chunk_of(blk)->mapped && chunk_of(blk)->arena == NULL) {
+    /* Resize the mapping instead of copying the block. */
+    BlockHdr *new_blk = remap_block(blk, align(size));
+    if (new_blk != NULL) {
+      void *new_mem = user_mem(new_blk);
+      if (new_mem != mem) {
+        sample_free(mem);
+        sample_alloc(new_mem, size, __builtin_return_address(0));
+      }
+      return new_mem;
+    }
+  }
+
+  if ((size_t)blk->size >= size) {
+    return mem;
+  } else {
+    void *new_mem = alloc(size);
+    if (new_mem == NULL)
+      return NULL;
+    sample_alloc(new_mem, size, __builtin_return_address(0));
+    memcpy(new_mem, mem, blk->size);
+    free(mem);
+    return new_mem;
+  }
+}
+
+void *calloc(size_t n, size_t size) {
+  /*
+   * If N and SIZE are suitably small, skip the division-based
+   * overflow test (for speed). Assuming the minimum width of
+   * size_t is 32 bits, two factors that are both less than 2^16
    * will never overflow. If that cannot be guaranteed, we used
    * division to check if the product would overflow.
    * See https://drj11.wordpress.com/2008/06/04/calloc-when-multiply-overflows/
@@ -294,14 +2170,77 @@ void *calloc(size_t n, size_t size) {
   if ((n > 65535 || size > 65535) && (size_t)-1 / n < size)
     return NULL;
 
-  void *mem = malloc(size * n);
+  void *mem = alloc(size * n);
   if (mem == NULL)
     return mem;
+  sample_alloc(mem, size * n, __builtin_return_address(0));
 
-  memset(mem, 0, size);
+  memset(mem, 0, size * n);
   return mem;
 }
 
+/* For the arena test: allocate and free on a thread of its own. */
+void *arena_thread(void *arg) {
+  word_t *mem[20];
+  for (int i = 0; i < 20; i++) {
+    mem[i] = alloc(8 * (i % 5 + 1));
+    assert(arena_of(mem_hdr(mem[i])) == thread_arena);
+  }
+  for (int i = 0; i < 20; i++)
+    wfree(mem[i]);
+
+  *(word_t **)arg = alloc(32);
+  return NULL;
+}
+
+/* For the remote free test: free three blocks on another thread. */
+void *tcache_thread(void *arg) {
+  /* Keep the round-robin assignment of arenas for the arena tests. */
+  thread_arena = &arenas[0];
+  word_t *mem[3];
+  for (int i = 0; i < 3; i++)
+    mem[i] = alloc(48);
+  for (int i = 0; i < 3; i++)
+    wfree(mem[i]);
+  assert(tcache.bins[pcpu_alloc_class(48)].count == 4);
+  heap_stats(arg);
+  return NULL;
+}
+
+/* For the exit report test: keep a block cached until STATE is 2. */
+void *cached_thread(void *arg) {
+  atomic_int *state = arg;
+  thread_arena = &arenas[0];
+  wfree(alloc(48));
+  *state = 1;
+  while (*state != 2)
+    sched_yield();
+  return NULL;
+}
+
+typedef struct {
+  Mutex mutex;
+  atomic_int started;
+} LockWaiter;
+
+void *lock_thread(void *arg) {
+  LockWaiter *waiter = arg;
+  waiter->started = 1;
+  mutex_lock(&waiter->mutex);
+  mutex_unlock(&waiter->mutex);
+  return NULL;
+}
+
+void *free_thread(void *arg) {
+  word_t **mem = arg;
+  /* Don't share the arena that the blocks came from. */
+  Arena *owner = arena_of(mem_hdr(mem[0]));
+  thread_arena = &arenas[(owner - arenas + 1) % narenas];
+  for (int i = 0; i < 3; i++)
+    wfree(mem[i]);
+  return NULL;
+}
+
 int main(void) {
   dbg("TEST: Aligning allocations\n");
   assert(align(0) == 0);
@@ -327,10 +2266,10 @@ int main(void) {
   wfree(alloc(0));
 
   wfree(a1);
-  assert(global_free_list == mem_hdr(a1));
+  assert(thread_arena->free_list == mem_hdr(a1));
 
   wfree(a3);
-  assert(global_free_list == mem_hdr(a3));
+  assert(thread_arena->free_list == mem_hdr(a3));
   assert(mem_hdr(a3)->next == NULL);
   assert(mem_hdr(a3)->prev == mem_hdr(a1));
   assert(mem_hdr(a1)->next == mem_hdr(a3));
@@ -363,7 +2302,7 @@ int main(void) {
   wfree(m2);
   wfree(m1);
   assert(mem_hdr(m1)->size == 16 + sizeof(BlockHdr));
-  assert(global_free_list == mem_hdr(m1)); /* m1 is first in the free list. */
+  assert(thread_arena->free_list == mem_hdr(m1)); /* m1 is first in the free list. */
   assert(mem_hdr(m1)->prev ==
          NULL); /* m1 is the only block in the free list. */
 
@@ -372,18 +2311,18 @@ int main(void) {
    * From the free block m1, the first 8 bytes have been allocated.
    * The rest remains in the free list.
    */
-  assert((size_t)global_free_list ==
+  assert((size_t)thread_arena->free_list ==
          (size_t)mem_hdr(m1) + 8 + sizeof(BlockHdr));
   alloc(8); /* Use up all free blocks. */
-  assert(global_free_list == NULL);
+  assert(thread_arena->free_list == NULL);
 
   reset_heap();
   m1 = alloc(8);
   m2 = alloc(8);
   wfree(m1);
-  assert(global_free_list == mem_hdr(m1));
+  assert(thread_arena->free_list == mem_hdr(m1));
   wfree(m2);
-  assert(global_free_list == mem_hdr(m1));
+  assert(thread_arena->free_list == mem_hdr(m1));
   assert(mem_hdr(m1)->prev == NULL);
   assert(mem_hdr(m1)->size == 16 + sizeof(BlockHdr));
 
@@ -397,7 +2336,7 @@ int main(void) {
   word_t *m3 = alloc(64);
   assert(mem_hdr(m3)->size == 64);
   /* m3 is new memory, so m1 stays in the free list. */
-  assert(global_free_list == mem_hdr(m1));
+  assert(thread_arena->free_list == mem_hdr(m1));
   assert(mem_hdr(m1)->size == 16 + sizeof(BlockHdr));
   wfree(m3);
   assert(mem_hdr(m1)->size == 64 + 16 + 2 * sizeof(BlockHdr));
@@ -416,7 +2355,867 @@ int main(void) {
   wfree(m5);
   word_t *m6 = alloc(16 + sizeof(BlockHdr));
   assert(mem_hdr(m6)->size == 16 + sizeof(BlockHdr));
-  assert(global_free_list == NULL);
+  assert(thread_arena->free_list == NULL);
+
+  reset_heap();
+  dbg("TEST: mallctl\n");
+  size_t val = 0;
+  size_t len = sizeof(val);
+  word_t *c1 = alloc(page_size() * 4);
+  word_t *c2 = alloc(16);
+  assert(mallctl("stats.allocated", &val, &len, NULL, 0) == 0);
+  assert(val == page_size() * 4 + 16);
+  assert(mallctl("stats.mapped", &val, &len, NULL, 0) == 0);
+  assert(val == CHUNK_SIZE);
+  wfree(c1);
+  assert(mallctl("stats.free", &val, &len, NULL, 0) == 0);
+  assert(val == page_size() * 4);
+  assert(mallctl("stats.free", NULL, NULL, &val, len) == EPERM);
+  assert(mallctl("arena.0.purge", &val, &len, NULL, 0) == 0);
+  assert(val >= page_size() * 3);
+  /* Purging again skips the blocks that are purged already. */
+  assert(mallctl("arena.0.purge", &val, &len, NULL, 0) == 0);
+  assert(val == 0);
+  assert(mallctl("arena.64.trim", NULL, NULL, NULL, 0) == ENOENT);
+  /* c2 is on top, so nothing can be trimmed. */
+  assert(mallctl("arena.0.trim", &val, &len, NULL, 0) == 0);
+  assert(val == 0);
+  wfree(c2);
+  /*
+   * c1 and c2 were merged and are both given back. Apart from the
+   * first page, which is shared with the chunk header, all their
+   * pages are purged.
+   */
+  assert(mallctl("arena.0.trim", &val, &len, NULL, 0) == 0);
+  assert(val == page_size() * 4);
+  assert(thread_arena->free_list == NULL);
+  assert(chunk_of(mem_hdr(c1))->top == (char *)mem_hdr(c1));
+
+  size_t threshold = 64;
+  assert(mallctl("opt.trim_threshold", &val, &len, &threshold, len) == 0);
+  assert(val == 0);
+  word_t *c3 = alloc(64);
+  wfree(c3);
+  assert(thread_arena->free_list == NULL);
+  assert(chunk_of(mem_hdr(c3))->top == (char *)mem_hdr(c3));
+  threshold = 0;
+  assert(mallctl("opt.trim_threshold", NULL, NULL, &threshold, len) == 0);
+  /* Caches, arenas and the like can only be set up at start. */
+  size_t opt_tcache = conf.tcache;
+  assert(mallctl("opt.tcache", NULL, NULL, &threshold, len) == EPERM);
+  assert(mallctl("opt.narenas", NULL, NULL, &threshold, len) == EPERM);
+  int thp_on = 1;
+  assert(mallctl("opt.thp", NULL, NULL, &thp_on, sizeof(thp_on)) == EPERM);
+  assert(conf.tcache == opt_tcache && conf.thp == 0);
+  assert(mallctl("opt.tcache", &val, &len, NULL, 0) == 0);
+  assert(val == opt_tcache);
+
+  reset_heap();
+  dbg("TEST: Huge pages\n");
+  conf.thp = 1;
+  /* A large block first doesn't make small ones use its chunk. */
+  word_t *h0 = alloc(THP_LARGE);
+  word_t *s0 = alloc(64);
+  assert(chunk_of(mem_hdr(h0)) == thread_arena->large);
+  assert(chunk_of(mem_hdr(s0)) == thread_arena->chunks);
+  assert(thread_arena->chunks != thread_arena->large);
+  assert(thread_arena->chunks->next == NULL);
+  assert(thread_arena->large->next == NULL);
+  wfree(s0);
+  wfree(h0);
+  reset_heap();
+  word_t *s1 = alloc(64);
+  word_t *h1 = alloc(THP_LARGE);
+  word_t *s2 = alloc(64);
+  /* Large blocks don't come between small ones. */
+  Chunk *small_chunk = chunk_of(mem_hdr(s1));
+  assert((uintptr_t)small_chunk % HUGE_PAGE_SIZE == 0);
+  assert(chunk_of(mem_hdr(h1)) != small_chunk);
+  assert(chunk_of(mem_hdr(h1)) == thread_arena->large);
+  assert((char *)mem_hdr(s2) == (char *)s1 + 64);
+
+  /* Only whole huge pages of free blocks are purged. */
+  assert(purge_huge_pages((char *)small_chunk + 1, HUGE_PAGE_SIZE) == 0);
+  word_t *h2 = alloc(HUGE_PAGE_SIZE / 2);
+  Chunk *large_chunk = thread_arena->large;
+  assert(chunk_of(mem_hdr(h2)) == large_chunk);
+  wfree(h2);
+  assert(mallctl("arena.0.purge", &val, &len, NULL, 0) == 0);
+  assert(val == 0);
+  /* The huge page that the top is in isn't purged either. */
+  assert(mallctl("arena.0.trim", &val, &len, NULL, 0) == 0);
+  assert(val == 0);
+  assert(large_chunk->top == (char *)mem_hdr(h2));
+  /* Blocks larger than a chunk still get one of their own. */
+  word_t *h3 = alloc(5 * HUGE_PAGE_SIZE / 2);
+  assert(chunk_of(mem_hdr(h3))->mapped);
+  assert(thread_arena->large == large_chunk);
+  wfree(h3);
+  wfree(s1);
+  wfree(h1);
+  wfree(s2);
+  conf.thp = 0;
+
+  reset_heap();
+  dbg("TEST: Decay\n");
+  conf.decay = 1000;
+  uint64_t later = decay_now() + 2000ull * 1000000;
+  word_t *d1 = alloc(page_size() * 4);
+  word_t *g1 = alloc(16); /* Avoids merging. */
+  word_t *d2 = alloc(page_size() * 4);
+  word_t *g2 = alloc(16);
+  word_t *d3 = alloc(page_size() * 4);
+  word_t *g3 = alloc(16);
+  wfree(d1);
+  wfree(d2);
+  /* Nothing has decayed yet. */
+  assert(mallctl("arena.0.decay", &val, &len, NULL, 0) == 0);
+  assert(val == 0);
+  assert(!mem_hdr(d1)->purged && !mem_hdr(d2)->purged);
+  /* Once the decay time has passed, all of them are purged. */
+  assert(decay_heap(thread_arena, later) >= (ptrdiff_t)(page_size() * 6));
+  assert(mem_hdr(d1)->purged && mem_hdr(d2)->purged);
+  /* A dirty block is reused before purged ones. */
+  wfree(d3);
+  assert(!mem_hdr(d3)->purged);
+  assert(alloc(page_size() * 4) == d3);
+  /* Purged blocks are still reused when they are all there is. */
+  word_t *d4 = alloc(page_size() * 4);
+  assert(d4 == d1 || d4 == d2);
+  assert(!mem_hdr(d4)->purged);
+  wfree(d3);
+  wfree(d4);
+  wfree(g1);
+  wfree(g2);
+  wfree(g3);
+  conf.decay = 0;
+
+  reset_heap();
+  dbg("TEST: Address space reserve\n");
+  conf.vm_reserve = 8 * CHUNK_SIZE;
+  word_t *v1 = alloc(64);
+  Backend *cb = chunk_backend;
+  /* Chunks are carved from the reserve, from the bottom up. */
+  assert((char *)chunk_of(mem_hdr(v1)) == cb->base);
+  char *v2 = reserve_chunk(CHUNK_SIZE);
+  char *v3 = reserve_chunk(2 * CHUNK_SIZE);
+  assert(v2 == cb->base + CHUNK_SIZE);
+  assert(v3 == v2 + CHUNK_SIZE);
+  assert(cb->brk == v3 + 2 * CHUNK_SIZE);
+  memset(v3, 1, 2 * CHUNK_SIZE);
+  /* A chunk below the top is decommitted and used again first. */
+  unmap_chunk(v2, CHUNK_SIZE);
+  assert(cb->brk == v3 + 2 * CHUNK_SIZE);
+  assert(reserve_chunk(CHUNK_SIZE) == v2);
+  memset(v2, 1, CHUNK_SIZE);
+  assert(cb->brk == v3 + 2 * CHUNK_SIZE);
+  /* The top one lowers the break, past the hole right below it. */
+  unmap_chunk(v2, CHUNK_SIZE);
+  unmap_chunk(v3, 2 * CHUNK_SIZE);
+  assert(cb->brk == v2);
+  assert(cb->commit == v2);
+  assert(reserve_nholes == 0);
+  /* Once the reserve is used up, chunks come from mmap. */
+  word_t *v4 = alloc(8 * CHUNK_SIZE);
+  assert(v4 != NULL);
+  assert((char *)v4 >= cb->end || (char *)v4 < cb->base);
+  assert(reserve_used == CHUNK_SIZE);
+  wfree(v4);
+  wfree(v1);
+  reset_heap();
+  assert(cb->base == NULL && chunk_backend == NULL);
+  conf.vm_reserve = 0;
+
+  reset_heap();
+  dbg("TEST: Chunk backends\n");
+  /* With a buffer, all chunks come from the buffer. */
+  static char chunk_buf[4 * CHUNK_SIZE];
+  Backend kb = buffer_backend(chunk_buf, sizeof(chunk_buf));
+  assert(set_chunk_backend(&kb) == 0);
+  word_t *k1 = alloc(64);
+  assert((char *)k1 > chunk_buf && (char *)k1 < chunk_buf + sizeof(chunk_buf));
+  assert((uintptr_t)kb.base % CHUNK_SIZE == 0);
+  /* The backend can't be changed while its chunks are in use. */
+  assert(set_chunk_backend(NULL) == -1);
+  /* When the buffer is used up, there's no more memory. */
+  assert(alloc(4 * CHUNK_SIZE) == NULL);
+  /* A chunk freed in the middle of the buffer is used again. */
+  word_t *k2 = alloc(CHUNK_SIZE / 2);
+  word_t *k3 = alloc(CHUNK_SIZE / 2);
+  word_t *k4 = alloc(CHUNK_SIZE / 2);
+  Chunk *k3_chunk = chunk_of(mem_hdr(k3));
+  assert(k3_chunk != chunk_of(mem_hdr(k2)));
+  assert(k3_chunk != chunk_of(mem_hdr(k4)));
+  wfree(k3);
+  trim_heap(thread_arena);
+  assert(reserve_nholes == 1);
+  word_t *k5 = alloc(CHUNK_SIZE / 2);
+  assert(chunk_of(mem_hdr(k5)) == k3_chunk);
+  assert(reserve_nholes == 0);
+  wfree(k5);
+  wfree(k4);
+  wfree(k2);
+  wfree(k1);
+  reset_heap();
+  assert(kb.brk == kb.base);
+  assert(set_chunk_backend(NULL) == 0);
+  assert(kb.base == NULL);
+
+  reset_heap();
+  dbg("TEST: Mapped blocks\n");
+  conf.mmap_threshold = 1 << 20;
+  word_t *q1 = alloc(1 << 20);
+  Chunk *q1_chunk = chunk_of(mem_hdr(q1));
+  assert(q1_chunk->mapped);
+  assert(q1_chunk->size == mapped_size(1 << 20));
+  assert(mem_hdr(q1)->size >= 1 << 20);
+  assert(atomic_load(&mapped_bytes) == q1_chunk->size);
+  q1[0] = 1;
+  q1[(1 << 20) / sizeof(word_t) - 1] = 2;
+  /* With something mapped right after it, the block has to move ... */
+  char *q_next = (char *)q1_chunk + q1_chunk->size;
+  void *blocker =
+      mmap(q_next, page_size(), PROT_NONE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+  assert(blocker == q_next);
+  word_t *q2 = realloc(q1, 64 << 20);
+  munmap(blocker, page_size());
+  assert(q2 != q1);
+  /* ... but it keeps its contents and is still in an aligned chunk. */
+  assert(q2[0] == 1 && q2[(1 << 20) / sizeof(word_t) - 1] == 2);
+  Chunk *q2_chunk = chunk_of(mem_hdr(q2));
+  assert(q2_chunk->mapped);
+  assert(q2_chunk->size == mapped_size(64 << 20));
+  assert(atomic_load(&mapped_bytes) == q2_chunk->size);
+  /* Shrinking unmaps the rest in place. */
+  word_t *q3 = realloc(q2, page_size());
+  assert(q3 == q2);
+  assert(q2_chunk->size == mapped_size(page_size()));
+  wfree(q3);
+  assert(atomic_load(&mapped_bytes) == 0);
+  /* A block that outgrows the threshold is copied into a mapping once. */
+  word_t *q4 = alloc(64);
+  word_t *q5 = realloc(q4, 2 << 20);
+  assert(chunk_of(mem_hdr(q5))->mapped);
+  assert(mallctl("stats.allocated", &val, &len, NULL, 0) == 0);
+  assert(val == (size_t)mem_hdr(q5)->size);
+  wfree(q5);
+  conf.mmap_threshold = 0;
+
+  reset_heap();
+  dbg("TEST: Huge blocks\n");
+  /* A block larger than a chunk gets a chunk of its own ... */
+  word_t *u1 = malloc(3 * CHUNK_SIZE / 2);
+  word_t *u2 = malloc(64);
+  Chunk *u1_chunk = chunk_of(mem_hdr(u1));
+  assert(u1_chunk->mapped && arena_of(mem_hdr(u1)) == thread_arena);
+  assert(thread_arena->huge == u1_chunk);
+  /* ... and small blocks are carved from a chunk of CHUNK_SIZE bytes. */
+  assert(chunk_of(mem_hdr(u2)) != u1_chunk);
+  assert(arena_of(mem_hdr(u2)) == thread_arena);
+  assert(thread_arena->chunks->size == CHUNK_SIZE);
+  memset(u1, 1, 3 * CHUNK_SIZE / 2);
+  free(u2);
+  free(u1);
+  assert(thread_arena->huge == NULL);
+  assert(atomic_load(&mapped_bytes) == 0);
+  /* The same goes for blocks that fill a chunk exactly. */
+  word_t *u3 = malloc(CHUNK_SIZE);
+  word_t *u4 = malloc(64);
+  assert(chunk_of(mem_hdr(u3))->mapped);
+  assert(!chunk_of(mem_hdr(u4))->mapped);
+  free(u4);
+  free(u3);
+  /* Resetting the arena unmaps them, too. */
+  assert(malloc(2 * CHUNK_SIZE) != NULL);
+  reset_heap();
+  assert(thread_arena->huge == NULL);
+  assert(atomic_load(&mapped_bytes) == 0);
+
+  reset_heap();
+  dbg("TEST: Prefaulting\n");
+  /* With "prefault", new chunks and mapped blocks are faulted in. */
+  conf.prefault = 1;
+  word_t *p1 = alloc(64);
+  Chunk *p1_chunk = chunk_of(mem_hdr(p1));
+  assert(resident_bytes(p1_chunk, CHUNK_SIZE) == CHUNK_SIZE);
+  conf.mmap_threshold = 1 << 20;
+  word_t *p2 = alloc(1 << 20);
+  assert(resident_bytes(p2, 1 << 20) >= 1 << 20);
+  word_t *p3 = realloc(p2, 4 << 20);
+  assert(resident_bytes(p3, 4 << 20) >= 4 << 20);
+  wfree(p3);
+  wfree(p1);
+  conf.mmap_threshold = 0;
+  conf.prefault = 0;
+  /* With "prefault_heap", every arena starts with its share, faulted in. */
+  reset_heap();
+  conf.prefault_heap = narenas * CHUNK_SIZE / 2;
+  prefault_arenas();
+  for (size_t i = 0; i < narenas; i++) {
+    assert(arenas[i].chunks != NULL);
+    assert(arenas[i].chunks->size == CHUNK_SIZE);
+    assert(resident_bytes(arenas[i].chunks, CHUNK_SIZE) == CHUNK_SIZE);
+  }
+  word_t *p4 = alloc(64);
+  assert(chunk_of(mem_hdr(p4)) == thread_arena->chunks);
+  wfree(p4);
+  conf.prefault_heap = 0;
+
+  dbg("TEST: Shared arenas\n");
+  SharedArena sa;
+  assert(shared_arena_create(&sa, "test", 1 << 20) == 0);
+  char *x1 = shared_alloc(&sa, 200);
+  strcpy(x1, "hello");
+  size_t x1_off = shared_offset(&sa, x1);
+  size_t *mailbox = shared_alloc(&sa, sizeof(size_t));
+  pid_t pid = fork();
+  if (pid == 0) {
+    /* The child maps the arena once more, at another address. */
+    SharedArena other;
+    if (shared_arena_open(&other, sa.fd) != 0)
+      _exit(1);
+    char *c = shared_ptr(&other, x1_off);
+    if (c == x1 || strcmp(c, "hello") != 0)
+      _exit(2);
+    /* It can free what the parent allocated and allocate, too. */
+    shared_free(&other, c);
+    char *reply = shared_alloc(&other, 64);
+    strcpy(reply, "world");
+    *(size_t *)shared_ptr(&other, shared_offset(&sa, mailbox)) =
+        shared_offset(&other, reply);
+    _exit(0);
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  char *x2 = shared_ptr(&sa, *mailbox);
+  assert(strcmp(x2, "world") == 0);
+  /* The child split the block of "hello" for its reply. */
+  assert(x2 == x1);
+  char *x3 = shared_alloc(&sa, 16);
+  assert(x3 == x2 + 64 + sizeof(SharedBlock));
+  /* A process that dies while it holds the lock doesn't block the others. */
+  pid = fork();
+  if (pid == 0) {
+    pthread_mutex_lock(&sa.hdr->lock);
+    _exit(0);
+  }
+  assert(waitpid(pid, &status, 0) == pid);
+  shared_free(&sa, x2);
+  shared_free(&sa, x3);
+  shared_free(&sa, mailbox);
+  /* Everything was merged and given back to the top. */
+  assert(sa.hdr->free_list == 0);
+  assert(sa.hdr->top ==
+         (size_t)((char *)x1 - sizeof(SharedBlock) - (char *)sa.hdr));
+  /* Only memfds with a shared arena in them can be opened. */
+  SharedArena bad;
+  int bad_fd = memfd_create("bad", MFD_CLOEXEC);
+  assert(ftruncate(bad_fd, page_size()) == 0);
+  assert(shared_arena_open(&bad, bad_fd) == -1);
+  close(bad_fd);
+  assert(shared_alloc(&sa, 2 << 20) == NULL);
+  assert(shared_alloc(&sa, SIZE_MAX) == NULL);
+  /* If it dies in the middle of an operation, the arena can't be used. */
+  char *x4 = shared_alloc(&sa, 16);
+  pid = fork();
+  if (pid == 0) {
+    shared_lock(&sa);
+    _exit(0);
+  }
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(shared_alloc(&sa, 16) == NULL);
+  assert(sa.hdr->broken);
+  shared_free(&sa, x4);
+  assert(sa.hdr->top > shared_offset(&sa, x4));
+  shared_arena_close(&sa);
+
+  reset_heap();
+  dbg("TEST: Created arenas\n");
+  Arena *ca1 = arena_create();
+  Arena *ca2 = arena_create();
+  word_t *n1 = arena_alloc(ca1, 64);
+  word_t *n2 = arena_alloc(ca2, 64);
+  word_t *n3 = arena_alloc(ca1, 3 * CHUNK_SIZE);
+  /* Each arena has chunks of its own. */
+  assert(arena_of(mem_hdr(n1)) == ca1 && arena_of(mem_hdr(n2)) == ca2);
+  assert(arena_of(mem_hdr(n3)) == ca1);
+  assert(chunk_of(mem_hdr(n1)) != chunk_of(mem_hdr(n2)));
+  /* Freed blocks go back to their arena, not into the thread cache. */
+  size_t saved_tcache = conf.tcache;
+  conf.tcache = 64;
+  wfree(n1);
+  assert(ca1->free_list == mem_hdr(n1));
+  assert(arena_alloc(ca2, 64) != n1);
+  assert(arena_alloc(ca1, 64) == n1);
+  conf.tcache = saved_tcache;
+  /* Resetting frees all blocks of an arena at once. */
+  arena_reset(ca1);
+  assert(ca1->chunks == NULL && ca1->free_list == NULL);
+  assert(arena_alloc(ca1, 64) != NULL);
+  *n2 = 42;
+  arena_destroy(ca1);
+  arena_destroy(ca2);
+
+  reset_heap();
+  dbg("TEST: Scopes\n");
+  Arena *sc1 = arena_create();
+  Arena *sc2 = arena_create();
+  assert(arena_scope_enter(sc1) == NULL);
+  /* malloc and its friends allocate from the scope's arena. */
+  word_t *sp1 = malloc(100);
+  word_t *sp2 = calloc(4, 8);
+  assert(arena_of(mem_hdr(sp1)) == sc1 && arena_of(mem_hdr(sp2)) == sc1);
+  sp1 = realloc(sp1, 1000);
+  assert(arena_of(mem_hdr(sp1)) == sc1);
+  /* Even large blocks, which would get a mapping of their own. */
+  size_t saved_threshold = conf.mmap_threshold;
+  conf.mmap_threshold = 4096;
+  word_t *sp3 = malloc(8192);
+  assert(arena_of(mem_hdr(sp3)) == sc1 && !chunk_of(mem_hdr(sp3))->mapped);
+  conf.mmap_threshold = saved_threshold;
+  /* Scopes nest. */
+  assert(arena_scope_enter(sc2) == sc1);
+  word_t *sp4 = malloc(16);
+  assert(arena_of(mem_hdr(sp4)) == sc2);
+  arena_scope_leave(sc1);
+  assert(arena_of(mem_hdr(malloc(16))) == sc1);
+  arena_scope_leave(NULL);
+  /* Outside of the scope, blocks still go back to their arena. */
+  word_t *sp5 = malloc(16);
+  assert(arena_of(mem_hdr(sp5))->created == 0);
+  BlockHdr *sh3 = mem_hdr(sp3), *sh4 = mem_hdr(sp4);
+  free(sp3);
+  assert(sc1->free_list == sh3);
+  free(sp4);
+  assert(sc2->free_list == sh4);
+  free(sp5);
+  /* The whole request is freed at once. */
+  arena_reset(sc1);
+  assert(sc1->chunks == NULL);
+  arena_destroy(sc1);
+  arena_destroy(sc2);
+
+  reset_heap();
+  dbg("TEST: Leak report\n");
+  assert(report_class(1) == 0);
+  assert(report_class(8) == 0);
+  assert(report_class(9) == 1);
+  assert(report_class(16) == 1);
+  assert(report_class(17) == 2);
+  assert(report_class(4096) == 9);
+  Report r = {0};
+  report_block(&r, 24, 1);
+  report_block(&r, 32, 1);
+  report_block(&r, 16, 0);
+  assert(r.classes[2].live_blocks == 2);
+  assert(r.classes[2].live_bytes == 56);
+  assert(r.classes[1].free_blocks == 1);
+
+  /* Sample every allocation made through malloc. */
+  conf.prof_sample = 1;
+  void *l1 = malloc(24);
+  void *l2 = malloc(40);
+  void *l3 = calloc(2, 8);
+  free(l2);
+  int live = 0;
+  for (size_t i = 0; i < SAMPLE_MAX; i++) {
+    if (samples[i].mem == l1 || samples[i].mem == l3)
+      live++;
+    assert(samples[i].mem != l2);
+  }
+  assert(live == 2);
+  /* One live 24 byte block, a free 40 byte block and the 16 byte block. */
+  heap_report();
+  free(l1);
+  free(l3);
+  conf.prof_sample = 0;
+
+  dbg("TEST: Per-CPU caches\n");
+  conf.pcpu_cache = 2;
+  if (pcpu_init()) {
+    /* Stay on one CPU, so all operations use the same cache. */
+    cpu_set_t saved_cpus, one_cpu;
+    sched_getaffinity(0, sizeof(saved_cpus), &saved_cpus);
+    CPU_ZERO(&one_cpu);
+    CPU_SET(sched_getcpu(), &one_cpu);
+    sched_setaffinity(0, sizeof(one_cpu), &one_cpu);
+    reset_heap();
+
+    /* Small allocations are rounded up to their class. */
+    word_t *p1 = alloc(40);
+    assert(mem_hdr(p1)->size == 48);
+    Report before = {0}, after = {0};
+    walk_heap(report_heap_block, &before);
+    /* Freed blocks are cached, not put into the free list ... */
+    wfree(p1);
+    assert(!is_free(mem_hdr(p1)));
+    assert(thread_arena->free_list == NULL);
+    /* Reports count them as cached, not live. */
+    walk_heap(report_heap_block, &after);
+    report_pcpu_caches(&after);
+    ReportClass *b48 = &before.classes[report_class(48)];
+    ReportClass *a48 = &after.classes[report_class(48)];
+    assert(a48->live_blocks == b48->live_blocks - 1);
+    assert(a48->cached_blocks == b48->cached_blocks + 1);
+    /* ... and re-used for any allocation of the same class. */
+    word_t *p2 = alloc(33);
+    assert(p2 == p1);
+    wfree(p2);
+
+    /* The cache only holds two blocks per class. */
+    word_t *p[3];
+    for (int i = 0; i < 3; i++)
+      p[i] = alloc(48);
+    assert(p[0] == p1);
+    for (int i = 0; i < 3; i++)
+      wfree(p[i]);
+    assert(thread_arena->free_list == mem_hdr(p[2]));
+
+    /* Larger blocks aren't cached. */
+    word_t *p3 = alloc(PCPU_MAX_SIZE + PCPU_QUANTUM);
+    assert(mem_hdr(p3)->size == PCPU_MAX_SIZE + PCPU_QUANTUM);
+    wfree(p3);
+    /* It was merged into p[2]. */
+    assert(mem_hdr(p[2])->size == 48 + sizeof(BlockHdr) + PCPU_MAX_SIZE +
+                                     PCPU_QUANTUM);
+
+    size_t flushed = 0;
+    size_t len = sizeof(flushed);
+    assert(mallctl("pcpu.flush", &flushed, &len, NULL, 0) == 0);
+    assert(flushed == 2);
+    assert(mallctl("pcpu.flush", &flushed, &len, NULL, 0) == 0);
+    assert(flushed == 0);
+
+    sched_setaffinity(0, sizeof(saved_cpus), &saved_cpus);
+  }
+  conf.pcpu_cache = 0;
+
+  dbg("TEST: Thread caches\n");
+  reset_heap();
+  conf.tcache = 4;
+  conf.tcache_batch = 2;
+  BlockList *bin = &tcache.bins[pcpu_alloc_class(48)];
+  TransferClass *tc = &transfer[pcpu_alloc_class(48)];
+
+  /* An empty bin is filled with a whole batch from the arena. */
+  word_t *t1 = alloc(40);
+  assert(mem_hdr(t1)->size == 48);
+  assert(bin->count == 1);
+  wfree(t1);
+  assert(bin->count == 2);
+  assert(!is_free(mem_hdr(t1)));
+
+  word_t *t[6];
+  for (int i = 0; i < 6; i++)
+    t[i] = alloc(48);
+  assert(bin->count == 0);
+  /* A bin that grows beyond 4 blocks gives a batch to the transfer cache. */
+  for (int i = 0; i < 6; i++)
+    wfree(t[i]);
+  assert(bin->count == 4);
+  assert(tc->nbatches == 1);
+  assert(tc->batches[0].count == 2);
+  assert(thread_arena->free_list == NULL);
+
+  /* Flushing gives the blocks in the bin back to the arena. */
+  size_t tflushed = 0;
+  size_t tlen = sizeof(tflushed);
+  assert(mallctl("tcache.flush", &tflushed, &tlen, NULL, 0) == 0);
+  assert(tflushed == 4);
+  assert(bin->count == 0);
+  assert(thread_arena->free_list != NULL);
+
+  /*
+   * Now that the bin is empty, it's refilled with the batch from the
+   * transfer cache. Any other thread that runs out would do the same.
+   */
+  word_t *t2 = alloc(48);
+  assert(tc->nbatches == 0);
+  assert(bin->count == 1);
+  assert(t2 == t[4] || t2 == t[3]);
+  wfree(t2);
+  flush_tcache();
+
+  /* Bins grow by a batch every time they run empty, up to "tcache" blocks. */
+  conf.tcache = 8;
+  int c64 = pcpu_alloc_class(64);
+  assert(tcache.caps[c64] == 2);
+  /* Overflowing doesn't make them grow. */
+  word_t *o[4];
+  conf.tcache = 0;
+  for (int i = 0; i < 4; i++)
+    o[i] = alloc(64);
+  conf.tcache = 8;
+  for (int i = 0; i < 4; i++)
+    wfree(o[i]);
+  assert(tcache.caps[c64] == 2);
+  assert(tcache.bins[c64].count <= 2);
+  flush_tcache();
+  tcache.overflows[c64] = 0;
+  word_t *g[8];
+  for (int i = 0; i < 8; i++)
+    g[i] = alloc(64);
+  assert(tcache.caps[c64] == 8);
+  for (int i = 0; i < 8; i++)
+    wfree(g[i]);
+  assert(tcache.bins[c64].count == 8);
+
+  /* A bin that keeps overflowing at full capacity shrinks again. */
+  for (int i = 0; i < 16 && tcache.caps[c64] == 8; i++) {
+    conf.tcache = 0;
+    word_t *uncached = alloc(64);
+    conf.tcache = 8;
+    wfree(uncached);
+  }
+  assert(tcache.caps[c64] == 2);
+  assert(tcache.bins[c64].count <= 2);
+
+  /* Beyond "tcache_max", a bin grows at the expense of a colder one. */
+  for (int i = 0; i < 8; i++)
+    g[i] = alloc(64);
+  assert(tcache.caps[c64] == 8);
+  size_t saved_tcache_max = conf.tcache_max;
+  conf.tcache_max = tcache_capacity;
+  int c96 = pcpu_alloc_class(96);
+  word_t *h = alloc(96);
+  assert(tcache.caps[c96] == 4);
+  /* The bin for 48 bytes missed less often, so it shrinks first. */
+  assert(tcache.caps[pcpu_alloc_class(48)] == 2);
+  assert(tcache.caps[c64] == 6);
+  assert(tcache_capacity <= conf.tcache_max);
+  wfree(h);
+  for (int i = 0; i < 8; i++)
+    wfree(g[i]);
+  conf.tcache_max = saved_tcache_max;
+  flush_tcache();
+  conf.tcache = 0;
+
+  reset_heap();
+  dbg("TEST: Arenas\n");
+  assert(thread_arena == &arenas[0]);
+  /* Use more arenas than there might be CPUs. */
+  size_t saved_narenas = narenas;
+  narenas = 4;
+  pthread_t threads[3];
+  word_t *thread_mem[3];
+  for (int i = 0; i < 3; i++)
+    pthread_create(&threads[i], NULL, arena_thread, &thread_mem[i]);
+  for (int i = 0; i < 3; i++)
+    pthread_join(threads[i], NULL);
+
+  /* Each thread got an arena of its own. */
+  for (int i = 0; i < 3; i++) {
+    Arena *arena = arena_of(mem_hdr(thread_mem[i]));
+    assert(arena != thread_arena);
+    for (int j = 0; j < i; j++)
+      assert(arena != arena_of(mem_hdr(thread_mem[j])));
+  }
+
+  /*
+   * Freeing on another thread returns blocks to the arena they came
+   * from. They wait on its remote free stack until it's locked next.
+   */
+  for (int i = 0; i < 3; i++) {
+    Arena *arena = arena_of(mem_hdr(thread_mem[i]));
+    wfree(thread_mem[i]);
+    assert(arena->remote_frees == mem_hdr(thread_mem[i]));
+    assert(!is_free(mem_hdr(thread_mem[i])));
+    mutex_lock(&arena->lock);
+    reclaim_remote_frees(arena);
+    mutex_unlock(&arena->lock);
+    assert(arena->remote_frees == NULL);
+    assert(is_free(mem_hdr(thread_mem[i])));
+  }
+  assert(thread_arena->free_list == NULL);
+
+  /* The owner reclaims blocks in one batch on its next allocation. */
+  word_t *own[3];
+  for (int i = 0; i < 3; i++)
+    own[i] = alloc(64);
+  alloc(8); /* Avoids merging own[2] into the rest of the chunk. */
+  pthread_t freer;
+  pthread_create(&freer, NULL, free_thread, own);
+  pthread_join(freer, NULL);
+  assert(thread_arena->free_list == NULL);
+  assert(thread_arena->remote_frees == mem_hdr(own[2]));
+  word_t *o1 = alloc(64 * 3 + 2 * sizeof(BlockHdr));
+  assert(thread_arena->remote_frees == NULL);
+  assert(o1 == own[0]); /* All three were merged. */
+  wfree(o1);
+
+  /* With percpu_arena, allocations use the arena of the current CPU. */
+  conf.percpu_arena = 1;
+  int cpu = sched_getcpu();
+  word_t *r1 = alloc(8);
+  if (cpu == sched_getcpu())
+    assert(arena_of(mem_hdr(r1)) == &arenas[cpu % narenas]);
+  wfree(r1);
+  conf.percpu_arena = 0;
+  narenas = saved_narenas;
+
+  dbg("TEST: Lock statistics\n");
+  assert(mutex_wait_bucket(999) == 0);
+  assert(mutex_wait_bucket(1000) == 1);
+  assert(mutex_wait_bucket(2000) == 2);
+  assert(mutex_wait_bucket(UINT64_MAX) == MUTEX_WAIT_BUCKETS - 1);
+
+  /* The waiter has to wait until the mutex is unlocked. */
+  LockWaiter waiter = {MUTEX_INITIALIZER, 0};
+  mutex_lock(&waiter.mutex);
+  pthread_t waiter_thread;
+  assert(pthread_create(&waiter_thread, NULL, lock_thread, &waiter) == 0);
+  while (!waiter.started)
+    sched_yield();
+  nanosleep(&(struct timespec){0, 10000000}, NULL);
+  mutex_unlock(&waiter.mutex);
+  assert(pthread_join(waiter_thread, NULL) == 0);
+  MutexStats *ws = &waiter.mutex.stats;
+  assert(ws->acquired == 2);
+  assert(ws->contended == 1);
+  assert(ws->wait_ns >= 5000000);
+  assert(ws->max_wait_ns == ws->wait_ns);
+  assert(ws->waits[mutex_wait_bucket(ws->wait_ns)] == 1);
+
+  MutexStats locks;
+  size_t locks_len = sizeof(locks);
+  size_t arena_idx = thread_arena - arenas;
+  char locks_name[32];
+  snprintf(locks_name, sizeof(locks_name), "stats.locks.arena.%zu", arena_idx);
+  assert(mallctl(locks_name, &locks, &locks_len, NULL, 0) == 0);
+  size_t acquired = locks.acquired;
+  wfree(alloc(8));
+  assert(mallctl(locks_name, &locks, &locks_len, NULL, 0) == 0);
+  assert(locks.acquired == acquired + 2);
+  assert(mallctl("stats.locks.arena.64", &locks, &locks_len, NULL, 0) ==
+         ENOENT);
+  assert(mallctl("stats.locks.transfer.0", &locks, &locks_len, NULL, 0) == 0);
+  assert(mallctl("stats.locks.spare", &locks, &locks_len, NULL, 0) == 0);
+  /* The locks of this thread's cache count towards "stats.locks.tcache". */
+  conf.tcache = 4;
+  assert(mallctl("stats.locks.tcache", &locks, &locks_len, NULL, 0) == 0);
+  acquired = locks.acquired;
+  wfree(alloc(48));
+  assert(mallctl("stats.locks.tcache", &locks, &locks_len, NULL, 0) == 0);
+  assert(locks.acquired == acquired + 2);
+  flush_tcache();
+  conf.tcache = 0;
+  assert(mallctl("stats.locks.tcaches", &locks, &locks_len, NULL, 0) == 0);
+  assert(locks.acquired > 0);
+  assert(mallctl("stats.locks.background", &locks, &locks_len, NULL, 0) == 0);
+  assert(mallctl("stats.locks.sample", &locks, &locks_len, NULL, 0) == 0);
+  assert(locks.acquired > 0);
+  locks_len = sizeof(size_t);
+  assert(mallctl("stats.locks.spare", &locks, &locks_len, NULL, 0) == EINVAL);
+
+  dbg("TEST: Thread exit and idle thread caches\n");
+  conf.tcache = 4;
+  conf.tcache_batch = 2;
+  /* The blocks that a thread has cached are given back when it exits. */
+  HeapStats cached, exited;
+  pthread_t cacher;
+  assert(pthread_create(&cacher, NULL, tcache_thread, &cached) == 0);
+  assert(pthread_join(cacher, NULL) == 0);
+  heap_stats(&exited);
+  assert(exited.allocated <= cached.allocated - 4 * 48);
+  assert(tcaches == &tcache && tcache.next == NULL);
+
+  /* The cache of an idle thread is flushed by the background thread. */
+  wfree(alloc(48));
+  assert(bin->count > 0);
+  uint64_t now = monotonic_ns();
+  assert(scavenge_tcaches(now) == 0);
+  wfree(alloc(48));
+  /* Still in use. */
+  assert(scavenge_tcaches(now + conf.tcache_idle * 1000000) == 0);
+  assert(bin->count > 0);
+  assert(scavenge_tcaches(now + 2 * conf.tcache_idle * 1000000) > 0);
+  assert(bin->count == 0);
+
+  /* Before the exit report, the caches of all threads are flushed. */
+  atomic_int cacher_state = 0;
+  assert(pthread_create(&cacher, NULL, cached_thread, &cacher_state) == 0);
+  while (cacher_state != 1)
+    sched_yield();
+  wfree(alloc(48));
+  assert(flush_tcaches() >= 2);
+  assert(bin->count == 0);
+  cacher_state = 2;
+  assert(pthread_join(cacher, NULL) == 0);
+  conf.tcache = 0;
+
+  dbg("TEST: Background thread\n");
+  /* Within a budget of 50%, a pass that took 1ms is followed by 1ms of sleep. */
+  conf.bg_interval = 0;
+  conf.bg_budget = 50;
+  assert(background_sleep_ns(1000000) == 1000000);
+  conf.bg_interval = 3600 * 1000; /* Only run passes by hand for now. */
+
+  int on = 1;
+  assert(mallctl("background_thread", NULL, NULL, &on, sizeof(on)) == 0);
+  on = 0;
+  size_t on_len = sizeof(on);
+  assert(mallctl("background_thread", &on, &on_len, NULL, 0) == 0);
+  assert(on == 1);
+
+  /* Freeing only puts blocks into the free list now. */
+  word_t *b[3];
+  for (int i = 0; i < 3; i++)
+    b[i] = alloc(page_size());
+  word_t *guard = alloc(page_size()); /* Keeps b[2] off the top. */
+  for (int i = 0; i < 3; i++)
+    wfree(b[i]);
+  for (int i = 0; i < 3; i++)
+    assert(is_free(mem_hdr(b[i])));
+
+  /* A pass merges them (and any free neighbors) and purges their pages. */
+  size_t passes = 0;
+  size_t passes_len = sizeof(passes);
+  background_pass();
+  assert(mallctl("stats.background_thread.passes", &passes, &passes_len, NULL,
+                 0) == 0);
+  assert(passes == 1);
+  assert(!is_free(mem_hdr(b[1])) && !is_free(mem_hdr(b[2])));
+  BlockHdr *merged = NULL;
+  for (BlockHdr *blk = thread_arena->free_list; blk != NULL; blk = blk->prev) {
+    if (user_mem(blk) <= b[0] &&
+        (char *)user_mem(blk) + blk->size >= (char *)b[2] + page_size())
+      merged = blk;
+  }
+  assert(merged != NULL);
+  wfree(guard);
+
+  /* With headroom, a pass maps spare chunks for arenas that run out. */
+  conf.headroom = 4 * CHUNK_SIZE;
+  conf.headroom_prefault = 1;
+  background_pass();
+  assert(nspare == 1);
+  char *spare = spare_chunks;
+  Chunk *spare_chunk = map_chunk(thread_arena, 0);
+  assert((char *)spare_chunk == spare);
+  assert(nspare == 0);
+  /* Taking a chunk counts as growth, so the next pass maps more. */
+  map_chunk(thread_arena, 0);
+  background_pass();
+  assert(nspare == 2);
+  conf.headroom = 0;
+  conf.headroom_prefault = 0;
+
+  /* The thread makes passes on its own. */
+  on = 0;
+  assert(mallctl("background_thread", NULL, NULL, &on, sizeof(on)) == 0);
+  conf.bg_interval = 1;
+  on = 1;
+  assert(mallctl("background_thread", NULL, NULL, &on, sizeof(on)) == 0);
+  for (int i = 0; i < 1000 && background_passes < 3; i++)
+    usleep(1000);
+  assert(background_passes >= 3);
+  on = 0;
+  assert(mallctl("background_thread", NULL, NULL, &on, sizeof(on)) == 0);
+  assert(!background_running);
+  conf.bg_interval = 100;
+  conf.bg_budget = 10;
 
   return 0;
 }
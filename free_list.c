@@ -12,15 +12,15 @@
 
 /* For tests. */
 #include <stdio.h>
+#include <string.h>
 
-/* How to search for free blocks. */
-#define FIRST_FIT 0
-#define NEXT_FIT 1
-#define BEST_FIT 2
-
-#ifndef SEARCH_MODE
-#define SEARCH_MODE BEST_FIT
-#endif
+/* FIRST_FIT etc. and the default SEARCH_MODE. */
+#include "conf.h"
+#include "ctl.h"
+#include "backend.h"
+#include "decay.h"
+#include "headroom.h"
+#include "os.h"
 
 /* A boolean. */
 typedef enum { true = 7, false = 0 } bool;
@@ -35,7 +35,8 @@ typedef struct {
    * sizeof(word_t) bytes. The LSB is used to encode
    * whether the block is used. If so, it's set; otherwise,
    * it's 0. The second lowest byte is set if this block
-   * is the last one in the chain.
+   * is the last one in the chain. The third lowest bit is
+   * set if the block is free and its pages were purged.
    */
   uint64_t hdr;
 
@@ -96,6 +97,25 @@ void unset_lastb(Block *blk) {
   blk->hdr |= 2;
 }
 
+/* Return TRUE if the pages of the given free block were purged. */
+bool purgedb(Block *blk) {
+  if (blk->hdr & 4) {
+    return true;
+  } else {
+    return false;
+  }
+}
+
+/* Set the given block to "purged". */
+void set_purgedb(Block *blk) {
+  blk->hdr |= 4;
+}
+
+/* Set the given block to "dirty", i.e., not purged. */
+void unset_purgedb(Block *blk) {
+  blk->hdr &= ~4;
+}
+
 /* Return the next block after the given one. */
 Block *nextb(Block *blk) {
   if ((blk->hdr & 2) == 0) {
@@ -106,83 +126,218 @@ Block *nextb(Block *blk) {
 }
 
 /*
- * The first node in the free list. This is where
- * the search for free nodes starts in FIRST_FIT.
+ * A heap. Every heap has its own blocks and its own memory, which
+ * it gets from its backend. ALLOC and FREE_ use the main heap, which
+ * grows with the program break by default. HEAP_CREATE makes more
+ * heaps, e.g. one per subsystem, so that their blocks don't fragment
+ * each other's memory. A heap has no lock. Only one thread may use
+ * it at a time.
  */
-static Block *free_list_start = NULL;
+typedef struct {
+  /*
+   * The first node in the free list. This is where
+   * the search for free nodes starts in FIRST_FIT.
+   */
+  Block *start;
+
+  /*
+   * The top node in the free list. This is where
+   * new allocations are added.
+   */
+  Block *top;
+
+  /*
+   * The last block that was successfully found by NEXT_FIT.
+   * It's the starting point of the next search.
+   */
+  Block *next_fit_start;
+
+  /*
+   * The end of the last block. Memory from here up to the
+   * break is headroom (see headroom.h).
+   */
+  char *end;
+  Headroom headroom;
+
+  /* Bytes freed over time, for the "decay" option. */
+  Decay decay;
+
+  /*
+   * Where the heap gets its memory from (see backend.h). By default,
+   * the main heap uses the program break, and other heaps a range of
+   * reserved address space of their own. With the "vm_reserve"
+   * option, all of them reserve that many bytes.
+   */
+  Backend default_backend;
+  Backend *backend;
+} Heap;
+
+/* Address space that heaps other than the main one reserve by default. */
+#define HEAP_RESERVE ((size_t) 1 << 30)
+
+static Heap main_heap;
+
+/* The backend of heap H, with its range set up. */
+Backend *heap_backend(Heap *h) {
+  if (h->backend == NULL) {
+    if (conf.vm_reserve > 0) {
+      h->default_backend = mmap_backend(conf.vm_reserve);
+    } else if (h == &main_heap) {
+      h->default_backend = sbrk_backend();
+    } else {
+      h->default_backend = mmap_backend(HEAP_RESERVE);
+    }
+    h->backend = &h->default_backend;
+  }
+  if (h->backend->base == NULL &&
+      h->backend->ops->reserve(h->backend, sizeof(word_t)) != 0 &&
+      h == &main_heap && h->backend == &h->default_backend) {
+    /* Without the address space, the break will have to do. */
+    h->default_backend = sbrk_backend();
+    h->default_backend.ops->reserve(&h->default_backend, sizeof(word_t));
+  }
+  return h->backend;
+}
+
+/* Move the break of heap H by INCR bytes, like sbrk. */
+void *heap_sbrk(Heap *h, ptrdiff_t incr) {
+  Backend *b = heap_backend(h);
+  if (b->base == NULL) {
+    return (void*) -1;
+  }
+  return b->ops->grow(b, incr);
+}
+
+/* Move the break of heap H to ADDR, like brk. */
+int heap_set_brk(Heap *h, void *addr) {
+  Backend *b = heap_backend(h);
+  return b->ops->shrink(b, addr);
+}
 
 /*
- * The top node in the free list. This is where
- * new allocations are added.
+ * Free all blocks of heap H at once and give its memory back
+ * to its backend. The heap can be used again right away.
  */
-static Block *free_list_top = NULL;
+void heap_reset(Heap *h) {
+  if (h->start != NULL) {
+    heap_set_brk(h, h->start);
+    h->next_fit_start = NULL;
+    h->top = NULL;
+    h->start = NULL;
+    h->end = NULL;
+    h->decay = (Decay) {0};
+  }
+  if (h->backend != NULL) {
+    h->backend->ops->destroy(h->backend);
+    if (h->backend == &h->default_backend) {
+      h->backend = NULL;
+    }
+  }
+}
 
-#if SEARCH_MODE == NEXT_FIT
 /*
- * The last block that was successfully found by NEXT_FIT.
- * It's the starting point of the next search.
+ * Make a new heap that gets its memory from B, or from the
+ * default backend if B is NULL. Return NULL if the OS has
+ * no memory for it.
  */
-static Block *next_fit_start = NULL;
-#endif
+Heap *heap_create(Backend *b) {
+  Heap *h = mmap(NULL, sizeof(Heap), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (h == MAP_FAILED) {
+    return NULL;
+  }
+  h->backend = b;
+  return h;
+}
 
+/* Give heap H and all of its memory back. */
+void heap_destroy(Heap *h) {
+  heap_reset(h);
+  munmap(h, sizeof(Heap));
+}
+
+/*
+ * Take the memory of heap H from B from now on, or from the
+ * default backend if B is NULL. The heap is reset.
+ */
+void heap_set_backend(Heap *h, Backend *b) {
+  heap_reset(h);
+  h->backend = b;
+}
+
+/* Reset the main heap. */
 void reset_heap(void) {
-  if (free_list_start == NULL) {
-    return;
-  } else {
-    brk(free_list_start);
-    #if SEARCH_MODE == NEXT_FIT
-    next_fit_start = NULL;
-    #endif
-    free_list_top = NULL;
-    free_list_start = NULL;
-  }
+  heap_reset(&main_heap);
 }
 
 /***********************/
 /* Finding free blocks */
 /***********************/
 
-#if SEARCH_MODE == FIRST_FIT
+/*
+ * All of them prefer dirty blocks over blocks whose pages were
+ * purged. Those would have to be faulted in again.
+ */
+
 /* Implementation of FIND_BLOCK using the "first fit" algorithm. */
-Block *first_fit(ptrdiff_t size) {
-  Block *blk = free_list_start;
+Block *first_fit(Heap *h, ptrdiff_t size) {
+  Block *blk = h->start;
+  Block *purged = NULL;
 
   while (blk != NULL) {
     if (usedb(blk) || sizeb(blk) < size) {
       blk = nextb(blk);
+    } else if (purgedb(blk)) {
+      if (purged == NULL) {
+	purged = blk;
+      }
+      blk = nextb(blk);
     } else {
       return blk;
     }
   }
 
-  return NULL;
+  return purged;
 }
-#endif
 
-#if SEARCH_MODE == NEXT_FIT
 /* Implementation of FIND_BLOCK using the "next fit" algorithm. */
-Block *next_fit(ptrdiff_t size) {
-  Block *blk = next_fit_start;
+Block *next_fit(Heap *h, ptrdiff_t size) {
+  /*
+   * The search mode may have been changed at runtime,
+   * after the heap was created. Start at the beginning then.
+   */
+  if (h->next_fit_start == NULL) {
+    h->next_fit_start = h->start;
+  }
+
+  Block *blk = h->next_fit_start;
+  Block *purged = NULL;
 
   while (blk != NULL) {
-    if (usedb(blk) || sizeb(blk) < size) {
+    if (usedb(blk) || sizeb(blk) < size || purgedb(blk)) {
+      if (usedb(blk) == false && sizeb(blk) >= size && purged == NULL) {
+	purged = blk;
+      }
       if (nextb(blk) == NULL) {
 	/* At the end of the free list, wrap around to the start. */
-	blk = free_list_start;
+	blk = h->start;
       } else {
 	blk = nextb(blk);
       }
 
-      if (blk == next_fit_start) {
+      if (blk == h->next_fit_start) {
 	/* Stop after one full loop. */
-	return NULL;
+	if (purged != NULL) {
+	  h->next_fit_start = purged;
+	}
+	return purged;
       }
     } else {
       /*
        * The next time this function is called,
        * start at the block that is now returned.
        */
-      next_fit_start = blk;
+      h->next_fit_start = blk;
       return blk;
     }
   }
@@ -190,16 +345,20 @@ Block *next_fit(ptrdiff_t size) {
   /* In case NEXT_FIT_START is NULL: */
   return NULL;
 }
-#endif
 
-#if SEARCH_MODE == BEST_FIT
 /* Implementation of FIND_BLOCK using the "best fit" algorithm. */
-Block *best_fit(ptrdiff_t size) {
-  /* The free block that fits the size best. */
+Block *best_fit(Heap *h, ptrdiff_t size) {
+  /* The free blocks that fit the size best, dirty and purged. */
   Block *best_blk = NULL;
+  Block *best_purged = NULL;
 
-  for (Block *blk = free_list_start; blk != NULL; blk = nextb(blk)) {
-    if (usedb(blk) == false) {
+  for (Block *blk = h->start; blk != NULL; blk = nextb(blk)) {
+    if (usedb(blk) == false && purgedb(blk)) {
+      if (sizeb(blk) >= size
+	  && (best_purged == NULL || sizeb(blk) < sizeb(best_purged))) {
+	best_purged = blk;
+      }
+    } else if (usedb(blk) == false) {
       if (sizeb(blk) == size) {
 	/* Cannot find a better fit. */
 	return blk;
@@ -215,23 +374,23 @@ Block *best_fit(ptrdiff_t size) {
     }
   }
 
-  return best_blk;
+  return best_blk != NULL ? best_blk : best_purged;
 }
-#endif
 
 /*
- * Find a block of allocated by unused memory.
+ * Find a block of allocated by unused memory in heap H.
  * The block must have at least a size of SIZE bytes.
  * Return NULL if there is no such block.
  */
-Block *find_block(ptrdiff_t size) {
-  #if SEARCH_MODE == FIRST_FIT
-  return first_fit(size);
-  #elif SEARCH_MODE == NEXT_FIT
-  return next_fit(size);
-  #else
-  return best_fit(size);
-  #endif
+Block *find_block(Heap *h, ptrdiff_t size) {
+  switch (conf.fit) {
+  case FIRST_FIT:
+    return first_fit(h, size);
+  case NEXT_FIT:
+    return next_fit(h, size);
+  default:
+    return best_fit(h, size);
+  }
 }
 
 
@@ -251,20 +410,49 @@ ptrdiff_t alloc_size(ptrdiff_t size) {
   return size + SIZEOF_HDR;
 }
 
-/* Allocate a new block by requesting more heap memory from the OS */
-Block *request_block(ptrdiff_t size) {
-  /* Pointer to the start of this new block. */
-  Block *blk = sbrk(0);
+/* Allocate a new block by requesting more memory for heap H from the OS */
+Block *request_block(Heap *h, ptrdiff_t size) {
+  char *brk_now = heap_sbrk(h, 0);
+  bool first = false;
+  if (h->end == NULL) {
+    h->end = brk_now;
+    first = true;
+  }
 
   /*
    * Bump the program break pointer so that there
-   * is enough memory from the new block.
+   * is enough memory from the new block. With the
+   * "headroom" option, the break is moved further
+   * than that, so the next blocks fit without sbrk.
+   * The first time, it's moved by at least
+   * "prefault_heap" bytes, which are faulted in.
    */
   ptrdiff_t bytes_needed = alloc_size(size);
-  if (sbrk(bytes_needed) == (void*) -1) {
-    return NULL;
+  if (h->end + bytes_needed > brk_now) {
+    ptrdiff_t grow = h->end + bytes_needed - brk_now;
+    ptrdiff_t extra = 0;
+    if (conf.headroom > 0) {
+      extra = headroom_target(&h->headroom, page_size());
+    }
+    if (first && grow + extra < (ptrdiff_t) conf.prefault_heap) {
+      extra = conf.prefault_heap - grow;
+    }
+    if (heap_sbrk(h, grow + extra) == (void*) -1) {
+      extra = 0;
+      if (heap_sbrk(h, grow) == (void*) -1) {
+        return NULL;
+      }
+    }
+    /* The headroom is left to fault in lazily (see headroom.h). */
+    if ((first && conf.prefault_heap > 0) || conf.prefault) {
+      prefault_pages(brk_now, grow + extra);
+    }
   }
 
+  /* Pointer to the start of this new block. */
+  Block *blk = (Block *) h->end;
+  h->end += bytes_needed;
+  h->headroom.used += bytes_needed;
   return blk;
 }
 
@@ -289,7 +477,7 @@ bool can_split(Block *blk, ptrdiff_t size) {
    * the minimum amount of memory for another block can fit in
    * it, then the given block can be split into two.
    */
-  return SIZEOF_HDR + size + sizeof(word_t) <= sizeb(blk);
+  return (ptrdiff_t) (SIZEOF_HDR + size + conf.min_split) <= sizeb(blk);
 }
 
 /*
@@ -318,17 +506,26 @@ void split_block(Block *blk, ptrdiff_t size) {
 
   unset_usedb(free_blk);
   assert(usedb(free_blk) == false);
+
+  /* Most of the pages of the rest are as they were. */
+  if (purgedb(blk)) {
+    set_purgedb(free_blk);
+  } else {
+    unset_purgedb(free_blk);
+  }
   
   set_sizeb(blk, size);
 }
 
 /*
- * Allocate SIZE bytes in a word aligned, contiguous buffer.
+ * Allocate SIZE bytes of heap H in a word aligned, contiguous buffer.
  * Return NULL if
  *  (a) SIZE is less than or equal to 0;
  *  (b) the program is out of memory (OOM).
  */
-word_t *alloc(ptrdiff_t size) {
+word_t *heap_alloc(Heap *h, ptrdiff_t size) {
+  conf_init();
+
   if (size <= 0) {
     return NULL;
   }
@@ -337,14 +534,15 @@ word_t *alloc(ptrdiff_t size) {
   size = align(size);
 
   Block *blk;
-  if ((blk = find_block(size)) != NULL) {
+  if ((blk = find_block(h, size)) != NULL) {
     if (can_split(blk, size)) {
       split_block(blk, size);
     }
     set_usedb(blk);
+    unset_purgedb(blk);
     return &blk->data;
   } else {
-    blk = request_block(size);
+    blk = request_block(h, size);
     if (blk == NULL) {
       return NULL;
     }
@@ -353,13 +551,12 @@ word_t *alloc(ptrdiff_t size) {
     set_sizeb(blk, size);
     set_usedb(blk);
     set_lastb(blk);
+    unset_purgedb(blk);
 
     /* Initialize the heap if this is the first call. */
-    if (free_list_start == NULL) {
-      free_list_start = blk;
-      #if SEARCH_MODE == NEXT_FIT
-      next_fit_start = blk;
-      #endif
+    if (h->start == NULL) {
+      h->start = blk;
+      h->next_fit_start = blk;
     }
 
     /*
@@ -367,10 +564,10 @@ word_t *alloc(ptrdiff_t size) {
      * of the list that it's not on top any more
      * and make the new block the top of the list.
      */
-    if (free_list_top != NULL) {
-      unset_lastb(free_list_top);
+    if (h->top != NULL) {
+      unset_lastb(h->top);
     }
-    free_list_top = blk;
+    h->top = blk;
 
     /* Give the user their memory. */
     return &blk->data;
@@ -400,25 +597,182 @@ bool can_coalesce(Block *blk) {
  * Merge BLK with the next block for freeing.
  * Only call this function if CAN_COALESCE returns true.
  */
-void coalesce(Block *blk) {
+void coalesce(Heap *h, Block *blk) {
   assert(can_coalesce(blk));
-  set_sizeb(blk, sizeb(blk) + sizeb(nextb(blk)) + SIZEOF_HDR);
-  if (nextb(nextb(blk)) == NULL) {
+  Block *next = nextb(blk);
+  set_sizeb(blk, sizeb(blk) + sizeb(next) + SIZEOF_HDR);
+  if (nextb(next) == NULL) {
     set_lastb(blk);
   }
+
+  /* Don't leave pointers to the header that was merged away. */
+  if (h->top == next) {
+    h->top = blk;
+  }
+  if (h->next_fit_start == next) {
+    h->next_fit_start = blk;
+  }
 }
 
-/* Free memory that was allocated by ALLOC. */
-void free_(word_t *data) {
+/*
+ * Give free blocks at the top of heap H back to the OS.
+ * Return the number of bytes that were released.
+ */
+ptrdiff_t trim_heap(Heap *h) {
+  ptrdiff_t released = 0;
+
+  while (h->top != NULL && usedb(h->top) == false) {
+    Block *top = h->top;
+    released += sizeb(top) + SIZEOF_HDR;
+
+    if (top == h->start) {
+      /* The heap is empty now. */
+      heap_reset(h);
+      break;
+    }
+
+    /* The block before the top becomes the new top. */
+    Block *prev = h->start;
+    while (nextb(prev) != top) {
+      prev = nextb(prev);
+    }
+    set_lastb(prev);
+    h->top = prev;
+    if (h->next_fit_start == top) {
+      h->next_fit_start = h->start;
+    }
+    /* The headroom above TOP goes back, too. */
+    heap_set_brk(h, top);
+    h->end = (char *) top;
+  }
+
+  return released;
+}
+
+/*
+ * Purge free blocks, from the bottom of heap H up, until
+ * no more dirty bytes are left than DECAY_LIMIT allows.
+ * Return the number of bytes that were purged.
+ */
+ptrdiff_t decay_heap(Heap *h, uint64_t now) {
+  size_t dirty = 0;
+  for (Block *blk = h->start; blk != NULL; blk = nextb(blk)) {
+    if (usedb(blk) == false && purgedb(blk) == false) {
+      dirty += whole_pages(&blk->data, sizeb(blk));
+    }
+  }
+
+  size_t limit = decay_limit(&h->decay, now);
+  ptrdiff_t released = 0;
+  for (Block *blk = h->start; blk != NULL && dirty > limit;
+       blk = nextb(blk)) {
+    size_t bytes = whole_pages(&blk->data, sizeb(blk));
+    if (usedb(blk) == false && purgedb(blk) == false && bytes > 0) {
+      released += decay_purge(&blk->data, sizeb(blk));
+      set_purgedb(blk);
+      dirty -= bytes;
+    }
+  }
+  return released;
+}
+
+/* Free memory that HEAP_ALLOC allocated in heap H. */
+void heap_free(Heap *h, word_t *data) {
   if (data == NULL)
     return;
 
   Block *blk = block_header(data);
+  size_t freed = whole_pages(&blk->data, sizeb(blk));
   if (can_coalesce(blk)) {
-    coalesce(blk);
+    coalesce(h, blk);
   }
 
   unset_usedb(blk);
+  unset_purgedb(blk);
+
+  if (conf.decay > 0 && freed > 0) {
+    uint64_t now = decay_now();
+    decay_freed(&h->decay, freed, now);
+    if (decay_due(&h->decay, now)) {
+      decay_heap(h, now);
+    }
+  }
+
+  if (conf.trim_threshold > 0 && blk == h->top
+      && sizeb(blk) >= (ptrdiff_t) conf.trim_threshold) {
+    trim_heap(h);
+  }
+}
+
+/* Allocate SIZE bytes in the main heap, like HEAP_ALLOC. */
+word_t *alloc(ptrdiff_t size) {
+  return heap_alloc(&main_heap, size);
+}
+
+/* Free memory that was allocated by ALLOC. */
+void free_(word_t *data) {
+  heap_free(&main_heap, data);
+}
+
+
+/*************************/
+/* Introspection (ctl.h) */
+/*************************/
+
+void heap_stats(HeapStats *st) {
+  st->allocated = st->free = st->mapped = 0;
+  for (Block *blk = main_heap.start; blk != NULL; blk = nextb(blk)) {
+    if (usedb(blk)) {
+      st->allocated += sizeb(blk);
+    } else {
+      st->free += sizeb(blk);
+    }
+    st->mapped += sizeb(blk) + SIZEOF_HDR;
+  }
+  if (main_heap.end != NULL) {
+    /* Headroom */
+    st->mapped += (char *) heap_sbrk(&main_heap, 0) - main_heap.end;
+  }
+}
+
+/* The main heap is arena 0. Other heaps are out of reach. */
+ptrdiff_t purge_arena(size_t idx) {
+  if (idx != 0) {
+    return -1;
+  }
+
+  ptrdiff_t released = 0;
+  for (Block *blk = main_heap.start; blk != NULL; blk = nextb(blk)) {
+    /* Blocks that were purged before have no pages left to give back. */
+    if (usedb(blk) == false && purgedb(blk) == false
+        && whole_pages(&blk->data, sizeb(blk)) > 0) {
+      released += purge_pages(&blk->data, sizeb(blk));
+      set_purgedb(blk);
+    }
+  }
+  return released;
+}
+
+ptrdiff_t trim_arena(size_t idx) {
+  if (idx != 0) {
+    return -1;
+  }
+  return trim_heap(&main_heap);
+}
+
+ptrdiff_t decay_arena(size_t idx) {
+  if (idx != 0) {
+    return -1;
+  }
+  return decay_heap(&main_heap, decay_now());
+}
+
+static const CtlEntry ctl_table[] = { CTL_COMMON };
+
+int mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp,
+	    size_t newlen) {
+  return ctl_dispatch(ctl_table, CTL_LEN(ctl_table), name,
+		      oldp, oldlenp, newp, newlen);
 }
 
 
@@ -489,9 +843,9 @@ int main(void) {
   free_(o1);
   free_(o2);
   word_t *o3 = alloc(16);
-  assert(next_fit_start == block_header(o3));
+  assert(main_heap.next_fit_start == block_header(o3));
   word_t *o4 = alloc(16);
-  assert(next_fit_start == block_header(o4));
+  assert(main_heap.next_fit_start == block_header(o4));
   #endif
 
   #if SEARCH_MODE == BEST_FIT
@@ -518,5 +872,259 @@ int main(void) {
   assert(nextb(z5_hdr) == after_z1);
   #endif
 
+  reset_heap();
+  printf("Test runtime configuration\n");
+  Conf saved_conf = conf;
+  conf_parse(&conf, "fit:first,min_split:32");
+  assert(conf.fit == FIRST_FIT);
+  assert(conf.min_split == 32);
+  /* Invalid options are skipped and don't change anything. */
+  conf_parse(&conf, "fit:worst,min_split:12x,bogus:1");
+  assert(conf.fit == FIRST_FIT);
+  assert(conf.min_split == 32);
+  alloc(8);
+  word_t *c1 = alloc(64);
+  alloc(8); /* Avoids coalescing. */
+  word_t *c2 = alloc(16);
+  alloc(8);
+  free_(c1);
+  free_(c2);
+  /* First fit picks c1 even though c2 fits better. */
+  word_t *c3 = alloc(16);
+  assert(c3 == c1);
+  /* The remainder of 64 - 16 - SIZEOF_HDR bytes is large enough to split. */
+  Block *c3_rem = nextb(block_header(c3));
+  assert(sizeb(c3_rem) == 64 - 16 - SIZEOF_HDR);
+  /* But it's too small to be split again with MIN_SPLIT = 32. */
+  word_t *c4 = alloc(16);
+  assert(block_header(c4) == c3_rem);
+  assert(sizeb(c3_rem) == 64 - 16 - SIZEOF_HDR);
+  conf = saved_conf;
+
+  reset_heap();
+  printf("Test mallctl\n");
+  size_t val = 0;
+  size_t len = sizeof(val);
+  word_t *s1 = alloc(16);
+  word_t *s2 = alloc(page_size() * 4);
+  alloc(8); /* Avoids trimming s2. */
+  assert(mallctl("stats.allocated", &val, &len, NULL, 0) == 0);
+  assert(val == 16 + page_size() * 4 + 8);
+  free_(s2);
+  assert(mallctl("stats.free", &val, &len, NULL, 0) == 0);
+  assert(val == page_size() * 4);
+  assert(mallctl("stats.mapped", &val, &len, NULL, 0) == 0);
+  assert(val == 16 + page_size() * 4 + 8 + 3 * SIZEOF_HDR);
+  /* Stats are read-only and sizes must match. */
+  assert(mallctl("stats.mapped", NULL, NULL, &val, sizeof(val)) == EPERM);
+  len = sizeof(int);
+  assert(mallctl("stats.mapped", &val, &len, NULL, 0) == EINVAL);
+  len = sizeof(val);
+  assert(mallctl("stats.nothing", &val, &len, NULL, 0) == ENOENT);
+  /* At least 3 of the 4 pages of s2 are somewhere in the middle of it. */
+  assert(mallctl("arena.0.purge", &val, &len, NULL, 0) == 0);
+  assert(val >= page_size() * 3);
+  /* Purging again skips the blocks that are purged already. */
+  assert(mallctl("arena.0.purge", &val, &len, NULL, 0) == 0);
+  assert(val == 0);
+  assert(mallctl("arena.1.purge", NULL, NULL, NULL, 0) == ENOENT);
+  /* Trimming releases free blocks at the top of the heap. */
+  free_(s1);
+  assert(mallctl("arena.0.trim", &val, &len, NULL, 0) == 0);
+  assert(val == 0);
+  /* Write and read options. */
+  size_t threshold = 64;
+  assert(mallctl("opt.trim_threshold", NULL, NULL, &threshold, len) == 0);
+  assert(conf.trim_threshold == 64);
+  assert(mallctl("opt.trim_threshold", NULL, NULL, &threshold, 4) == EINVAL);
+  /* Options that shape the heap can't be changed while it's in use. */
+  int fit = NEXT_FIT;
+  assert(mallctl("opt.fit", NULL, NULL, &fit, sizeof(fit)) == EPERM);
+  assert(mallctl("opt.classes", NULL, NULL, &fit, sizeof(fit)) == EPERM);
+  assert(mallctl("opt.vm_reserve", NULL, NULL, &threshold, len) == EPERM);
+  assert(conf.vm_reserve == 0);
+  /* With a trim threshold, freeing a large top block shrinks the heap. */
+  word_t *s3 = alloc(page_size() * 8); /* Doesn't fit into s2. */
+  Block *s3_blk = block_header(s3);
+  free_(s3);
+  assert(main_heap.top != s3_blk);
+  assert(sbrk(0) == (void *) s3_blk);
+  conf = saved_conf;
+
+  reset_heap();
+  printf("Test headroom\n");
+  conf.headroom = page_size() * 4;
+  conf.headroom_prefault = true;
+  word_t *h1 = alloc(16);
+  /* The break moved up by more than the block needs ... */
+  char *h_brk = sbrk(0);
+  assert(h_brk >= main_heap.end + page_size());
+  /* ... but the allocation didn't pay for faulting all of that in. */
+  char *h_lazy = (char *) page_up((uintptr_t) main_heap.end);
+  assert(resident_bytes(h_lazy, h_brk - h_lazy) == 0);
+  /* ... so the next blocks don't have to move it. */
+  word_t *h2 = alloc(64);
+  assert(block_header(h2) == nextb(block_header(h1)));
+  assert(sbrk(0) == h_brk);
+  assert(mallctl("stats.mapped", &val, &len, NULL, 0) == 0);
+  assert(val == (size_t) (h_brk - (char *) block_header(h1)));
+  /* Trimming gives the headroom back, too. */
+  free_(h2);
+  assert(mallctl("arena.0.trim", &val, &len, NULL, 0) == 0);
+  assert(sbrk(0) == (void *) block_header(h2));
+  conf = saved_conf;
+
+  reset_heap();
+  printf("Test decay\n");
+  conf.decay = 1000;
+  uint64_t now = decay_now();
+  uint64_t later = now + 2000ull * 1000000;
+  /* Freshly freed bytes may all stay dirty; after "decay" ms none may. */
+  Decay d = {0};
+  decay_freed(&d, 1000, now);
+  assert(decay_limit(&d, now) == 1000);
+  size_t half = decay_limit(&d, now + 500ull * 1000000);
+  assert(half > 0 && half < 1000);
+  assert(decay_limit(&d, later) == 0);
+  word_t *d1 = alloc(page_size() * 4);
+  alloc(8); /* Avoids coalescing. */
+  word_t *d2 = alloc(page_size() * 4);
+  alloc(8);
+  word_t *d3 = alloc(page_size() * 4);
+  alloc(8);
+  free_(d1);
+  free_(d2);
+  /* Nothing has decayed yet. */
+  assert(mallctl("arena.0.decay", &val, &len, NULL, 0) == 0);
+  assert(val == 0);
+  assert(purgedb(block_header(d1)) == false);
+  /* Once the decay time has passed, all of them are purged. */
+  assert(decay_heap(&main_heap, later) >= (ptrdiff_t) (page_size() * 6));
+  assert(purgedb(block_header(d1)) && purgedb(block_header(d2)));
+  /* A dirty block is reused before purged ones. */
+  free_(d3);
+  assert(purgedb(block_header(d3)) == false);
+  assert(alloc(page_size() * 4) == d3);
+  #if SEARCH_MODE == NEXT_FIT
+  /* Next fit goes past the purged blocks and goes on from d3. */
+  assert(main_heap.next_fit_start == block_header(d3));
+  #endif
+  /* Purged blocks are still reused when they are all there is. */
+  word_t *d4 = alloc(page_size() * 4);
+  assert(d4 == d1 || d4 == d2);
+  assert(purgedb(block_header(d4)) == false);
+  #if SEARCH_MODE == NEXT_FIT
+  /* After a full loop, it goes on from the purged block it took. */
+  assert(main_heap.next_fit_start == block_header(d4));
+  #endif
+  conf = saved_conf;
+
+  reset_heap();
+  printf("Test address space reserve\n");
+  conf.vm_reserve = 64 << 20;
+  char *r_brk = sbrk(0);
+  word_t *r1 = alloc(16);
+  Backend *rb = heap_backend(&main_heap);
+  /* The heap starts at the bottom of the reserve, not at the break. */
+  assert((char *) block_header(r1) == rb->base);
+  assert(sbrk(0) == r_brk);
+  assert(rb->commit == rb->base + BACKEND_COMMIT_STEP);
+  /* Growing past what's committed commits more. */
+  word_t *r2 = alloc(BACKEND_COMMIT_STEP * 2);
+  assert(block_header(r2) == nextb(block_header(r1)));
+  assert(rb->commit == (char *) page_up((uintptr_t) heap_sbrk(&main_heap, 0)));
+  memset(r2, 1, BACKEND_COMMIT_STEP * 2);
+  /* Trimming decommits. */
+  conf.trim_threshold = 64;
+  free_(r2);
+  assert(heap_sbrk(&main_heap, 0) == (void *) block_header(r2));
+  assert(rb->commit == (char *) page_up((uintptr_t) block_header(r2)));
+  /* The heap can't grow past the end of the reserve. */
+  assert(alloc(128 << 20) == NULL);
+  reset_heap();
+  assert(rb->base == NULL);
+  conf = saved_conf;
+
+  printf("Test backends\n");
+  /* With a buffer, the heap lives in the buffer ... */
+  static char buf[64 << 10];
+  Backend bb = buffer_backend(buf, sizeof(buf));
+  heap_set_backend(&main_heap, &bb);
+  char *k_brk = sbrk(0);
+  word_t *k1 = alloc(16);
+  assert((char *) k1 > buf && (char *) k1 < buf + sizeof(buf));
+  assert(sbrk(0) == k_brk);
+  /* ... and it can't grow past it. */
+  word_t *k2 = alloc(4096);
+  assert(block_header(k2) == nextb(block_header(k1)));
+  assert(alloc(sizeof(buf)) == NULL);
+  /* Trimming moves the break, but the buffer keeps its memory. */
+  memset(k2, 7, 4096);
+  conf.trim_threshold = 64;
+  free_(k2);
+  assert(heap_sbrk(&main_heap, 0) == (void *) block_header(k2));
+  assert(bb.commit == buf + sizeof(buf));
+  assert(alloc(4096) == k2);
+  heap_set_backend(&main_heap, NULL);
+  assert(bb.base == NULL);
+  conf = saved_conf;
+  /* Huge pages are mapped and faulted in up front. Without any in
+     the pool, transparent huge pages are used instead. */
+  Backend hb = hugetlb_backend(1);
+  heap_set_backend(&main_heap, &hb);
+  word_t *k3 = alloc(16);
+  assert(hb.end - hb.base == (ptrdiff_t) HUGE_PAGE_SIZE);
+  assert((uintptr_t) hb.base % HUGE_PAGE_SIZE == 0);
+  assert((char *) block_header(k3) == hb.base);
+  assert(resident_bytes(hb.base, HUGE_PAGE_SIZE) == HUGE_PAGE_SIZE);
+  heap_set_backend(&main_heap, NULL);
+  assert(hb.base == NULL);
+
+  reset_heap();
+  printf("Test prefaulting\n");
+  /* The first allocation sets up and faults in the whole heap ... */
+  conf.prefault_heap = 1 << 20;
+  word_t *f1 = alloc(16);
+  char *f_start = (char *) block_header(f1);
+  assert((char *) heap_sbrk(&main_heap, 0) >= f_start + (1 << 20));
+  assert(resident_bytes(f_start, 1 << 20) >= (1 << 20));
+  /* ... and the next ones fit into it. */
+  word_t *f2 = alloc(page_size() * 4);
+  assert(block_header(f2) == nextb(block_header(f1)));
+  /* With "prefault", new memory is faulted in whenever the heap grows. */
+  conf.prefault_heap = 0;
+  conf.prefault = true;
+  word_t *f3 = alloc(2 << 20);
+  assert(resident_bytes(f3, 2 << 20) >= (2 << 20));
+  conf = saved_conf;
+
+  printf("Test heap objects\n");
+  Heap *heap1 = heap_create(NULL);
+  Heap *heap2 = heap_create(NULL);
+  char *j_brk = sbrk(0);
+  word_t *j1 = heap_alloc(heap1, 64);
+  word_t *j2 = heap_alloc(heap2, 64);
+  word_t *j3 = heap_alloc(heap1, 64);
+  /* Each heap has memory of its own, away from the program break. */
+  assert(sbrk(0) == j_brk);
+  assert(block_header(j3) == nextb(block_header(j1)));
+  assert((char *) j2 < heap_backend(heap1)->base
+         || (char *) j2 >= heap_backend(heap1)->end);
+  /* Each heap searches its own free blocks, from its own cursor. */
+  heap_free(heap1, j1);
+  assert(heap_alloc(heap2, 64) != j1);
+  assert(heap_alloc(heap1, 64) == j1);
+#if SEARCH_MODE == NEXT_FIT
+  assert(heap1->next_fit_start == block_header(j1));
+  assert(heap2->next_fit_start == block_header(j2));
+#endif
+  /* Resetting frees all blocks of a heap at once. */
+  heap_reset(heap1);
+  assert(heap1->start == NULL);
+  assert(heap_alloc(heap1, 64) != NULL);
+  assert(usedb(block_header(j2)));
+  heap_destroy(heap1);
+  heap_destroy(heap2);
+
   printf("All assertions passed\n");
 } 
@@ -0,0 +1,62 @@
+#ifndef __HEADROOM_H_
+#define __HEADROOM_H_
+
+#include <stddef.h> /* size_t */
+
+#include "conf.h"
+#include "os.h"
+
+/*
+ * Headroom. Growing the heap costs a system call, and touching the new
+ * memory for the first time costs a page fault per page. Whatever
+ * allocation happens to need the memory pays for both. To keep that off
+ * the allocation path, the allocators get more memory from the OS than
+ * they need right away and keep the rest in reserve. With the
+ * "headroom_prefault" option, the pages of the reserve are faulted in
+ * as soon as they are mapped.
+ *
+ * Only explicit_free_list.c does that: its background thread maps the
+ * reserve, so no allocation waits for the faults. free_list.c and
+ * segregated_free_list.c refill the reserve from the allocation that
+ * runs out of it. Faulting in the reserve there would make that one
+ * allocation pay for up to "headroom" bytes of page faults, so they
+ * leave the reserve to be faulted in as it's used.
+ *
+ * The size of the reserve follows how fast the heap grows: each time
+ * it's refilled, it's made about twice as large as what was taken out
+ * of it (on average) since the last refill, and at most "headroom"
+ * bytes large.
+ */
+
+typedef struct {
+  size_t used; /* Bytes taken out of the reserve since the last refill. */
+  size_t rate; /* USED, smoothed over past refills. */
+} Headroom;
+
+/*
+ * Return how many bytes the reserve should hold after a refill, but
+ * at least MIN. Counting what's taken out starts anew.
+ */
+size_t headroom_target(Headroom *h, size_t min) {
+  h->rate = (h->rate + h->used) / 2;
+  h->used = 0;
+
+  size_t target = 2 * h->rate;
+  if (target < min)
+    target = min;
+  if (target > conf.headroom)
+    target = conf.headroom;
+  return target;
+}
+
+/*
+ * Fault in new memory of the reserve if that's wanted. With the
+ * "prefault" option, all new memory is. This is for reserves that
+ * are refilled off the allocation path.
+ */
+void headroom_prefault(void *start, size_t len) {
+  if (conf.headroom_prefault || conf.prefault)
+    prefault_pages(start, len);
+}
+
+#endif /* __HEADROOM_H_ */
@@ -0,0 +1,108 @@
+/*
+ * Tests of the std::pmr adapters in memory_resource.hpp.
+ * Build and run them with build-pmr.sh.
+ */
+
+#include <cassert>   /* assert */
+#include <cstdint>   /* uintptr_t */
+#include <cstdio>    /* printf */
+#include <cstring>   /* memset */
+#include <map>       /* std::pmr::map */
+#include <new>       /* std::bad_alloc */
+#include <string>    /* std::pmr::string */
+#include <vector>    /* std::pmr::vector */
+
+#include "memory_resource.hpp"
+
+/* A type that needs more alignment than the allocators give. */
+struct alignas(64) Line {
+  char bytes[64];
+};
+
+void test_resource(const char *name, std::pmr::memory_resource *res) {
+  printf("Test %s\n", name);
+
+  /* Containers get their memory from the resource ... */
+  std::pmr::vector<int> v(res);
+  for (int i = 0; i < 10000; i++)
+    v.push_back(i);
+  for (int i = 0; i < 10000; i++)
+    assert(v[i] == i);
+
+  std::pmr::map<int, std::pmr::string> m(res);
+  for (int i = 0; i < 1000; i++)
+    m.emplace(i, std::pmr::string(100, 'a' + i % 26, res));
+  assert(m.size() == 1000 && m[999][99] == 'a' + 999 % 26);
+  m.clear();
+
+  /* ... aligned as much as their elements need. */
+  for (std::size_t align = 1; align <= 4096; align *= 2) {
+    void *p = res->allocate(align * 3, align);
+    assert((std::uintptr_t)p % align == 0);
+    memset(p, 0xaa, align * 3);
+    res->deallocate(p, align * 3, align);
+  }
+  std::pmr::vector<Line> lines(100, res);
+  assert((std::uintptr_t)lines.data() % 64 == 0);
+
+  /* Zero bytes still give a pointer that can be freed. */
+  void *z = res->allocate(0, 1);
+  assert(z != nullptr);
+  res->deallocate(z, 0, 1);
+
+  /* A resource only equals itself. */
+  assert(*res == *res);
+  assert(*res != *std::pmr::new_delete_resource());
+
+  /* Failing allocations throw. */
+  bool thrown = false;
+  try {
+    (void)res->allocate((std::size_t)PTRDIFF_MAX, 16);
+  } catch (const std::bad_alloc &) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+template <typename Resource> void test_heaps(const char *name) {
+  printf("Test %s heaps\n", name);
+  Resource r1, r2;
+  assert(r1 != r2);
+
+  /* Resources of one allocator have heaps of their own. */
+  char *a = (char *)r1.allocate(1 << 16);
+  char *b = (char *)r2.allocate(1 << 16);
+  memset(a, 'a', 1 << 16);
+  memset(b, 'b', 1 << 16);
+  /* Releasing frees everything at once; the resource stays usable. */
+  for (int i = 0; i < 100; i++)
+    memset(r1.allocate(1000), 1, 1000);
+  r1.release();
+  char *c = (char *)r1.allocate(1 << 16);
+  memset(c, 'c', 1 << 16);
+  for (int i = 0; i < 1 << 16; i++)
+    assert(b[i] == 'b' && c[i] == 'c');
+  r2.deallocate(b, 1 << 16);
+  r1.deallocate(c, 1 << 16);
+}
+
+int main(void) {
+  FreeListResource free_list;
+  ExplicitResource explicit_;
+  SegregatedResource segregated;
+  test_resource("FreeListResource", &free_list);
+  test_resource("ExplicitResource", &explicit_);
+  test_resource("SegregatedResource", &segregated);
+  test_heaps<FreeListResource>("FreeListResource");
+  test_heaps<ExplicitResource>("ExplicitResource");
+  test_heaps<SegregatedResource>("SegregatedResource");
+
+  /* The resources don't touch each other's memory. */
+  std::pmr::vector<char> a(1 << 20, 'a', &free_list);
+  std::pmr::vector<char> b(1 << 20, 'b', &explicit_);
+  std::pmr::vector<char> c(1 << 20, 'c', &segregated);
+  for (std::size_t i = 0; i < a.size(); i++)
+    assert(a[i] == 'a' && b[i] == 'b' && c[i] == 'c');
+
+  printf("All assertions passed\n");
+}
@@ -0,0 +1,158 @@
+#ifndef __MEMORY_RESOURCE_HPP_
+#define __MEMORY_RESOURCE_HPP_
+
+#include <cstddef>         /* size_t, ptrdiff_t */
+#include <cstdint>         /* uintptr_t */
+#include <memory_resource> /* std::pmr::memory_resource */
+#include <new>             /* std::bad_alloc */
+
+/*
+ * std::pmr adapters. Each allocator is a std::pmr::memory_resource,
+ * so that single containers can use it:
+ *
+ *   SegregatedResource res;
+ *   std::pmr::vector<int> v(&res);
+ *
+ * Every resource has a heap of its own (an arena, for
+ * ExplicitResource), which it creates when it's constructed and
+ * destroys with it. RELEASE frees all of its blocks at once, like
+ * std::pmr::monotonic_buffer_resource::release does.
+ *
+ * The allocators aren't built for C++, and they all have functions
+ * of the same names. build-pmr.sh compiles each of them into an object
+ * of its own, in which everything is local but the functions below.
+ * Their names get the allocator's name as a prefix.
+ *
+ * A FreeListResource has no lock and must only be used by one thread
+ * at a time. The others can be shared.
+ */
+
+extern "C" {
+void *free_list_heap_create(void *backend);
+void free_list_heap_destroy(void *heap);
+void free_list_heap_reset(void *heap);
+void *free_list_heap_alloc(void *heap, std::ptrdiff_t size);
+void free_list_heap_free(void *heap, void *mem);
+
+void *explicit_arena_create(void);
+void explicit_arena_destroy(void *arena);
+void explicit_arena_reset(void *arena);
+void *explicit_arena_alloc(void *arena, std::ptrdiff_t size);
+void explicit_free(void *mem);
+
+void *segregated_heap_create(void *backend);
+void segregated_heap_destroy(void *heap);
+void segregated_heap_reset(void *heap);
+void *segregated_heap_alloc(void *heap, std::ptrdiff_t size);
+void segregated_heap_free(void *heap, void *mem);
+}
+
+/* All allocators align blocks to this many bytes. */
+#define PMR_ALIGN alignof(std::uint64_t)
+
+/* The functions of an allocator that a resource needs. */
+struct EngineOps {
+  void *(*create)();
+  void (*destroy)(void *heap);
+  void (*reset)(void *heap);
+  void *(*alloc)(void *heap, std::ptrdiff_t size);
+  void (*free)(void *heap, void *mem);
+};
+
+class EngineResource : public std::pmr::memory_resource {
+public:
+  explicit EngineResource(const EngineOps &ops) : ops_(ops) {
+    heap_ = ops_.create();
+    if (heap_ == nullptr)
+      throw std::bad_alloc();
+  }
+
+  EngineResource(const EngineResource &) = delete;
+  EngineResource &operator=(const EngineResource &) = delete;
+
+  ~EngineResource() override { ops_.destroy(heap_); }
+
+  /* Free everything that was allocated from this resource. */
+  void release() { ops_.reset(heap_); }
+
+private:
+  /*
+   * The allocators only align to PMR_ALIGN. For more, BYTES + ALIGNMENT
+   * are allocated, and the block's address is stored right before the
+   * aligned pointer. There's always room for it, since the block is at
+   * least PMR_ALIGN bytes off.
+   */
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+    if (bytes > PTRDIFF_MAX - alignment)
+      throw std::bad_alloc();
+    if (alignment <= PMR_ALIGN) {
+      void *mem = ops_.alloc(heap_, bytes > 0 ? bytes : 1);
+      if (mem == nullptr)
+        throw std::bad_alloc();
+      return mem;
+    }
+
+    void *mem = ops_.alloc(heap_, bytes + alignment);
+    if (mem == nullptr)
+      throw std::bad_alloc();
+    std::uintptr_t start =
+        ((std::uintptr_t)mem + alignment) & ~(alignment - 1);
+    ((void **)start)[-1] = mem;
+    return (void *)start;
+  }
+
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) override {
+    (void)bytes;
+    if (alignment <= PMR_ALIGN)
+      ops_.free(heap_, p);
+    else
+      ops_.free(heap_, ((void **)p)[-1]);
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+      noexcept override {
+    return this == &other;
+  }
+
+  const EngineOps &ops_;
+  void *heap_;
+};
+
+inline const EngineOps free_list_ops = {
+    [] { return free_list_heap_create(nullptr); },
+    free_list_heap_destroy,
+    free_list_heap_reset,
+    free_list_heap_alloc,
+    free_list_heap_free,
+};
+
+inline const EngineOps explicit_ops = {
+    explicit_arena_create,
+    explicit_arena_destroy,
+    explicit_arena_reset,
+    explicit_arena_alloc,
+    [](void *, void *mem) { explicit_free(mem); },
+};
+
+inline const EngineOps segregated_ops = {
+    [] { return segregated_heap_create(nullptr); },
+    segregated_heap_destroy,
+    segregated_heap_reset,
+    segregated_heap_alloc,
+    segregated_heap_free,
+};
+
+struct FreeListResource : EngineResource {
+  FreeListResource() : EngineResource(free_list_ops) {}
+};
+
+struct ExplicitResource : EngineResource {
+  ExplicitResource() : EngineResource(explicit_ops) {}
+};
+
+struct SegregatedResource : EngineResource {
+  SegregatedResource() : EngineResource(segregated_ops) {}
+};
+
+#endif /* __MEMORY_RESOURCE_HPP_ */
@@ -0,0 +1,100 @@
+#ifndef __MUTEX_H_
+#define __MUTEX_H_
+
+#include <pthread.h> /* pthread_mutex_t */
+#include <stddef.h>  /* size_t */
+#include <stdint.h>  /* uint64_t */
+#include <string.h>  /* memcpy, memset */
+#include <time.h>    /* clock_gettime */
+
+/*
+ * Mutexes that count how they are used, so that one can see where
+ * threads wait for each other. A mutex is first tried without waiting.
+ * Only if that fails is the time measured until the mutex is taken,
+ * so an uncontended mutex costs about as much as a plain one.
+ *
+ * The numbers are updated while the mutex is held and need no
+ * atomics. MUTEX_STATS reads them without taking the mutex, so
+ * they can be off by the operations that are underway.
+ */
+
+/* Bucket K counts waits of less than 2^K microseconds. */
+#define MUTEX_WAIT_BUCKETS 16
+
+typedef struct {
+  size_t acquired;  /* Times the mutex was taken. */
+  size_t contended; /* Times it was held by another thread already. */
+  uint64_t wait_ns; /* Time spent waiting for it in total. */
+  uint64_t max_wait_ns;
+  /* Waits by duration. The last bucket also holds all longer ones. */
+  size_t waits[MUTEX_WAIT_BUCKETS];
+} MutexStats;
+
+typedef struct {
+  pthread_mutex_t lock;
+  MutexStats stats;
+} Mutex;
+
+#define MUTEX_INITIALIZER {PTHREAD_MUTEX_INITIALIZER, {0}}
+
+void mutex_init(Mutex *m) {
+  pthread_mutex_init(&m->lock, NULL);
+  memset(&m->stats, 0, sizeof(m->stats));
+}
+
+uint64_t mutex_clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* The bucket of MUTEX_WAIT_BUCKETS for a wait of NS nanoseconds. */
+int mutex_wait_bucket(uint64_t ns) {
+  uint64_t us = ns / 1000;
+  /* The number of bits needed for US. */
+  int k = us == 0 ? 0 : 64 - __builtin_clzll(us);
+  return k < MUTEX_WAIT_BUCKETS ? k : MUTEX_WAIT_BUCKETS - 1;
+}
+
+void mutex_lock(Mutex *m) {
+  if (pthread_mutex_trylock(&m->lock) != 0) {
+    uint64_t start = mutex_clock_ns();
+    pthread_mutex_lock(&m->lock);
+    uint64_t wait = mutex_clock_ns() - start;
+
+    m->stats.contended++;
+    m->stats.wait_ns += wait;
+    if (wait > m->stats.max_wait_ns)
+      m->stats.max_wait_ns = wait;
+    m->stats.waits[mutex_wait_bucket(wait)]++;
+  }
+  m->stats.acquired++;
+}
+
+/* Return 0 if M was taken, like pthread_mutex_trylock. */
+int mutex_trylock(Mutex *m) {
+  int err = pthread_mutex_trylock(&m->lock);
+  if (err == 0)
+    m->stats.acquired++;
+  return err;
+}
+
+void mutex_unlock(Mutex *m) { pthread_mutex_unlock(&m->lock); }
+
+/* Copy the numbers of M to ST. */
+void mutex_stats(Mutex *m, MutexStats *st) {
+  memcpy(st, &m->stats, sizeof(*st));
+}
+
+/* Add the numbers of M to ST, e.g. to sum up a group of mutexes. */
+void mutex_stats_add(Mutex *m, MutexStats *st) {
+  st->acquired += m->stats.acquired;
+  st->contended += m->stats.contended;
+  st->wait_ns += m->stats.wait_ns;
+  if (m->stats.max_wait_ns > st->max_wait_ns)
+    st->max_wait_ns = m->stats.max_wait_ns;
+  for (int k = 0; k < MUTEX_WAIT_BUCKETS; k++)
+    st->waits[k] += m->stats.waits[k];
+}
+
+#endif /* __MUTEX_H_ */
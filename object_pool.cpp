@@ -0,0 +1,156 @@
+/*
+ * Tests of the object pools in object_pool.hpp.
+ * Build and run them with build-pool.sh.
+ */
+
+#include <cassert>   /* assert */
+#include <cstdint>   /* uintptr_t */
+#include <cstdio>    /* printf */
+#include <stdexcept> /* std::runtime_error */
+#include <thread>    /* std::thread */
+
+#include "object_pool.hpp"
+
+struct Point {
+  long x, y, z;
+  Point(long x, long y, long z) : x(x), y(y), z(z) {}
+};
+
+struct alignas(64) Line {
+  char bytes[100];
+};
+
+struct Small {
+  char c;
+};
+
+/* Throws when it's constructed with a negative number. */
+struct Picky {
+  long n;
+  explicit Picky(long n) : n(n) {
+    if (n < 0)
+      throw std::runtime_error("negative");
+  }
+};
+
+/* Slot sizes are known at compile time. */
+static_assert(ObjectPool<Point>::slot_size == 24);
+static_assert(ObjectPool<Line>::slot_size == 128);
+static_assert(ObjectPool<Line>::slot_align == 64);
+static_assert(ObjectPool<Small>::slot_size == sizeof(void *));
+static_assert(ObjectPool<Point>::slots_per_chunk == (4096 - 8) / 24);
+static_assert(ObjectPool<Line, 1 << 16>::slots_per_chunk == 511);
+
+int main(void) {
+  printf("Test allocating\n");
+  {
+    ObjectPool<Point> pool;
+    Point *p1 = pool.allocate();
+    Point *p2 = pool.allocate();
+    /* There's no header between the slots. */
+    assert((char *)p2 == (char *)p1 + sizeof(Point));
+    assert(ObjectPool<Point>::pool_of(p1) == &pool);
+    /* The slot that was freed last is used first. */
+    pool.deallocate(p1);
+    pool.deallocate(p2);
+    assert(pool.allocate() == p2);
+    assert(pool.allocate() == p1);
+    /* Full chunks are followed by new ones. */
+    assert(pool.chunks() == 1);
+    for (std::size_t i = 2; i < ObjectPool<Point>::slots_per_chunk; i++)
+      pool.allocate();
+    assert(pool.chunks() == 1);
+    Point *p3 = pool.allocate();
+    assert(pool.chunks() == 2);
+    assert(ObjectPool<Point>::pool_of(p3) == &pool);
+    assert((std::uintptr_t)p3 % 4096 == ObjectPool<Point>::chunk_header);
+  }
+
+  printf("Test alignment\n");
+  {
+    ObjectPool<Line> pool;
+    for (int i = 0; i < 100; i++)
+      assert((std::uintptr_t)pool.allocate() % 64 == 0);
+    assert(pool.chunks() == 4);
+  }
+
+  printf("Test limits\n");
+  {
+    /* Two chunks' worth of address space. */
+    ObjectPool<Point> pool(2 * 4096);
+    for (std::size_t i = 0; i < 2 * ObjectPool<Point>::slots_per_chunk; i++)
+      pool.allocate();
+    bool thrown = false;
+    try {
+      pool.allocate();
+    } catch (const std::bad_alloc &) {
+      thrown = true;
+    }
+    assert(thrown);
+  }
+
+  printf("Test thread-local pools\n");
+  {
+    Point *p = ObjectPool<Point>::create(1, 2, 3);
+    assert(p->x == 1 && p->y == 2 && p->z == 3);
+    assert(ObjectPool<Point>::pool_of(p) == &ObjectPool<Point>::local());
+    ObjectPool<Point>::destroy(p);
+    assert(ObjectPool<Point>::create(4, 5, 6) == p);
+
+    /* A constructor that throws gives its slot back. */
+    Picky *k = ObjectPool<Picky>::create(1);
+    ObjectPool<Picky>::destroy(k);
+    bool thrown = false;
+    try {
+      ObjectPool<Picky>::create(-1);
+    } catch (const std::runtime_error &) {
+      thrown = true;
+    }
+    assert(thrown);
+    assert(ObjectPool<Picky>::create(2) == k);
+
+    /* Every thread has a pool of its own. */
+    ObjectPool<Point> *other = nullptr;
+    Point *q = nullptr;
+    std::thread t([&] {
+      other = &ObjectPool<Point>::local();
+      q = ObjectPool<Point>::create(7, 8, 9);
+    });
+    t.join();
+    assert(other != &ObjectPool<Point>::local());
+    assert(ObjectPool<Point>::pool_of(q) == other);
+
+    /* Freeing on another thread hands the slot back to its pool. */
+    ObjectPool<Point>::destroy(q);
+    Point *objs[10];
+    for (int i = 0; i < 10; i++)
+      objs[i] = ObjectPool<Point>::create(i, i, i);
+    std::thread u([&] {
+      for (int i = 0; i < 10; i++)
+        ObjectPool<Point>::destroy(objs[i]);
+    });
+    u.join();
+    /* The slots are taken back once the free list is empty. */
+    bool found = false;
+    for (int i = 0; i < 10; i++) {
+      Point *r = ObjectPool<Point>::local().allocate();
+      found |= r == objs[9];
+      assert(ObjectPool<Point>::pool_of(r) == &ObjectPool<Point>::local());
+    }
+    assert(found);
+
+    /* The pool of an exited thread goes to the next thread. */
+    ObjectPool<Point> *next = nullptr;
+    Point *from_q = nullptr;
+    std::thread v([&] {
+      next = &ObjectPool<Point>::local();
+      from_q = ObjectPool<Point>::create(0, 0, 0);
+    });
+    v.join();
+    assert(next == other);
+    assert(from_q == q);
+  }
+
+  printf("All assertions passed\n");
+  return 0;
+}
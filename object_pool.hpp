@@ -0,0 +1,228 @@
+#ifndef __OBJECT_POOL_HPP_
+#define __OBJECT_POOL_HPP_
+
+#include <atomic>  /* std::atomic */
+#include <cstddef> /* size_t */
+#include <cstdint> /* uintptr_t */
+#include <mutex>   /* std::mutex, std::lock_guard */
+#include <new>     /* std::bad_alloc, placement new */
+#include <utility> /* std::forward */
+
+#include "backend.h"
+
+/*
+ * Object pools. An ObjectPool<T, ChunkSize> hands out memory for
+ * single objects of type T. It gets chunks of CHUNK_SIZE bytes from
+ * an OS backend (see backend.h), the same one that the heaps of
+ * segregated_free_list.c use, and carves them into slots that are
+ * as large as and aligned like a T. A free slot holds the link to the
+ * next one, so there's no header in front of the objects. Slot size,
+ * alignment and the number of slots per chunk are all known at
+ * compile time.
+ *
+ * A pool belongs to one thread, which allocates from it and frees its
+ * slots without a lock or an atomic instruction. Other threads free
+ * slots of the pool with RELEASE, which pushes them onto a lock-free
+ * stack. The owner takes all of them back at once when its own free
+ * list runs empty. RELEASE finds a slot's pool through the header of
+ * its chunk, which is aligned to CHUNK_SIZE.
+ *
+ * LOCAL is the pool of the calling thread. When a thread exits, its
+ * pool is kept, slots and all, for the next thread that needs one.
+ * CREATE and DESTROY construct and destroy objects in these pools.
+ *
+ * The chunks are never given back while the pool lives. The backend
+ * reserves RESERVE bytes of address space, which limits how many
+ * objects a pool can hold at once.
+ */
+
+#define POOL_RESERVE ((size_t)1 << 30)
+
+template <typename T, std::size_t ChunkSize = 4096> class ObjectPool {
+  struct Slot {
+    Slot *next;
+  };
+
+  struct Chunk {
+    ObjectPool *pool;
+  };
+
+  static constexpr std::size_t round_up(std::size_t n, std::size_t align) {
+    return (n + align - 1) & ~(align - 1);
+  }
+
+  static constexpr std::size_t max(std::size_t a, std::size_t b) {
+    return a > b ? a : b;
+  }
+
+public:
+  static constexpr std::size_t slot_align = max(alignof(T), alignof(Slot));
+  static constexpr std::size_t slot_size =
+      round_up(max(sizeof(T), sizeof(Slot)), slot_align);
+  /* The slots start after the chunk's header. */
+  static constexpr std::size_t chunk_header =
+      round_up(sizeof(Chunk), slot_align);
+  static constexpr std::size_t slots_per_chunk =
+      (ChunkSize - chunk_header) / slot_size;
+
+  static_assert((ChunkSize & (ChunkSize - 1)) == 0,
+                "ChunkSize must be a power of two");
+  static_assert(slot_align <= ChunkSize, "T is aligned to more than a chunk");
+  static_assert(slots_per_chunk > 0, "T doesn't fit into a chunk");
+
+  explicit ObjectPool(std::size_t reserve = POOL_RESERVE)
+      : backend_(mmap_backend(reserve)) {}
+
+  ObjectPool(const ObjectPool &) = delete;
+  ObjectPool &operator=(const ObjectPool &) = delete;
+
+  ~ObjectPool() {
+    if (backend_.base != nullptr)
+      backend_.ops->destroy(&backend_);
+  }
+
+  /* Memory for one T. Only the owner may call this. */
+  T *allocate() {
+    Slot *slot = free_;
+    if (slot == nullptr)
+      slot = remote_.exchange(nullptr, std::memory_order_acquire);
+    if (slot != nullptr) {
+      free_ = slot->next;
+      return reinterpret_cast<T *>(slot);
+    }
+
+    if (next_ == end_ && !grow())
+      throw std::bad_alloc();
+    T *mem = reinterpret_cast<T *>(next_);
+    next_ += slot_size;
+    return mem;
+  }
+
+  /* Free MEM, which this pool allocated. Only the owner may call this. */
+  void deallocate(T *mem) {
+    Slot *slot = reinterpret_cast<Slot *>(mem);
+    slot->next = free_;
+    free_ = slot;
+  }
+
+  /* Free MEM, which this pool allocated, from any thread. */
+  void remote_deallocate(T *mem) {
+    Slot *slot = reinterpret_cast<Slot *>(mem);
+    slot->next = remote_.load(std::memory_order_relaxed);
+    while (!remote_.compare_exchange_weak(slot->next, slot,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed))
+      ;
+  }
+
+  /* The pool that MEM belongs to. */
+  static ObjectPool *pool_of(T *mem) {
+    std::uintptr_t chunk = (std::uintptr_t)mem & ~(ChunkSize - 1);
+    return reinterpret_cast<Chunk *>(chunk)->pool;
+  }
+
+  /* Free MEM, which any pool of this type allocated, from any thread. */
+  static void release(T *mem) {
+    ObjectPool *pool = pool_of(mem);
+    if (pool == local_pool())
+      pool->deallocate(mem);
+    else
+      pool->remote_deallocate(mem);
+  }
+
+  /* The pool of the calling thread. */
+  static ObjectPool &local() {
+    ObjectPool *pool = local_pool();
+    if (pool == nullptr)
+      pool = adopt();
+    return *pool;
+  }
+
+  /* Construct a T in the calling thread's pool. */
+  template <typename... Args> static T *create(Args &&...args) {
+    ObjectPool &pool = local();
+    T *mem = pool.allocate();
+    try {
+      return new (mem) T(std::forward<Args>(args)...);
+    } catch (...) {
+      pool.deallocate(mem);
+      throw;
+    }
+  }
+
+  /* Destroy OBJ, which CREATE made on any thread. */
+  static void destroy(T *obj) {
+    obj->~T();
+    release(obj);
+  }
+
+  /* The number of chunks that the pool has. */
+  std::size_t chunks() const {
+    if (backend_.base == nullptr)
+      return 0;
+    return (backend_.brk - backend_.base) / ChunkSize;
+  }
+
+private:
+  /* Take another chunk from the backend. Return false if there's none. */
+  bool grow() {
+    if (backend_.base == nullptr && backend_.ops->reserve(&backend_, ChunkSize))
+      return false;
+    char *chunk = (char *)backend_.ops->grow(&backend_, ChunkSize);
+    if (chunk == (char *)-1)
+      return false;
+    reinterpret_cast<Chunk *>(chunk)->pool = this;
+    next_ = chunk + chunk_header;
+    end_ = next_ + slots_per_chunk * slot_size;
+    return true;
+  }
+
+  /*
+   * The pool of the calling thread, if it has one. ORPHANS holds the
+   * pools of threads that have exited.
+   */
+  struct Owner {
+    ObjectPool *pool = nullptr;
+
+    ~Owner() {
+      if (pool == nullptr)
+        return;
+      std::lock_guard<std::mutex> guard(orphans_lock);
+      pool->next_orphan_ = orphans;
+      orphans = pool;
+    }
+  };
+
+  static inline thread_local Owner owner;
+  static inline std::mutex orphans_lock;
+  static inline ObjectPool *orphans = nullptr;
+
+  static ObjectPool *local_pool() { return owner.pool; }
+
+  /* Give the calling thread the pool of an exited thread, or a new one. */
+  static ObjectPool *adopt() {
+    ObjectPool *pool = nullptr;
+    {
+      std::lock_guard<std::mutex> guard(orphans_lock);
+      if (orphans != nullptr) {
+        pool = orphans;
+        orphans = pool->next_orphan_;
+      }
+    }
+    if (pool == nullptr)
+      pool = new ObjectPool();
+    owner.pool = pool;
+    return pool;
+  }
+
+  Backend backend_;
+  Slot *free_ = nullptr;
+  /* The slots of the last chunk that were never used. */
+  char *next_ = nullptr;
+  char *end_ = nullptr;
+  /* Slots that other threads freed (see REMOTE_DEALLOCATE). */
+  std::atomic<Slot *> remote_{nullptr};
+  ObjectPool *next_orphan_ = nullptr;
+};
+
+#endif /* __OBJECT_POOL_HPP_ */
@@ -0,0 +1,225 @@
+#ifndef __OS_H_
+#define __OS_H_
+
+#include <stddef.h>   /* size_t */
+#include <stdint.h>   /* uintptr_t */
+#include <sys/mman.h> /* madvise, mincore, mmap, mprotect, mremap */
+#include <unistd.h>   /* sysconf */
+
+/* Helpers for handing memory back to the OS and for getting it ready. */
+
+/* The size of a page in bytes. */
+size_t page_size(void) {
+  static size_t size = 0;
+  if (size == 0)
+    size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+/* Round the address P up or down to the nearest page boundary. */
+uintptr_t page_up(uintptr_t p) { return (p + page_size() - 1) & ~(page_size() - 1); }
+uintptr_t page_down(uintptr_t p) { return p & ~(page_size() - 1); }
+
+/* The size of a transparent huge page, as on x86-64. */
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+uintptr_t huge_page_up(uintptr_t p) {
+  return (p + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+}
+uintptr_t huge_page_down(uintptr_t p) { return p & ~(HUGE_PAGE_SIZE - 1); }
+
+/*
+ * Release the physical memory of all whole pages in the range
+ * of LEN bytes at START. The range stays mapped; the next access
+ * to a purged page faults in a zeroed page.
+ * Return the number of bytes that were purged.
+ */
+size_t purge_pages(void *start, size_t len) {
+  uintptr_t first = page_up((uintptr_t)start);
+  uintptr_t last = page_down((uintptr_t)start + len);
+
+  if (first >= last)
+    return 0;
+  if (madvise((void *)first, last - first, MADV_DONTNEED) != 0)
+    return 0;
+  return last - first;
+}
+
+/*
+ * Like PURGE_PAGES, but the kernel only takes the pages away when it
+ * needs the memory. Until then, the next access finds the old page
+ * with its old contents, without a fault. Where MADV_FREE isn't
+ * supported, the pages are purged right away.
+ */
+size_t lazy_purge_pages(void *start, size_t len) {
+#ifdef MADV_FREE
+  uintptr_t first = page_up((uintptr_t)start);
+  uintptr_t last = page_down((uintptr_t)start + len);
+
+  if (first >= last)
+    return 0;
+  if (madvise((void *)first, last - first, MADV_FREE) == 0)
+    return last - first;
+#endif
+  return purge_pages(start, len);
+}
+
+/* The number of bytes in whole pages in the range of LEN bytes at START. */
+size_t whole_pages(void *start, size_t len) {
+  uintptr_t first = page_up((uintptr_t)start);
+  uintptr_t last = page_down((uintptr_t)start + len);
+  return first < last ? last - first : 0;
+}
+
+/*
+ * Like PURGE_PAGES, but only purge whole huge pages. The kernel
+ * would have to split a huge page that is purged in part, and the
+ * memory around the range would be backed by small pages from then on.
+ */
+size_t purge_huge_pages(void *start, size_t len) {
+  uintptr_t first = huge_page_up((uintptr_t)start);
+  uintptr_t last = huge_page_down((uintptr_t)start + len);
+
+  if (first >= last)
+    return 0;
+  if (madvise((void *)first, last - first, MADV_DONTNEED) != 0)
+    return 0;
+  return last - first;
+}
+
+/*
+ * Ask the kernel to back the range of LEN bytes at START with
+ * transparent huge pages. START and LEN should be multiples of
+ * HUGE_PAGE_SIZE. Return 0 on success.
+ */
+int advise_huge_pages(void *start, size_t len) {
+#ifdef MADV_HUGEPAGE
+  return madvise(start, len, MADV_HUGEPAGE);
+#else
+  (void)start, (void)len;
+  return -1;
+#endif
+}
+
+/*
+ * Fault in all pages in the range of LEN bytes at START, so that
+ * touching them later doesn't have to. The pages must be writable.
+ * Their contents don't change.
+ */
+void prefault_pages(void *start, size_t len) {
+  uintptr_t first = page_down((uintptr_t)start);
+  uintptr_t last = page_up((uintptr_t)start + len);
+
+  if (first >= last)
+    return;
+#ifdef MADV_POPULATE_WRITE
+  if (madvise((void *)first, last - first, MADV_POPULATE_WRITE) == 0)
+    return;
+#endif
+  /* Older kernels: write every page once. */
+  for (uintptr_t p = first; p < last; p += page_size())
+    *(volatile char *)p = *(volatile char *)p;
+}
+
+/*
+ * Return how many bytes of the pages in the range of LEN bytes
+ * at START are in memory, i.e., touching them takes no page fault.
+ */
+size_t resident_bytes(void *start, size_t len) {
+  uintptr_t first = page_down((uintptr_t)start);
+  uintptr_t last = page_up((uintptr_t)start + len);
+  size_t resident = 0;
+  unsigned char vec[64];
+
+  for (uintptr_t p = first; p < last; p += sizeof(vec) * page_size()) {
+    size_t n = (last - p) / page_size();
+    if (n > sizeof(vec))
+      n = sizeof(vec);
+    if (mincore((void *)p, n * page_size(), vec) != 0)
+      return resident;
+    for (size_t i = 0; i < n; i++)
+      resident += (vec[i] & 1) * page_size();
+  }
+  return resident;
+}
+
+/*
+ * Resize the mapping of OLD_SIZE bytes at OLD to NEW_SIZE bytes (both
+ * multiples of the page size) without copying its contents: mremap
+ * only moves page table entries. The mapping grows in place if nothing
+ * is mapped after it. Otherwise, it's moved to a range aligned to
+ * ALIGN, a power of two. Return the new address or NULL, with the old
+ * mapping left as it was, if the mapping can't be resized.
+ */
+void *remap_aligned(void *old, size_t old_size, size_t new_size,
+                    size_t align) {
+#ifdef MREMAP_MAYMOVE
+  if (mremap(old, old_size, new_size, 0) != MAP_FAILED)
+    return old;
+  if (new_size < old_size)
+    return NULL;
+
+  /* Reserve the new range first, so it can be aligned. */
+  char *map = (char *)mmap(NULL, new_size + align, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+  char *start = (char *)(((uintptr_t)map + align - 1) & ~(align - 1));
+  if (mremap(old, old_size, new_size, MREMAP_MAYMOVE | MREMAP_FIXED, start) ==
+      MAP_FAILED) {
+    munmap(map, new_size + align);
+    return NULL;
+  }
+  if (start != map)
+    munmap(map, start - map);
+  munmap(start + new_size, (map + align) - start);
+  return start;
+#else
+  (void)old, (void)old_size, (void)new_size, (void)align;
+  return NULL;
+#endif
+}
+
+/*
+ * Reserve-then-commit. Instead of growing into whatever address space
+ * is free, a heap can reserve a large range up front (MAP_RESERVED)
+ * and make it usable bit by bit (COMMIT_PAGES). The reserved range is
+ * mapped PROT_NONE and MAP_NORESERVE, so it costs neither memory nor
+ * commit charge. See the mmap backend in backend.h.
+ */
+
+/*
+ * Reserve SIZE bytes (a multiple of the page size) aligned to ALIGN,
+ * a power of two and a multiple of the page size. Return NULL if the
+ * address space can't be reserved.
+ */
+char *map_reserved(size_t size, size_t align) {
+  char *map = (char *)mmap(NULL, size + align, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+  char *start = (char *)(((uintptr_t)map + align - 1) & ~(align - 1));
+  if (start != map)
+    munmap(map, start - map);
+  munmap(start + size, (map + align) - start);
+  return start;
+}
+
+/* Make the pages in the range of LEN bytes at START usable. */
+int commit_pages(void *start, size_t len) {
+  return mprotect(start, len, PROT_READ | PROT_WRITE);
+}
+
+/*
+ * Give the pages in the range of LEN bytes at START back, but keep
+ * the range reserved. Unlike PURGE_PAGES, this also drops the commit
+ * charge. Return 0 on success.
+ */
+int decommit_pages(void *start, size_t len) {
+  void *map = mmap(start, len, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                   -1, 0);
+  return map == MAP_FAILED ? -1 : 0;
+}
+
+#endif /* __OS_H_ */
@@ -0,0 +1,220 @@
+#ifndef __PCPU_H_
+#define __PCPU_H_
+
+#include <pthread.h>  /* pthread_once */
+#include <stddef.h>   /* size_t */
+#include <sys/mman.h> /* mmap */
+#include <unistd.h>   /* sysconf */
+
+/*
+ * Per-CPU caches of free blocks, built on restartable sequences
+ * (see rseq(2)).
+ *
+ * Each CPU has a small stack of free blocks for every size class.
+ * A thread pushes and pops on the stack of the CPU it runs on, inside
+ * a critical section that the kernel restarts if the thread is
+ * preempted, migrated or interrupted by a signal before the final
+ * store. So, no other thread can get in between, and neither locks
+ * nor atomic instructions are needed. Since there's one cache per
+ * CPU rather than per thread, the memory held in caches is bounded
+ * by the number of CPUs, no matter how many threads there are.
+ *
+ * The critical sections are written in x86-64 assembly and use the
+ * rseq area that glibc (2.35 and later) registers for every thread.
+ * Elsewhere, or if rseq isn't available, PCPU_INIT fails and the
+ * caches are never used.
+ */
+
+/* Class K holds blocks of at least (K + 1) * PCPU_QUANTUM bytes. */
+#define PCPU_QUANTUM 16
+#define PCPU_CLASSES 8
+#define PCPU_MAX_SIZE (PCPU_CLASSES * PCPU_QUANTUM)
+/* The most blocks a stack can hold. CONF.PCPU_CACHE picks the limit. */
+#define PCPU_MAX_CAP 64
+
+#if defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h> /* __rseq_offset, __rseq_size, RSEQ_SIG */
+#define PCPU_RSEQ 1
+#endif
+#endif
+
+typedef struct {
+  size_t count[PCPU_CLASSES];
+  void *slots[PCPU_CLASSES][PCPU_MAX_CAP];
+} __attribute__((aligned(64))) PcpuCache;
+
+/* One cache per possible CPU, or NULL if they can't be used. */
+static PcpuCache *pcpu_caches = NULL;
+static int pcpu_ncpus = 0;
+
+/* The class for an allocation of SIZE bytes. SIZE must be in (0, PCPU_MAX_SIZE]. */
+int pcpu_alloc_class(size_t size) { return (size - 1) / PCPU_QUANTUM; }
+
+/* The size of the blocks that are allocated for class CLS. */
+size_t pcpu_class_size(int cls) { return (cls + 1) * PCPU_QUANTUM; }
+
+/*
+ * The class that a freed block of SIZE bytes can serve, or -1 if it's
+ * too small or too large to be cached. Any block of class K is large
+ * enough for every allocation of class K.
+ */
+int pcpu_free_class(size_t size) {
+  if (size < PCPU_QUANTUM || size >= PCPU_MAX_SIZE + PCPU_QUANTUM)
+    return -1;
+  return size / PCPU_QUANTUM - 1;
+}
+
+#ifdef PCPU_RSEQ
+
+_Static_assert(RSEQ_SIG == 0x53053053, "the abort handlers hard-code RSEQ_SIG");
+
+void pcpu_setup(void) {
+  /* No rseq area, e.g. because of GLIBC_TUNABLES=glibc.pthread.rseq=0. */
+  if (__rseq_size == 0)
+    return;
+
+  long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+  if (ncpus < 1)
+    return;
+
+  void *mem = mmap(NULL, ncpus * sizeof(PcpuCache), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return;
+
+  pcpu_ncpus = ncpus;
+  pcpu_caches = mem;
+}
+
+struct rseq *pcpu_rseq(void) {
+  return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+
+/*
+ * The start of a critical section. Label 3 is its descriptor: the
+ * section runs from label 1 up to (but not including) label 2, and
+ * the kernel continues at label 4 if it's interrupted. The descriptor
+ * is stored in the rseq area to arm the section.
+ */
+#define PCPU_CS_BEGIN                                                          \
+  ".pushsection __rseq_cs, \"aw\"\n\t"                                         \
+  ".balign 32\n\t"                                                             \
+  "3:\n\t"                                                                     \
+  ".long 0, 0\n\t"                                                             \
+  ".quad 1f, (2f - 1f), 4f\n\t"                                                \
+  ".popsection\n\t"                                                            \
+  "leaq 3b(%%rip), %%rax\n\t"                                                  \
+  "movq %%rax, (%[rseq_cs])\n\t"                                               \
+  "1:\n\t"                                                                     \
+  "cmpl %[cpu], (%[cpu_id])\n\t"                                               \
+  "jnz 4f\n\t"
+
+/*
+ * The end of a critical section. The kernel only jumps to abort
+ * handlers that are preceded by RSEQ_SIG. The three bytes before it
+ * make the signature part of a ud1 instruction for disassemblers.
+ */
+#define PCPU_CS_END                                                            \
+  "2:\n\t"                                                                     \
+  ".pushsection __rseq_failure, \"ax\"\n\t"                                    \
+  ".byte 0x0f, 0xb9, 0x3d\n\t"                                                 \
+  ".long 0x53053053\n\t"                                                       \
+  "4:\n\t"                                                                     \
+  "jmp %l[abort]\n\t"                                                          \
+  ".popsection\n\t"
+
+/*
+ * Pop a block off the stack for class CLS of the current CPU.
+ * Return NULL if the stack is empty.
+ */
+void *pcpu_pop(int cls) {
+  struct rseq *rs = pcpu_rseq();
+  void *item;
+
+retry:;
+  unsigned int cpu = __atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+  if (cpu >= (unsigned int)pcpu_ncpus)
+    return NULL;
+
+  PcpuCache *c = &pcpu_caches[cpu];
+  __asm__ __volatile__ goto(PCPU_CS_BEGIN
+                            "movq (%[count]), %%rax\n\t"
+                            "testq %%rax, %%rax\n\t"
+                            "jz %l[empty]\n\t"
+                            "movq -8(%[slots], %%rax, 8), %%rdx\n\t"
+                            "movq %%rdx, (%[item])\n\t"
+                            "decq %%rax\n\t"
+                            /* Commit. */
+                            "movq %%rax, (%[count])\n\t"
+                            PCPU_CS_END
+                            :
+                            : [rseq_cs] "r"(&rs->rseq_cs),
+                              [cpu_id] "r"(&rs->cpu_id), [cpu] "r"(cpu),
+                              [count] "r"(&c->count[cls]),
+                              [slots] "r"(c->slots[cls]), [item] "r"(&item)
+                            : "rax", "rdx", "memory", "cc"
+                            : abort, empty);
+  return item;
+abort:
+  goto retry;
+empty:
+  return NULL;
+}
+
+/*
+ * Push BLOCK onto the stack for class CLS of the current CPU unless
+ * the stack already holds CAP blocks. Return 0 if BLOCK was pushed.
+ */
+int pcpu_push(int cls, void *block, size_t cap) {
+  struct rseq *rs = pcpu_rseq();
+
+retry:;
+  unsigned int cpu = __atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+  if (cpu >= (unsigned int)pcpu_ncpus)
+    return -1;
+
+  PcpuCache *c = &pcpu_caches[cpu];
+  __asm__ __volatile__ goto(PCPU_CS_BEGIN
+                            "movq (%[count]), %%rax\n\t"
+                            "cmpq %[cap], %%rax\n\t"
+                            "jae %l[full]\n\t"
+                            "movq %[block], (%[slots], %%rax, 8)\n\t"
+                            "incq %%rax\n\t"
+                            /* Commit. */
+                            "movq %%rax, (%[count])\n\t"
+                            PCPU_CS_END
+                            :
+                            : [rseq_cs] "r"(&rs->rseq_cs),
+                              [cpu_id] "r"(&rs->cpu_id), [cpu] "r"(cpu),
+                              [count] "r"(&c->count[cls]),
+                              [slots] "r"(c->slots[cls]), [block] "r"(block),
+                              [cap] "r"(cap)
+                            : "rax", "memory", "cc"
+                            : abort, full);
+  return 0;
+abort:
+  goto retry;
+full:
+  return -1;
+}
+
+#else
+
+void pcpu_setup(void) {}
+void *pcpu_pop(int cls) { (void)cls; return NULL; }
+int pcpu_push(int cls, void *block, size_t cap) {
+  (void)cls, (void)block, (void)cap;
+  return -1;
+}
+
+#endif /* PCPU_RSEQ */
+
+/* Set up the caches once. Return 1 if they can be used. */
+int pcpu_init(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, pcpu_setup);
+  return pcpu_caches != NULL;
+}
+
+#endif /* __PCPU_H_ */
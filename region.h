@@ -0,0 +1,237 @@
+#ifndef __REGION_H_
+#define __REGION_H_
+
+#include <stddef.h>   /* size_t */
+#include <stdint.h>   /* uint64_t */
+#include <sys/mman.h> /* mmap, munmap */
+
+#include "mutex.h"
+#include "os.h"
+
+/*
+ * Regions. A region is a bump-pointer allocator for memory that dies
+ * all at once, such as everything that is allocated while a request is
+ * handled. Allocating moves a pointer through the region's current
+ * chunk, and freeing a single block does nothing. When the current
+ * chunk is full, another one is chained to it. REGION_RESET frees all
+ * blocks at once, and REGION_RELEASE hands back all chunks, both
+ * without looking at the blocks or the pool's chunks one by one.
+ *
+ * Chunks come from a pool that is shared by many regions, so that a
+ * new region (or one that grows again after a reset) doesn't have to
+ * ask the OS for memory. The pool keeps the chunks it's given until
+ * REGION_POOL_TRIM unmaps them. All chunks of a pool have the same
+ * size. A block that doesn't fit into one gets a chunk of its own,
+ * which is unmapped when the region is reset. These chunks are the
+ * only ones that reset and release go through one by one, with a
+ * munmap each, so they take time in the number of large blocks.
+ *
+ * A region must only be used by one thread at a time. The pool has a
+ * lock and can be shared.
+ */
+
+#define REGION_CHUNK_SIZE ((size_t)64 << 10)
+
+/* Regions align blocks like the allocators do. */
+#define REGION_ALIGN sizeof(uint64_t)
+
+/* The bytes at the start of a chunk that blocks can't use. */
+#define REGION_HEADER \
+  ((sizeof(RegionChunk) + REGION_ALIGN - 1) & ~(REGION_ALIGN - 1))
+
+typedef struct RegionChunk {
+  struct RegionChunk *next;
+  size_t size; /* Bytes of the chunk, including this header. */
+} RegionChunk;
+
+typedef struct {
+  Mutex lock;
+  size_t chunk_size;   /* Bytes of every chunk in the pool. */
+  RegionChunk *chunks; /* The free chunks. */
+  size_t count;        /* The number of free chunks. */
+  size_t mapped;       /* The number of chunks mapped, free or not. */
+} RegionPool;
+
+#define REGION_POOL_INITIALIZER(size) {MUTEX_INITIALIZER, (size), NULL, 0, 0}
+
+/* The pool of regions that are set up without one. */
+static RegionPool region_pool = REGION_POOL_INITIALIZER(REGION_CHUNK_SIZE);
+
+typedef struct {
+  RegionPool *pool;
+  RegionChunk *first; /* R's chunks from its pool, oldest first. */
+  RegionChunk *last;
+  size_t count;       /* The number of chunks from FIRST to LAST. */
+  RegionChunk *cur;   /* The chunk that blocks are taken from. */
+  RegionChunk *large; /* Chunks of single blocks that are too large. */
+  char *ptr;          /* The next block in the current chunk. */
+  char *end;          /* The end of the current chunk. */
+} Region;
+
+/* The first byte of CHUNK that blocks can use. */
+char *region_chunk_start(RegionChunk *chunk) {
+  return (char *)chunk + REGION_HEADER;
+}
+
+/* Map a chunk of SIZE bytes, rounded up to pages. */
+RegionChunk *region_map_chunk(size_t size) {
+  size = page_up(size);
+  RegionChunk *chunk = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (chunk == MAP_FAILED)
+    return NULL;
+  chunk->next = NULL;
+  chunk->size = size;
+  return chunk;
+}
+
+/* Set up R with chunks from POOL, or from REGION_POOL if it's NULL. */
+void region_init(Region *r, RegionPool *pool) {
+  r->pool = pool != NULL ? pool : &region_pool;
+  r->first = r->last = r->cur = r->large = NULL;
+  r->count = 0;
+  r->ptr = r->end = NULL;
+}
+
+/* Take a chunk out of POOL, or map a new one. */
+RegionChunk *region_pool_get(RegionPool *pool) {
+  mutex_lock(&pool->lock);
+  RegionChunk *chunk = pool->chunks;
+  if (chunk != NULL) {
+    pool->chunks = chunk->next;
+    pool->count--;
+  }
+  mutex_unlock(&pool->lock);
+
+  if (chunk == NULL) {
+    chunk = region_map_chunk(pool->chunk_size);
+    if (chunk == NULL)
+      return NULL;
+    mutex_lock(&pool->lock);
+    pool->mapped++;
+    mutex_unlock(&pool->lock);
+  }
+  chunk->next = NULL;
+  return chunk;
+}
+
+/* Give the COUNT chunks from FIRST to LAST back to POOL. */
+void region_pool_put(RegionPool *pool, RegionChunk *first, RegionChunk *last,
+                     size_t count) {
+  mutex_lock(&pool->lock);
+  last->next = pool->chunks;
+  pool->chunks = first;
+  pool->count += count;
+  mutex_unlock(&pool->lock);
+}
+
+/*
+ * Unmap the free chunks of POOL but KEEP of them.
+ * Return the number of chunks that were unmapped.
+ */
+size_t region_pool_trim(RegionPool *pool, size_t keep) {
+  mutex_lock(&pool->lock);
+  RegionChunk *chunks = NULL;
+  size_t n = 0;
+  while (pool->count > keep) {
+    RegionChunk *chunk = pool->chunks;
+    pool->chunks = chunk->next;
+    pool->count--;
+    pool->mapped--;
+    chunk->next = chunks;
+    chunks = chunk;
+    n++;
+  }
+  mutex_unlock(&pool->lock);
+
+  while (chunks != NULL) {
+    RegionChunk *next = chunks->next;
+    munmap(chunks, chunks->size);
+    chunks = next;
+  }
+  return n;
+}
+
+/* Allocate SIZE bytes in a chunk of their own. */
+void *region_alloc_large(Region *r, size_t size) {
+  RegionChunk *chunk = region_map_chunk(REGION_HEADER + size);
+  if (chunk == NULL)
+    return NULL;
+  chunk->next = r->large;
+  r->large = chunk;
+  return region_chunk_start(chunk);
+}
+
+/*
+ * Allocate SIZE bytes in R. Return NULL if SIZE is 0 or if there's no
+ * memory left.
+ */
+void *region_alloc(Region *r, size_t size) {
+  if (size == 0 || size > PTRDIFF_MAX)
+    return NULL;
+  size = (size + REGION_ALIGN - 1) & ~(REGION_ALIGN - 1);
+
+  if (size <= (size_t)(r->end - r->ptr)) {
+    void *mem = r->ptr;
+    r->ptr += size;
+    return mem;
+  }
+
+  if (size > r->pool->chunk_size - REGION_HEADER)
+    return region_alloc_large(r, size);
+
+  /* After a reset, the chunks that R already has are used again first. */
+  RegionChunk *chunk = r->cur != NULL ? r->cur->next : r->first;
+  if (chunk == NULL) {
+    chunk = region_pool_get(r->pool);
+    if (chunk == NULL)
+      return NULL;
+    if (r->last != NULL)
+      r->last->next = chunk;
+    else
+      r->first = chunk;
+    r->last = chunk;
+    r->count++;
+  }
+  r->cur = chunk;
+  r->ptr = region_chunk_start(chunk) + size;
+  r->end = (char *)chunk + chunk->size;
+  return region_chunk_start(chunk);
+}
+
+/* Blocks of a region are only freed all at once. */
+void region_free(Region *r, void *mem) { (void)r, (void)mem; }
+
+/* Unmap the chunks of R's large blocks. */
+void region_free_large(Region *r) {
+  while (r->large != NULL) {
+    RegionChunk *next = r->large->next;
+    munmap(r->large, r->large->size);
+    r->large = next;
+  }
+}
+
+/*
+ * Free all blocks of R at once. R keeps its chunks and fills them again
+ * from the first one on. Only the chunks of large blocks are unmapped.
+ */
+void region_reset(Region *r) {
+  region_free_large(r);
+  r->cur = r->first;
+  r->ptr = r->end = NULL;
+  if (r->cur != NULL) {
+    r->ptr = region_chunk_start(r->cur);
+    r->end = (char *)r->cur + r->cur->size;
+  }
+}
+
+/* Free all blocks of R and give its chunks back to its pool. */
+void region_release(Region *r) {
+  region_free_large(r);
+  /* The chunks are still chained to each other. */
+  if (r->first != NULL)
+    region_pool_put(r->pool, r->first, r->last, r->count);
+  region_init(r, r->pool);
+}
+
+#endif /* __REGION_H_ */
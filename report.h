@@ -0,0 +1,223 @@
+#ifndef __REPORT_H_
+#define __REPORT_H_
+
+#include <dlfcn.h>   /* dladdr (needs _GNU_SOURCE) */
+#include <stddef.h>  /* size_t */
+#include <stdint.h>  /* uintptr_t */
+
+#include "conf.h"
+#include "dbg.h"
+#include "mutex.h"
+
+/*
+ * A report of what is left on the heap. Blocks are grouped into
+ * power of two size classes: class K holds blocks of up to 8 << K
+ * bytes. Used blocks are counted as live, free blocks as retained.
+ * Used blocks that sit in a cache, ready to be handed out again, are
+ * counted as cached. Lots of live blocks at exit point to leaks, lots
+ * of retained ones to fragmentation.
+ *
+ * Everything is printed with dbg, so nothing is allocated.
+ */
+
+#define REPORT_CLASSES 48
+
+typedef struct {
+  size_t live_blocks;
+  size_t live_bytes;
+  size_t free_blocks;
+  size_t free_bytes;
+  size_t cached_blocks;
+  size_t cached_bytes;
+} ReportClass;
+
+typedef struct {
+  ReportClass classes[REPORT_CLASSES];
+} Report;
+
+/* Return the report size class of a block of SIZE bytes. */
+int report_class(size_t size) {
+  if (size <= 8)
+    return 0;
+  /* The number of bits needed for (size - 1) / 8. */
+  int k = 64 - __builtin_clzl((size - 1) >> 3);
+  return k < REPORT_CLASSES ? k : REPORT_CLASSES - 1;
+}
+
+/* Add a block of SIZE bytes to the report. */
+void report_block(Report *r, size_t size, int live) {
+  ReportClass *c = &r->classes[report_class(size)];
+  if (live) {
+    c->live_blocks++;
+    c->live_bytes += size;
+  } else {
+    c->free_blocks++;
+    c->free_bytes += size;
+  }
+}
+
+/*
+ * Count a block of SIZE bytes that was added as live as cached
+ * instead. The allocator can't tell cached blocks from used ones
+ * when it walks the heap, but it can find them in its caches.
+ */
+void report_cached(Report *r, size_t size) {
+  ReportClass *c = &r->classes[report_class(size)];
+  c->live_blocks--;
+  c->live_bytes -= size;
+  c->cached_blocks++;
+  c->cached_bytes += size;
+}
+
+/*
+ * Allocation sites. If sampling is on (see CONF.PROF_SAMPLE), every
+ * n-th allocation is stored in a fixed size hash table, keyed by the
+ * address of the allocation. Freeing a sampled allocation removes it
+ * again, so at exit, the table holds the sampled allocations that are
+ * still live.
+ */
+
+#define SAMPLE_MAX 4096
+
+/* Marks a slot in SAMPLES whose allocation was freed. */
+#define SAMPLE_FREED ((void *)1)
+
+typedef struct {
+  void *mem;  /* NULL if the slot was never used. */
+  void *site; /* Return address of the caller of malloc & co. */
+  size_t size;
+} Sample;
+
+static Sample samples[SAMPLE_MAX];
+static size_t sample_count = 0;   /* Allocations seen so far. */
+static size_t sample_dropped = 0; /* Samples that didn't fit. */
+static Mutex sample_lock = MUTEX_INITIALIZER;
+
+size_t sample_slot(void *mem) {
+  return (((uintptr_t)mem >> 4) * 0x9e3779b97f4a7c15ull) % SAMPLE_MAX;
+}
+
+/* Maybe remember that MEM (SIZE bytes) was allocated at SITE. */
+void sample_alloc(void *mem, size_t size, void *site) {
+  if (conf.prof_sample == 0 || mem == NULL)
+    return;
+
+  mutex_lock(&sample_lock);
+  if (++sample_count % conf.prof_sample != 0) {
+    mutex_unlock(&sample_lock);
+    return;
+  }
+
+  size_t i = sample_slot(mem);
+  for (size_t n = 0; n < SAMPLE_MAX; n++, i = (i + 1) % SAMPLE_MAX) {
+    if (samples[i].mem == NULL || samples[i].mem == SAMPLE_FREED) {
+      samples[i].mem = mem;
+      samples[i].site = site;
+      samples[i].size = size;
+      mutex_unlock(&sample_lock);
+      return;
+    }
+  }
+  sample_dropped++;
+  mutex_unlock(&sample_lock);
+}
+
+/* Forget MEM if it was sampled. */
+void sample_free(void *mem) {
+  if (conf.prof_sample == 0 || mem == NULL)
+    return;
+
+  mutex_lock(&sample_lock);
+  size_t i = sample_slot(mem);
+  for (size_t n = 0; n < SAMPLE_MAX && samples[i].mem != NULL;
+       n++, i = (i + 1) % SAMPLE_MAX) {
+    if (samples[i].mem == mem) {
+      samples[i].mem = SAMPLE_FREED;
+      break;
+    }
+  }
+  mutex_unlock(&sample_lock);
+}
+
+/* Print the site of a sample as "object+offset" so addr2line can use it. */
+void report_site(void *site, size_t blocks, size_t bytes) {
+  Dl_info info;
+  if (dladdr(site, &info) != 0 && info.dli_fname != NULL) {
+    dbg("  %s+%#tx: %zu blocks, %zu bytes\n", info.dli_fname,
+        (uintptr_t)site - (uintptr_t)info.dli_fbase, blocks, bytes);
+  } else {
+    dbg("  %p: %zu blocks, %zu bytes\n", site, blocks, bytes);
+  }
+}
+
+/* Print the sampled allocations that are still live, grouped by site. */
+void report_sites(void) {
+  /* Sites that have already been printed. */
+  static void *done[SAMPLE_MAX];
+  size_t ndone = 0;
+
+  dbg("Live sampled allocations by site (1 in %zu allocations):\n",
+      conf.prof_sample);
+
+  for (size_t i = 0; i < SAMPLE_MAX; i++) {
+    if (samples[i].mem == NULL || samples[i].mem == SAMPLE_FREED)
+      continue;
+
+    void *site = samples[i].site;
+    int seen = 0;
+    for (size_t j = 0; j < ndone && !seen; j++)
+      seen = done[j] == site;
+    if (seen)
+      continue;
+    done[ndone++] = site;
+
+    size_t blocks = 0;
+    size_t bytes = 0;
+    for (size_t j = i; j < SAMPLE_MAX; j++) {
+      if (samples[j].mem != NULL && samples[j].mem != SAMPLE_FREED &&
+          samples[j].site == site) {
+        blocks++;
+        bytes += samples[j].size;
+      }
+    }
+    report_site(site, blocks, bytes);
+  }
+
+  if (sample_dropped > 0)
+    dbg("  (%zu samples were dropped, the table was full)\n", sample_dropped);
+}
+
+void report_print(Report *r) {
+  size_t live_blocks = 0, live_bytes = 0, free_blocks = 0, free_bytes = 0;
+  size_t cached_blocks = 0, cached_bytes = 0;
+  for (int k = 0; k < REPORT_CLASSES; k++) {
+    live_blocks += r->classes[k].live_blocks;
+    live_bytes += r->classes[k].live_bytes;
+    free_blocks += r->classes[k].free_blocks;
+    free_bytes += r->classes[k].free_bytes;
+    cached_blocks += r->classes[k].cached_blocks;
+    cached_bytes += r->classes[k].cached_bytes;
+  }
+
+  dbg("Heap report: %zu live blocks (%zu bytes), "
+      "%zu free blocks (%zu bytes), %zu cached blocks (%zu bytes)\n",
+      live_blocks, live_bytes, free_blocks, free_bytes, cached_blocks,
+      cached_bytes);
+  dbg("  %12s %12s %12s %12s %12s %13s %12s\n", "size <=", "live blocks",
+      "live bytes", "free blocks", "free bytes", "cached blocks",
+      "cached bytes");
+
+  for (int k = 0; k < REPORT_CLASSES; k++) {
+    ReportClass *c = &r->classes[k];
+    if (c->live_blocks == 0 && c->free_blocks == 0 && c->cached_blocks == 0)
+      continue;
+    dbg("  %12zu %12zu %12zu %12zu %12zu %13zu %12zu\n", (size_t)8 << k,
+        c->live_blocks, c->live_bytes, c->free_blocks, c->free_bytes,
+        c->cached_blocks, c->cached_bytes);
+  }
+
+  if (conf.prof_sample != 0)
+    report_sites();
+}
+
+#endif /* __REPORT_H_ */
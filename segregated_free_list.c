@@ -1,9 +1,21 @@
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "conf.h"
+#include "ctl.h"
+#include "backend.h"
 #include "dbg.h"
+#include "decay.h"
+#include "headroom.h"
+#include "mutex.h"
+#include "os.h"
+#include "region.h"
 
 /* Three lowest bits set for good measure. */
 #define TRUE 7
@@ -14,10 +26,16 @@ struct BlockHdr {
   size_t size;    /* The number of bytes in this block. */
   BlockHdr *next; /* Linked list of blocks. */
   int used;       /* Flag if the block is used. */
+  int stacked;    /* Flag if the block belongs to a lock-free stack. */
+  int purged;     /* Flag if the block is free and its pages were purged. */
 };
 
 typedef uint64_t word_t;
 
+/*
+ * The default bucket layout. It can be changed at runtime
+ * with the "classes" option (see conf.h).
+ */
 enum {
   TINY = 1,
   SMALL = 16,
@@ -31,28 +49,191 @@ enum {
   HUGE_IDX = 4,
 };
 
-static BlockHdr *global_buckets[] = {
-    [TINY_IDX] = NULL,  /* >= TINY # of words */
-    [SMALL_IDX] = NULL, /* >= SMALL # of words */
-    [MID_IDX] = NULL,   /* >= MID # of words */
-    [BIG_IDX] = NULL,   /* >= BIG # of words */
-    [HUGE_IDX] = NULL,  /* >= HUGE # of words */
-};
+/*
+ * Lock-free stacks. With the "stack_max" option, allocations of up to
+ * that many bytes don't search the buckets. Instead, there's a stack
+ * of free blocks for every size (in words) up to STACK_MAX_SIZE, and
+ * allocating and freeing pops and pushes with a compare-and-swap. No
+ * lock is taken, except to get a batch of new blocks from the OS when
+ * a stack runs empty.
+ *
+ * Those blocks are also put into the buckets, with STACKED set, so
+ * they are counted in the heap statistics. Apart from that, the
+ * buckets ignore them: they're never handed out by FIND_BLOCK and
+ * never trimmed, so their memory stays mapped once they exist.
+ * That's what makes it safe for POP to read a block that another
+ * thread has just taken.
+ *
+ * Blocks on a stack are linked through their memory, because NEXT
+ * links the buckets. The head of a stack is a tagged pointer: the low
+ * 48 bits hold the top block and the high 16 bits a counter that
+ * changes with every update. So, if a block is popped and pushed again
+ * between another thread's read of the head and its compare-and-swap,
+ * the counter differs and that CAS fails (the ABA problem).
+ */
+
+#define STACK_MAX_SIZE 256
+#define STACK_CLASSES (STACK_MAX_SIZE / sizeof(word_t))
+/* Blocks that are carved out at once when a stack is empty. */
+#define STACK_BATCH 32
+
+#define TAG_SHIFT 48
+#define PTR_MASK (((uint64_t)1 << TAG_SHIFT) - 1)
+
+typedef _Atomic uint64_t Stack;
+
+#ifdef STACK_LOCKED
+/* For bench-stacks.sh: the same stacks, but behind mutexes. */
+static pthread_mutex_t stack_locks[STACK_CLASSES] = {
+    [0 ... STACK_CLASSES - 1] = PTHREAD_MUTEX_INITIALIZER};
+#endif
+
+/*
+ * A heap. Every heap has its own buckets, stacks and memory, which it
+ * gets from its backend. ALLOC and WFREE use the main heap, which grows
+ * with the program break by default. HEAP_CREATE makes more heaps, e.g.
+ * one per subsystem, so that their blocks don't fragment each other's
+ * memory and their threads don't wait for each other's lock.
+ */
+typedef struct {
+  /*
+   * Bucket I holds blocks of at least CONF.CLASSES[I] words.
+   * With the default layout, that's:
+   *   [TINY_IDX]  >= TINY # of words
+   *   [SMALL_IDX] >= SMALL # of words
+   *   [MID_IDX]   >= MID # of words
+   *   [BIG_IDX]   >= BIG # of words
+   *   [HUGE_IDX]  >= HUGE # of words
+   */
+  BlockHdr *buckets[CONF_MAX_CLASSES];
+
+  /* Protects the buckets and the break. */
+  Mutex lock;
 
-static void *heap_base_addr = NULL;
+  Stack stacks[STACK_CLASSES];
 
-void reset_heap(void) {
-  if (heap_base_addr != NULL) {
-    brk(heap_base_addr);
-    heap_base_addr = NULL;
-    global_buckets[TINY_IDX] = NULL;
-    global_buckets[SMALL_IDX] = NULL;
-    global_buckets[MID_IDX] = NULL;
-    global_buckets[BIG_IDX] = NULL;
-    global_buckets[HUGE_IDX] = NULL;
+  void *base_addr;
+
+  /*
+   * The end of the last block. Memory from here up to the
+   * break is headroom (see headroom.h). BRK is where this
+   * allocator left the break. If it's somewhere else,
+   * someone else has moved it, and the memory above END
+   * isn't ours.
+   */
+  char *end;
+  char *brk;
+  Headroom headroom;
+
+  /* Bytes freed over time, for the "decay" option. */
+  Decay decay;
+
+  /*
+   * Where the heap gets its memory from (see backend.h). By default,
+   * the main heap uses the program break, and other heaps a range of
+   * reserved address space of their own. With the "vm_reserve"
+   * option, all of them reserve that many bytes.
+   */
+  Backend default_backend;
+  Backend *backend;
+} Heap;
+
+/* Address space that heaps other than the main one reserve by default. */
+#define HEAP_RESERVE ((size_t)1 << 30)
+
+static Heap main_heap = {.lock = MUTEX_INITIALIZER};
+
+/* The backend of heap H, with its range set up. */
+Backend *heap_backend(Heap *h) {
+  if (h->backend == NULL) {
+    if (conf.vm_reserve > 0)
+      h->default_backend = mmap_backend(conf.vm_reserve);
+    else if (h == &main_heap)
+      h->default_backend = sbrk_backend();
+    else
+      h->default_backend = mmap_backend(HEAP_RESERVE);
+    h->backend = &h->default_backend;
   }
+  if (h->backend->base == NULL &&
+      h->backend->ops->reserve(h->backend, sizeof(word_t)) != 0 &&
+      h == &main_heap && h->backend == &h->default_backend) {
+    /* Without the address space, the break will have to do. */
+    h->default_backend = sbrk_backend();
+    h->default_backend.ops->reserve(&h->default_backend, sizeof(word_t));
+  }
+  return h->backend;
+}
+
+/* Move the break of heap H by INCR bytes, like sbrk. */
+void *heap_sbrk(Heap *h, ptrdiff_t incr) {
+  Backend *b = heap_backend(h);
+  if (b->base == NULL)
+    return (void *)-1;
+  return b->ops->grow(b, incr);
+}
+
+/* Move the break of heap H to ADDR, like brk. */
+int heap_set_brk(Heap *h, void *addr) {
+  Backend *b = heap_backend(h);
+  return b->ops->shrink(b, addr);
 }
 
+/*
+ * Free all blocks of heap H at once and give its memory back to its
+ * backend. No other thread may use the heap meanwhile.
+ */
+void heap_reset(Heap *h) {
+  if (h->base_addr != NULL) {
+    heap_set_brk(h, h->base_addr);
+    h->base_addr = NULL;
+    h->end = h->brk = NULL;
+    for (int i = 0; i < CONF_MAX_CLASSES; i++)
+      h->buckets[i] = NULL;
+    for (size_t i = 0; i < STACK_CLASSES; i++)
+      h->stacks[i] = 0;
+    h->decay = (Decay){0};
+  }
+  if (h->backend != NULL) {
+    h->backend->ops->destroy(h->backend);
+    if (h->backend == &h->default_backend)
+      h->backend = NULL;
+  }
+}
+
+/*
+ * Make a new heap that gets its memory from B, or from the default
+ * backend if B is NULL. Return NULL if the OS has no memory for it.
+ */
+Heap *heap_create(Backend *b) {
+  Heap *h = mmap(NULL, sizeof(Heap), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (h == MAP_FAILED)
+    return NULL;
+  mutex_init(&h->lock);
+  h->backend = b;
+  return h;
+}
+
+/* Give heap H and all of its memory back. */
+void heap_destroy(Heap *h) {
+  heap_reset(h);
+  pthread_mutex_destroy(&h->lock.lock);
+  munmap(h, sizeof(Heap));
+}
+
+/*
+ * Take the memory of heap H from B from now on, or from the default
+ * backend if B is NULL. The heap is reset, so no other thread may
+ * use it meanwhile.
+ */
+void heap_set_backend(Heap *h, Backend *b) {
+  heap_reset(h);
+  h->backend = b;
+}
+
+/* Reset the main heap. */
+void reset_heap(void) { heap_reset(&main_heap); }
+
 BlockHdr *hdr(word_t *ptr) { return (BlockHdr *)(ptr)-1; }
 
 /*
@@ -60,51 +241,46 @@ BlockHdr *hdr(word_t *ptr) { return (BlockHdr *)(ptr)-1; }
  * that have a size greater or equal to SIZE.
  */
 int bucket_idx(size_t size) {
-  int idx = 0;
   size_t words = size / sizeof(word_t);
-  if (words >= HUGE) {
-    idx = HUGE_IDX;
-  } else if (words >= BIG) {
-    idx = BIG_IDX;
-  } else if (words >= MID) {
-    idx = MID_IDX;
-  } else if (words >= SMALL) {
-    idx = SMALL_IDX;
-  } else if (words >= TINY) {
-    idx = TINY_IDX;
+  for (int idx = conf.nclasses - 1; idx > 0; idx--) {
+    if (words >= conf.classes[idx])
+      return idx;
   }
-  return idx;
+  return 0;
 }
 
-BlockHdr *find_block(size_t size) {
+BlockHdr *find_block(Heap *h, size_t size) {
   int idx = bucket_idx(size);
-  BlockHdr *blk = global_buckets[idx];
+  BlockHdr *blk = h->buckets[idx];
   BlockHdr *best = NULL;
+  /* Purged blocks would have to be faulted in again, so they come last. */
+  BlockHdr *best_purged = NULL;
 
   while (blk != NULL) {
-    if (blk->used == FALSE && blk->size >= size) {
-      if (best == NULL || blk->size < best->size) {
-        best = blk;
+    if (blk->used == FALSE && blk->stacked == FALSE && blk->size >= size) {
+      BlockHdr **bestp = blk->purged ? &best_purged : &best;
+      if (*bestp == NULL || blk->size < (*bestp)->size) {
+        *bestp = blk;
       }
     }
     blk = blk->next;
   }
 
-  return best;
+  return best != NULL ? best : best_purged;
 }
 
-/* Insert a block into the bucket that best fits its size. */
-void insert_block(BlockHdr *blk) {
+/* Insert a block into the bucket of heap H that best fits its size. */
+void insert_block(Heap *h, BlockHdr *blk) {
   int idx = bucket_idx(blk->size);
-  blk->next = global_buckets[idx];
-  global_buckets[idx] = blk;
+  blk->next = h->buckets[idx];
+  h->buckets[idx] = blk;
 }
 
 /*
  * Split off as much memory as possible from the end of the
  * given block so that it only contains SIZE bytes.
  */
-void split_block(BlockHdr *blk, size_t size) {
+void split_block(Heap *h, BlockHdr *blk, size_t size) {
   assert(blk->size >= size);
 
   /*
@@ -114,18 +290,20 @@ void split_block(BlockHdr *blk, size_t size) {
   size_t real_size = sizeof(BlockHdr) + size;
 
   /*
-   * +8 because we want the new block to also
-   * contain at least a word of memory.
+   * The new block must also contain at least
+   * CONF.MIN_SPLIT bytes (by default, a word).
    */
-  if (blk->size < real_size + 8)
+  if (blk->size < real_size + conf.min_split)
     return;
 
   /* Create the new block and move add it to the right bucket. */
   BlockHdr *new_blk = (BlockHdr *)((size_t)blk + real_size);
   new_blk->size = blk->size - real_size;
   new_blk->used = FALSE;
+  new_blk->stacked = FALSE;
+  new_blk->purged = blk->purged;
   new_blk->next = NULL;
-  insert_block(new_blk);
+  insert_block(h, new_blk);
 
   /*
    * Shrink the original block's size. This block and
@@ -138,23 +316,49 @@ void split_block(BlockHdr *blk, size_t size) {
   blk->size = size;
 }
 
-BlockHdr *request_block_from_os(size_t size) {
-  BlockHdr *blk = sbrk(0); /* Returns current break. */
+BlockHdr *request_block_from_os(Heap *h, size_t size) {
+  char *brk_now = heap_sbrk(h, 0); /* Returns current break. */
 
   /*
    * Safe the start address of the heap before changing
    * it for the first time. This is only needed to allow
    * implementing RESET_HEAP.
    */
-  if (heap_base_addr == NULL)
-    heap_base_addr = (void *)blk;
+  int first = h->base_addr == NULL;
+  if (first)
+    h->base_addr = (void *)brk_now;
+  if (brk_now != h->brk)
+    h->end = brk_now;
 
-  /* Size of the actual allocation that is performed on heap. */
+  /*
+   * Size of the actual allocation that is performed on heap.
+   * If the headroom doesn't fit it, the break moves up by that
+   * much plus new headroom (if the "headroom" option is on).
+   * The first time, it moves up by at least "prefault_heap"
+   * bytes, which are faulted in.
+   */
   size_t real_size = sizeof(BlockHdr) + size;
-  if (sbrk(real_size) == (void *)-1) {
-    return NULL; /* Out of memory. */
+  if (h->end + real_size > brk_now) {
+    size_t grow = h->end + real_size - brk_now;
+    size_t extra = 0;
+    if (conf.headroom > 0)
+      extra = headroom_target(&h->headroom, page_size());
+    if (first && grow + extra < conf.prefault_heap)
+      extra = conf.prefault_heap - grow;
+    if (heap_sbrk(h, grow + extra) == (void *)-1) {
+      extra = 0;
+      if (heap_sbrk(h, grow) == (void *)-1)
+        return NULL; /* Out of memory. */
+    }
+    /* The headroom is left to fault in lazily (see headroom.h). */
+    if ((first && conf.prefault_heap > 0) || conf.prefault)
+      prefault_pages(brk_now, grow + extra);
+    h->brk = heap_sbrk(h, 0);
   }
 
+  BlockHdr *blk = (BlockHdr *)h->end;
+  h->end += real_size;
+  h->headroom.used += real_size;
   return blk;
 }
 
@@ -163,7 +367,114 @@ size_t align(size_t size) {
   return (size + (sizeof(word_t) - 1)) & ~(sizeof(word_t) - 1);
 }
 
-word_t *alloc(ptrdiff_t ssize) {
+/* The head of a stack that has BLK on top and comes after OLD. */
+uint64_t stack_head(BlockHdr *blk, uint64_t old) {
+  return (((old >> TAG_SHIFT) + 1) << TAG_SHIFT) | (uintptr_t)blk;
+}
+
+BlockHdr *stack_top(uint64_t head) {
+  return (BlockHdr *)(uintptr_t)(head & PTR_MASK);
+}
+
+/* The link to the next block on a stack is stored in the block's memory. */
+BlockHdr *_Atomic *stack_link(BlockHdr *blk) {
+  return (BlockHdr *_Atomic *)(blk + 1);
+}
+
+/* Push BLK onto the stack of heap H for blocks of CLS + 1 words. */
+void stack_push(Heap *h, size_t cls, BlockHdr *blk) {
+  Stack *stack = &h->stacks[cls];
+#ifdef STACK_LOCKED
+  pthread_mutex_lock(&stack_locks[cls]);
+  *stack_link(blk) = stack_top(*stack);
+  *stack = stack_head(blk, *stack);
+  pthread_mutex_unlock(&stack_locks[cls]);
+#else
+  uint64_t old = atomic_load_explicit(stack, memory_order_relaxed);
+  do {
+    atomic_store_explicit(stack_link(blk), stack_top(old),
+                          memory_order_relaxed);
+  } while (!atomic_compare_exchange_weak_explicit(stack, &old,
+                                                  stack_head(blk, old),
+                                                  memory_order_release,
+                                                  memory_order_relaxed));
+#endif
+}
+
+BlockHdr *stack_pop(Heap *h, size_t cls) {
+  Stack *stack = &h->stacks[cls];
+#ifdef STACK_LOCKED
+  pthread_mutex_lock(&stack_locks[cls]);
+  BlockHdr *blk = stack_top(*stack);
+  if (blk != NULL)
+    *stack = stack_head(*stack_link(blk), *stack);
+  pthread_mutex_unlock(&stack_locks[cls]);
+  return blk;
+#else
+  uint64_t old = atomic_load_explicit(stack, memory_order_acquire);
+  BlockHdr *blk;
+  do {
+    blk = stack_top(old);
+    if (blk == NULL)
+      return NULL;
+    /*
+     * BLK might be taken and used by another thread right now. Then
+     * this reads garbage, but the CAS fails because the tag changed.
+     */
+    BlockHdr *next = atomic_load_explicit(stack_link(blk), memory_order_relaxed);
+    if (atomic_compare_exchange_weak_explicit(stack, &old,
+                                              stack_head(next, old),
+                                              memory_order_acquire,
+                                              memory_order_acquire))
+      break;
+  } while (1);
+  return blk;
+#endif
+}
+
+/*
+ * Carve STACK_BATCH blocks of SIZE bytes out of new memory from the
+ * OS. The first one is returned, the others are pushed onto the stack
+ * of heap H for their size.
+ */
+BlockHdr *refill_stack(Heap *h, size_t size) {
+  size_t real_size = sizeof(BlockHdr) + size;
+  BlockHdr *blks[STACK_BATCH];
+
+  mutex_lock(&h->lock);
+  char *mem = (char *)request_block_from_os(
+      h, STACK_BATCH * real_size - sizeof(BlockHdr));
+  if (mem == NULL) {
+    mutex_unlock(&h->lock);
+    return NULL;
+  }
+  for (int i = 0; i < STACK_BATCH; i++) {
+    blks[i] = (BlockHdr *)(mem + i * real_size);
+    blks[i]->size = size;
+    blks[i]->used = i == 0 ? TRUE : FALSE;
+    blks[i]->stacked = TRUE;
+    insert_block(h, blks[i]);
+  }
+  mutex_unlock(&h->lock);
+
+  for (int i = STACK_BATCH - 1; i > 0; i--)
+    stack_push(h, size / sizeof(word_t) - 1, blks[i]);
+  return blks[0];
+}
+
+word_t *stack_alloc(Heap *h, size_t size) {
+  BlockHdr *blk = stack_pop(h, size / sizeof(word_t) - 1);
+  if (blk != NULL)
+    blk->used = TRUE;
+  else if ((blk = refill_stack(h, size)) == NULL)
+    return NULL;
+  return (word_t *)(blk + 1);
+}
+
+/* Allocate SSIZE bytes in heap H. Return NULL if that fails. */
+word_t *heap_alloc(Heap *h, ptrdiff_t ssize) {
+  conf_init();
+
   if (ssize <= 0)
     return NULL;
 
@@ -174,28 +485,291 @@ word_t *alloc(ptrdiff_t ssize) {
   size_t size = (size_t)ssize;
   size = align(size);
 
+  if (size <= conf.stack_max && size <= STACK_MAX_SIZE)
+    return stack_alloc(h, size);
+
+  mutex_lock(&h->lock);
   BlockHdr *blk = NULL;
-  if ((blk = find_block(size)) != NULL) {
-    split_block(blk, size);
+  if ((blk = find_block(h, size)) != NULL) {
+    split_block(h, blk, size);
     blk->used = TRUE;
-    return (word_t *)(blk + 1);
+    blk->purged = FALSE;
   } else {
-    blk = request_block_from_os(size);
+    blk = request_block_from_os(h, size);
+    if (blk == NULL) {
+      mutex_unlock(&h->lock);
+      return NULL;
+    }
     blk->size = size;
     blk->used = TRUE;
-    insert_block(blk);
-    return (word_t *)(blk + 1);
+    blk->stacked = FALSE;
+    blk->purged = FALSE;
+    insert_block(h, blk);
+  }
+  mutex_unlock(&h->lock);
+  return (word_t *)(blk + 1);
+}
+
+/* Check if BLK is the last block of heap H. */
+int is_top(Heap *h, BlockHdr *blk) {
+  return (char *)(blk + 1) + blk->size == h->end &&
+         heap_sbrk(h, 0) == h->brk;
+}
+
+/* Remove BLK from its bucket in heap H. */
+void remove_block(Heap *h, BlockHdr *blk) {
+  BlockHdr **link = &h->buckets[bucket_idx(blk->size)];
+  while (*link != blk)
+    link = &(*link)->next;
+  *link = blk->next;
+}
+
+/*
+ * Give free blocks at the top of heap H back to the OS.
+ * Return the number of bytes that were released.
+ */
+ptrdiff_t trim_heap(Heap *h) {
+  ptrdiff_t released = 0;
+  int found = TRUE;
+
+  while (found) {
+    found = FALSE;
+    for (int i = 0; i < conf.nclasses && !found; i++) {
+      for (BlockHdr *blk = h->buckets[i]; blk != NULL; blk = blk->next) {
+        if (blk->used == FALSE && blk->stacked == FALSE && is_top(h, blk)) {
+          released += sizeof(BlockHdr) + blk->size;
+          remove_block(h, blk);
+          /* The headroom above BLK goes back, too. */
+          heap_set_brk(h, blk);
+          h->end = h->brk = (char *)blk;
+          found = TRUE;
+          break;
+        }
+      }
+    }
   }
+
+  if (h->base_addr != NULL && heap_sbrk(h, 0) == h->base_addr) {
+    h->base_addr = NULL; /* The heap is empty. */
+    h->end = h->brk = NULL;
+  }
+
+  return released;
 }
 
-void wfree(word_t *ptr) {
+/*
+ * Purge free blocks of heap H until no more dirty bytes are left
+ * than DECAY_LIMIT allows. The caller must hold H's lock.
+ * Return the number of bytes that were purged.
+ */
+ptrdiff_t decay_heap(Heap *h, uint64_t now) {
+  size_t dirty = 0;
+  for (int i = 0; i < conf.nclasses; i++) {
+    for (BlockHdr *blk = h->buckets[i]; blk != NULL; blk = blk->next) {
+      if (blk->used == FALSE && blk->stacked == FALSE && blk->purged == FALSE)
+        dirty += whole_pages(blk + 1, blk->size);
+    }
+  }
+
+  size_t limit = decay_limit(&h->decay, now);
+  ptrdiff_t released = 0;
+  /* The largest blocks are in the last bucket. */
+  for (int i = conf.nclasses - 1; i >= 0 && dirty > limit; i--) {
+    for (BlockHdr *blk = h->buckets[i]; blk != NULL && dirty > limit;
+         blk = blk->next) {
+      size_t bytes = whole_pages(blk + 1, blk->size);
+      if (blk->used == FALSE && blk->stacked == FALSE &&
+          blk->purged == FALSE && bytes > 0) {
+        released += decay_purge(blk + 1, blk->size);
+        blk->purged = TRUE;
+        dirty -= bytes;
+      }
+    }
+  }
+  return released;
+}
+
+/* Free memory that HEAP_ALLOC allocated in heap H. */
+void heap_free(Heap *h, word_t *ptr) {
   if (ptr == NULL)
     return;
 
-  hdr(ptr)->used = FALSE;
+  BlockHdr *blk = hdr(ptr);
+  if (blk->stacked) {
+    blk->used = FALSE;
+    stack_push(h, blk->size / sizeof(word_t) - 1, blk);
+    return;
+  }
+
+  mutex_lock(&h->lock);
+  blk->used = FALSE;
+  blk->purged = FALSE;
+
+  size_t freed = whole_pages(blk + 1, blk->size);
+  if (conf.decay > 0 && freed > 0) {
+    uint64_t now = decay_now();
+    decay_freed(&h->decay, freed, now);
+    if (decay_due(&h->decay, now))
+      decay_heap(h, now);
+  }
+
+  if (conf.trim_threshold > 0 && blk->size >= conf.trim_threshold &&
+      is_top(h, blk))
+    trim_heap(h);
+  mutex_unlock(&h->lock);
 }
 
+word_t *alloc(ptrdiff_t size) { return heap_alloc(&main_heap, size); }
+
+void wfree(word_t *ptr) { heap_free(&main_heap, ptr); }
+
+/*
+ * Blocks on the stacks are counted, too. Since they are allocated
+ * and freed without the heap's lock, those numbers are only a snapshot.
+ */
+void heap_stats(HeapStats *st) {
+  mutex_lock(&main_heap.lock);
+  st->allocated = st->free = st->mapped = 0;
+  for (int i = 0; i < conf.nclasses; i++) {
+    for (BlockHdr *blk = main_heap.buckets[i]; blk != NULL; blk = blk->next) {
+      if (blk->used)
+        st->allocated += blk->size;
+      else
+        st->free += blk->size;
+      st->mapped += sizeof(BlockHdr) + blk->size;
+    }
+  }
+  if (main_heap.end != NULL && heap_sbrk(&main_heap, 0) == main_heap.brk)
+    st->mapped += main_heap.brk - main_heap.end; /* Headroom */
+  mutex_unlock(&main_heap.lock);
+}
+
+/* The main heap is arena 0. Other heaps are out of reach. */
+ptrdiff_t purge_arena(size_t idx) {
+  if (idx != 0)
+    return -1;
+
+  ptrdiff_t released = 0;
+  mutex_lock(&main_heap.lock);
+  for (int i = 0; i < conf.nclasses; i++) {
+    for (BlockHdr *blk = main_heap.buckets[i]; blk != NULL; blk = blk->next) {
+      /* Blocks that were purged before have no pages left to give back. */
+      if (blk->used == FALSE && blk->stacked == FALSE &&
+          blk->purged == FALSE && whole_pages(blk + 1, blk->size) > 0) {
+        released += purge_pages(blk + 1, blk->size);
+        blk->purged = TRUE;
+      }
+    }
+  }
+  mutex_unlock(&main_heap.lock);
+  return released;
+}
+
+ptrdiff_t trim_arena(size_t idx) {
+  if (idx != 0)
+    return -1;
+  mutex_lock(&main_heap.lock);
+  ptrdiff_t released = trim_heap(&main_heap);
+  mutex_unlock(&main_heap.lock);
+  return released;
+}
+
+ptrdiff_t decay_arena(size_t idx) {
+  if (idx != 0)
+    return -1;
+  mutex_lock(&main_heap.lock);
+  ptrdiff_t released = decay_heap(&main_heap, decay_now());
+  mutex_unlock(&main_heap.lock);
+  return released;
+}
+
+/* How the lock of the main heap is used (see mutex.h). */
+int ctl_locks_heap(size_t idx, void *oldp, size_t *oldlenp, void *newp,
+                   size_t newlen) {
+  (void)idx, (void)newlen;
+  MutexStats st;
+  mutex_stats(&main_heap.lock, &st);
+  return ctl_read_only(oldp, oldlenp, newp, &st, sizeof(st));
+}
+
+static const CtlEntry ctl_table[] = {CTL_COMMON,
+                                     {"stats.locks.heap", ctl_locks_heap}};
+
+int mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp,
+            size_t newlen) {
+  return ctl_dispatch(ctl_table, CTL_LEN(ctl_table), name, oldp, oldlenp, newp,
+                      newlen);
+}
+
+/* For the stack test: allocate and free small blocks for a while. */
+void *stack_thread(void *arg) {
+  (void)arg;
+  word_t *mem[16];
+  for (int round = 0; round < 1000; round++) {
+    for (int i = 0; i < 16; i++) {
+      mem[i] = alloc(8 * (i % 8 + 1));
+      assert(hdr(mem[i])->used == TRUE);
+      *mem[i] = (word_t)mem[i];
+    }
+    for (int i = 0; i < 16; i++) {
+      assert(*mem[i] == (word_t)mem[i]);
+      wfree(mem[i]);
+    }
+  }
+  return NULL;
+}
+
+#ifdef BENCH_STACKS
+/*
+ * The contention benchmark of bench-stacks.sh: BENCH_THREADS
+ * threads allocate and free small blocks as fast as they can.
+ */
+#define BENCH_THREADS 8
+#define BENCH_ROUNDS 100000
+
+void *bench_thread(void *arg) {
+  (void)arg;
+  word_t *mem[16];
+  for (int round = 0; round < BENCH_ROUNDS; round++) {
+    for (int i = 0; i < 16; i++)
+      mem[i] = alloc(8 * (i % 4 + 1));
+    for (int i = 0; i < 16; i++)
+      wfree(mem[i]);
+  }
+  return NULL;
+}
+
+int bench_stacks(void) {
+  pthread_t threads[BENCH_THREADS];
+  struct timespec start, end;
+
+  conf_init();
+  conf.stack_max = STACK_MAX_SIZE;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < BENCH_THREADS; i++)
+    pthread_create(&threads[i], NULL, bench_thread, NULL);
+  for (int i = 0; i < BENCH_THREADS; i++)
+    pthread_join(threads[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+#ifdef STACK_LOCKED
+  const char *kind = "mutex";
+#else
+  const char *kind = "lock-free";
+#endif
+  dbg("%s stacks: %d threads, %.1f ns per malloc/free pair\n", kind,
+      BENCH_THREADS, ns / ((double)BENCH_THREADS * BENCH_ROUNDS * 16));
+  return 0;
+}
+#endif /* BENCH_STACKS */
+
 int main(void) {
+#ifdef BENCH_STACKS
+  return bench_stacks();
+#endif
+
   dbg("TEST: Alignment\n");
   assert(align(0) == 0);
   assert(align(1) == 8);
@@ -210,20 +784,20 @@ int main(void) {
     /* Make a tiny allocation. */
     word_t *a1 = alloc(8);
     assert(hdr(a1)->size == 8);
-    assert(global_buckets[TINY_IDX] == hdr(a1));
+    assert(main_heap.buckets[TINY_IDX] == hdr(a1));
     /* Make a small allocation. */
     word_t *a2 = alloc(125);
     assert(hdr(a2)->size == 128);
-    assert(global_buckets[SMALL_IDX] == hdr(a2));
+    assert(main_heap.buckets[SMALL_IDX] == hdr(a2));
     /* Make a huge allocation. */
     word_t *a3 = alloc(sizeof(word_t) * HUGE);
     assert(hdr(a3)->size == sizeof(word_t) * HUGE);
-    assert(global_buckets[HUGE_IDX] == hdr(a3));
+    assert(main_heap.buckets[HUGE_IDX] == hdr(a3));
     /* Make another allocation in a non-empty bucket. */
     word_t *a4 = alloc(8);
     assert(hdr(a4)->size == 8);
-    assert(global_buckets[TINY_IDX] == hdr(a4));
-    assert(global_buckets[TINY_IDX]->next == hdr(a1));
+    assert(main_heap.buckets[TINY_IDX] == hdr(a4));
+    assert(main_heap.buckets[TINY_IDX]->next == hdr(a1));
   }
 
   {
@@ -236,22 +810,22 @@ int main(void) {
     word_t *a1 = alloc(8);
     assert(hdr(a1)->used == TRUE);
     assert(hdr(a1)->size == 8);
-    assert(global_buckets[TINY_IDX] == hdr(a1));
+    assert(main_heap.buckets[TINY_IDX] == hdr(a1));
 
     wfree(a1);
     assert(hdr(a1)->used == FALSE);
     assert(hdr(a1)->size == 8);
-    assert(global_buckets[TINY_IDX] == hdr(a1));
+    assert(main_heap.buckets[TINY_IDX] == hdr(a1));
 
     word_t *a2 = alloc(256);
     assert(hdr(a2)->used == TRUE);
     assert(hdr(a2)->size == 256);
-    assert(global_buckets[MID_IDX] == hdr(a2));
+    assert(main_heap.buckets[MID_IDX] == hdr(a2));
 
     wfree(a2);
     assert(hdr(a2)->used == FALSE);
     assert(hdr(a2)->size == 256);
-    assert(global_buckets[MID_IDX] == hdr(a2));
+    assert(main_heap.buckets[MID_IDX] == hdr(a2));
   }
 
   {
@@ -261,7 +835,7 @@ int main(void) {
     word_t *a1 = alloc(64);
     wfree(a1);
     assert(hdr(a1)->used == FALSE);
-    assert(global_buckets[TINY_IDX] == hdr(a1));
+    assert(main_heap.buckets[TINY_IDX] == hdr(a1));
     word_t *a2 = alloc(64);
     assert(hdr(a1) == hdr(a2));
     assert(hdr(a1)->used == TRUE);
@@ -272,8 +846,8 @@ int main(void) {
     assert(hdr(a3) != hdr(a1));
     assert(hdr(a3)->size == 72);
     assert(hdr(a3)->used == TRUE);
-    assert(global_buckets[TINY_IDX] == hdr(a3));
-    assert(global_buckets[TINY_IDX]->next == hdr(a1));
+    assert(main_heap.buckets[TINY_IDX] == hdr(a3));
+    assert(main_heap.buckets[TINY_IDX]->next == hdr(a1));
     wfree(a3);
 
     /* Re-use the smaller of the two free blocks in the TINY bucket. */
@@ -281,15 +855,15 @@ int main(void) {
     assert(hdr(a4) == hdr(a1));
     assert(hdr(a4)->used == TRUE);
     assert(hdr(a4)->size == 64);
-    assert(global_buckets[TINY_IDX] == hdr(a3));
-    assert(global_buckets[TINY_IDX]->next == hdr(a4));
+    assert(main_heap.buckets[TINY_IDX] == hdr(a3));
+    assert(main_heap.buckets[TINY_IDX]->next == hdr(a4));
 
     /*
      * Create a free block in the SMALL bucket. For the subsequent SMALL
      * allocations, that block should be re-used.
      */
     word_t *a5 = alloc(128);
-    assert(global_buckets[SMALL_IDX] == hdr(a5));
+    assert(main_heap.buckets[SMALL_IDX] == hdr(a5));
     assert(hdr(a5)->used == TRUE);
     assert(hdr(a5)->size == 128);
     wfree(a5);
@@ -297,7 +871,7 @@ int main(void) {
     assert(hdr(a6) == hdr(a5));
     assert(hdr(a6)->used == TRUE);
     assert(hdr(a6)->size == 128);
-    assert(global_buckets[SMALL_IDX] == hdr(a6));
+    assert(main_heap.buckets[SMALL_IDX] == hdr(a6));
     wfree(a6);
 
     /*
@@ -305,12 +879,12 @@ int main(void) {
      * If we allocate another block, the smallest possible bucket
      * should be picked.
      */
-    assert(global_buckets[TINY_IDX]->used == FALSE);
+    assert(main_heap.buckets[TINY_IDX]->used == FALSE);
     word_t *a7 = alloc(65);
     assert(hdr(a7) == hdr(a3));
     assert(hdr(a7)->used == TRUE);
     assert(hdr(a7)->size == 72);
-    assert(global_buckets[TINY_IDX] == hdr(a7));
+    assert(main_heap.buckets[TINY_IDX] == hdr(a7));
     wfree(a7);
   }
 
@@ -321,32 +895,32 @@ int main(void) {
     word_t *a1 = alloc(16 + sizeof(BlockHdr));
     assert(hdr(a1)->size == 16 + sizeof(BlockHdr));
     assert(hdr(a1)->next == NULL);
-    assert(global_buckets[TINY_IDX] == hdr(a1));
+    assert(main_heap.buckets[TINY_IDX] == hdr(a1));
     wfree(a1);
     word_t *a2 = alloc(8);
     assert(hdr(a2) == hdr(a1));
     assert(hdr(a2)->used == TRUE);
     assert(hdr(a2)->size == 8);
     assert(hdr(a2)->next == NULL);
-    /* global_buckets[TINY_IDX] is the block that has been split off. */
-    assert(global_buckets[TINY_IDX]->next == hdr(a2));
-    assert(global_buckets[TINY_IDX]->used == FALSE);
-    assert(global_buckets[TINY_IDX]->size == 8);
+    /* main_heap.buckets[TINY_IDX] is the block that has been split off. */
+    assert(main_heap.buckets[TINY_IDX]->next == hdr(a2));
+    assert(main_heap.buckets[TINY_IDX]->used == FALSE);
+    assert(main_heap.buckets[TINY_IDX]->size == 8);
 
     /* Splitting on re-use changes buckets if sizes grow too small. */
     word_t *a3 = alloc(304 + sizeof(BlockHdr));
     assert(hdr(a3)->size == 304 + sizeof(BlockHdr));
     assert(hdr(a3)->used == TRUE);
-    assert(global_buckets[MID_IDX] == hdr(a3));
+    assert(main_heap.buckets[MID_IDX] == hdr(a3));
     wfree(a3);
 
     word_t *a4 = alloc(256);
     assert(a4 == a3);
     assert(hdr(a4)->size == 256);
-    assert(global_buckets[MID_IDX] == hdr(a4));
+    assert(main_heap.buckets[MID_IDX] == hdr(a4));
     /* The block that's split off is stored in the TINY bucket. */
-    assert(global_buckets[TINY_IDX]->used == FALSE);
-    assert(global_buckets[TINY_IDX]->size == 304 - 256);
+    assert(main_heap.buckets[TINY_IDX]->used == FALSE);
+    assert(main_heap.buckets[TINY_IDX]->size == 304 - 256);
 
     reset_heap();
     /*
@@ -354,17 +928,362 @@ int main(void) {
      * size that's too small for its bucket.
      */
     word_t *a5 = alloc(256 + sizeof(BlockHdr));
-    assert(global_buckets[MID_IDX] == hdr(a5));
+    assert(main_heap.buckets[MID_IDX] == hdr(a5));
     wfree(a5);
     word_t *a6 = alloc(64);
     assert(a6 != a5);
-    assert(global_buckets[TINY_IDX] == hdr(a6));
-    assert(global_buckets[MID_IDX] == hdr(a5));
+    assert(main_heap.buckets[TINY_IDX] == hdr(a6));
+    assert(main_heap.buckets[MID_IDX] == hdr(a5));
     assert(hdr(a6)->used == TRUE);
     assert(hdr(a6)->size == 64);
     assert(hdr(a5)->used == FALSE);
     assert(hdr(a5)->size == 256 + sizeof(BlockHdr));
   }
 
+  {
+    reset_heap();
+    dbg("TEST: Configuring buckets\n");
+    Conf saved_conf = conf;
+    conf_parse(&conf, "classes:1|4|8");
+    assert(conf.nclasses == 3);
+    assert(bucket_idx(8) == 0);
+    assert(bucket_idx(32) == 1);
+    assert(bucket_idx(1024) == 2);
+    /* Descending or empty layouts are rejected as a whole. */
+    conf_parse(&conf, "classes:1|8|4");
+    conf_parse(&conf, "classes:");
+    assert(conf.nclasses == 3);
+    assert(conf.classes[2] == 8);
+
+    word_t *a1 = alloc(96);
+    assert(main_heap.buckets[2] == hdr(a1));
+    wfree(a1);
+    /*
+     * By default, 96 - 64 - sizeof(BlockHdr) bytes would be split
+     * off. Nothing is split off unless at least 32 bytes remain.
+     */
+    conf_parse(&conf, "min_split:32");
+    word_t *a2 = alloc(64);
+    assert(a2 == a1);
+    assert(hdr(a2)->size == 96);
+    conf = saved_conf;
+    reset_heap();
+  }
+
+  {
+    reset_heap();
+    dbg("TEST: mallctl\n");
+    size_t val = 0;
+    size_t len = sizeof(val);
+    word_t *a1 = alloc(page_size() * 4);
+    word_t *a2 = alloc(8);
+    assert(mallctl("stats.allocated", &val, &len, NULL, 0) == 0);
+    assert(val == page_size() * 4 + 8);
+    wfree(a1);
+    assert(mallctl("stats.free", &val, &len, NULL, 0) == 0);
+    assert(val == page_size() * 4);
+    assert(mallctl("stats.mapped", &val, &len, NULL, 0) == 0);
+    assert(val == page_size() * 4 + 8 + 2 * sizeof(BlockHdr));
+    assert(mallctl("arena.0.purge", &val, &len, NULL, 0) == 0);
+    assert(val >= page_size() * 3);
+    /* Purging again skips the blocks that are purged already. */
+    assert(mallctl("arena.0.purge", &val, &len, NULL, 0) == 0);
+    assert(val == 0);
+    assert(mallctl("arena.0.trim", &val, &len, NULL, 0) == 0);
+    assert(val == 0);
+    wfree(a2);
+    /* Both blocks are free and at the top now. */
+    assert(mallctl("arena.0.trim", &val, &len, NULL, 0) == 0);
+    assert(val == page_size() * 4 + 8 + 2 * sizeof(BlockHdr));
+    assert(main_heap.buckets[TINY_IDX] == NULL);
+    assert(main_heap.buckets[HUGE_IDX] == NULL);
+
+    size_t classes[CONF_MAX_CLASSES];
+    len = sizeof(classes);
+    assert(mallctl("opt.classes", classes, &len, NULL, 0) == 0);
+    assert(len == 5 * sizeof(size_t));
+    assert(classes[HUGE_IDX] == HUGE);
+
+    MutexStats locks;
+    len = sizeof(locks);
+    assert(mallctl("stats.locks.heap", &locks, &len, NULL, 0) == 0);
+    size_t acquired = locks.acquired;
+    wfree(alloc(8));
+    assert(mallctl("stats.locks.heap", &locks, &len, NULL, 0) == 0);
+    assert(locks.acquired == acquired + 2);
+    assert(locks.contended == 0);
+  }
+
+  {
+    reset_heap();
+    dbg("TEST: Lock-free stacks\n");
+    conf.stack_max = 64;
+    /* A whole batch is carved out; the other blocks go onto the stack. */
+    word_t *a1 = alloc(20);
+    assert(hdr(a1)->size == 24);
+    assert(hdr(a1)->used == TRUE);
+    assert(hdr(a1)->stacked == TRUE);
+    assert(stack_top(main_heap.stacks[2]) == (BlockHdr *)((char *)a1 + 24));
+    /* Freeing pushes and allocating pops. */
+    wfree(a1);
+    assert(stack_top(main_heap.stacks[2]) == hdr(a1));
+    assert(hdr(a1)->used == FALSE);
+    word_t *a2 = alloc(24);
+    assert(a2 == a1);
+    /* Every update of a stack changes its tag. */
+    uint64_t head = main_heap.stacks[2];
+    wfree(a2);
+    assert(stack_top(main_heap.stacks[2]) == hdr(a2));
+    assert((main_heap.stacks[2] >> TAG_SHIFT) == (head >> TAG_SHIFT) + 1);
+
+    /* Larger blocks still come from the buckets. */
+    word_t *a3 = alloc(72);
+    assert(hdr(a3)->stacked == FALSE);
+    wfree(a3);
+    /* Blocks of the stacks aren't used for other sizes nor trimmed. */
+    word_t *a4 = alloc(72);
+    assert(a4 == a3);
+    wfree(a4);
+    size_t val = 0;
+    size_t len = sizeof(val);
+    assert(mallctl("arena.0.trim", &val, &len, NULL, 0) == 0);
+    assert(val == sizeof(BlockHdr) + 72);
+    assert(mallctl("stats.mapped", &val, &len, NULL, 0) == 0);
+    assert(val == STACK_BATCH * (sizeof(BlockHdr) + 24));
+
+    /* Many threads can use the stacks at once. */
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++)
+      pthread_create(&threads[i], NULL, stack_thread, NULL);
+    for (int i = 0; i < 4; i++)
+      pthread_join(threads[i], NULL);
+    assert(mallctl("stats.allocated", &val, &len, NULL, 0) == 0);
+    assert(val == 0);
+
+    conf.stack_max = 0;
+    reset_heap();
+  }
+
+  {
+    reset_heap();
+    dbg("TEST: Headroom\n");
+    conf.headroom = page_size() * 4;
+    word_t *a1 = alloc(16);
+    char *brk_after = sbrk(0);
+    assert(main_heap.brk == brk_after);
+    size_t val = 0;
+    size_t len = sizeof(val);
+    assert(mallctl("stats.mapped", &val, &len, NULL, 0) == 0);
+    assert(val == (size_t)(brk_after - (char *)hdr(a1)));
+    /*
+     * The program break is shared with everyone else who calls sbrk.
+     * Once someone else moves it, the headroom isn't the heap's anymore ...
+     */
+    assert(sbrk(page_size()) == brk_after);
+    assert(mallctl("stats.mapped", &val, &len, NULL, 0) == 0);
+    assert(val == sizeof(BlockHdr) + 16);
+    /* ... and the next block goes above the other caller's memory. */
+    word_t *a2 = alloc(64);
+    assert((char *)hdr(a2) == brk_after + page_size());
+    assert(main_heap.brk == sbrk(0));
+    conf.headroom = 0;
+    reset_heap();
+  }
+
+  {
+    reset_heap();
+    dbg("TEST: Decay\n");
+    conf.decay = 1000;
+    uint64_t later = decay_now() + 2000ull * 1000000;
+    word_t *a1 = alloc(page_size() * 8);
+    alloc(8); /* Keeps a1 off the top. */
+    wfree(a1);
+    mutex_lock(&main_heap.lock);
+    assert(decay_heap(&main_heap, later) >= (ptrdiff_t)(page_size() * 7));
+    mutex_unlock(&main_heap.lock);
+    assert(hdr(a1)->purged == TRUE);
+    /* A purged block that is split leaves the rest of it purged ... */
+    word_t *a2 = alloc(page_size() * 2);
+    assert(a2 == a1);
+    assert(hdr(a2)->purged == FALSE);
+    BlockHdr *rest = (BlockHdr *)((char *)a2 + page_size() * 2);
+    assert(main_heap.buckets[HUGE_IDX] == rest);
+    assert(rest->used == FALSE && rest->purged == TRUE);
+    /* ... so decaying doesn't purge it again. */
+    mutex_lock(&main_heap.lock);
+    assert(decay_heap(&main_heap, later) == 0);
+    mutex_unlock(&main_heap.lock);
+    conf.decay = 0;
+    reset_heap();
+  }
+
+  {
+    reset_heap();
+    dbg("TEST: Address space reserve\n");
+    conf.vm_reserve = 64 << 20;
+    word_t *a1 = alloc(16);
+    Backend *b = heap_backend(&main_heap);
+    assert((char *)hdr(a1) == b->base);
+    /*
+     * The heap doesn't share the program break anymore, so someone
+     * else moving it doesn't leave a gap between the blocks.
+     */
+    char *brk_before = sbrk(0);
+    assert(sbrk(page_size()) == brk_before);
+    word_t *a2 = alloc(16);
+    assert(hdr(a2) == (BlockHdr *)((char *)a1 + 16));
+    assert(main_heap.brk == heap_sbrk(&main_heap, 0));
+    assert(brk(brk_before) == 0);
+    /* The blocks that refill the stacks come from the reserve, too. */
+    conf.stack_max = 64;
+    word_t *a3 = alloc(32);
+    assert((char *)a3 > b->base && (char *)a3 < b->end);
+    wfree(a3);
+    conf.stack_max = 0;
+    conf.vm_reserve = 0;
+    reset_heap();
+    assert(b->base == NULL);
+  }
+
+  {
+    dbg("TEST: Backends\n");
+    /* The buckets and the stacks fill up with blocks in the buffer. */
+    static char buf[64 << 10];
+    Backend bb = buffer_backend(buf, sizeof(buf));
+    heap_set_backend(&main_heap, &bb);
+    conf.stack_max = 64;
+    word_t *a1 = alloc(16);
+    word_t *a2 = alloc(page_size());
+    assert((char *)a1 > buf && (char *)a1 < buf + sizeof(buf));
+    assert((char *)a2 > buf && (char *)a2 < buf + sizeof(buf));
+    wfree(a1);
+    wfree(a2);
+    size_t stack = hdr(a1)->size / sizeof(word_t) - 1;
+    assert(main_heap.stacks[stack] != 0);
+    assert(main_heap.buckets[HUGE_IDX] == hdr(a2));
+    /*
+     * Switching to another backend empties them, since none of
+     * their blocks may be handed out anymore.
+     */
+    heap_set_backend(&main_heap, NULL);
+    assert(bb.base == NULL);
+    assert(main_heap.stacks[stack] == 0);
+    assert(main_heap.buckets[HUGE_IDX] == NULL);
+    word_t *a3 = alloc(16);
+    assert((char *)a3 < buf || (char *)a3 >= buf + sizeof(buf));
+    conf.stack_max = 0;
+    reset_heap();
+  }
+
+  {
+    reset_heap();
+    dbg("TEST: Prefaulting\n");
+    /* The first allocation sets up and faults in the whole heap ... */
+    conf.prefault_heap = 1 << 20;
+    word_t *a1 = alloc(16);
+    char *start = (char *)hdr(a1);
+    char *end = (char *)heap_sbrk(&main_heap, 0);
+    assert(end >= start + (1 << 20));
+    assert(resident_bytes(start, 1 << 20) >= (1 << 20));
+    /* ... and blocks of every bucket are carved from it. */
+    for (int i = 1; i < conf.nclasses; i++) {
+      size_t size = conf.classes[i] * sizeof(word_t);
+      word_t *a = alloc(size);
+      assert(main_heap.buckets[bucket_idx(size)] == hdr(a));
+      assert((char *)a + size <= end);
+    }
+    assert((char *)heap_sbrk(&main_heap, 0) == end);
+    /* After a reset, the next allocation sets it up anew. */
+    reset_heap();
+    word_t *a2 = alloc(16);
+    assert((char *)heap_sbrk(&main_heap, 0) >= (char *)hdr(a2) + (1 << 20));
+    assert(resident_bytes(hdr(a2), 1 << 20) >= (1 << 20));
+    conf.prefault_heap = 0;
+    reset_heap();
+  }
+
+  {
+    dbg("TEST: Heap objects\n");
+    Heap *h1 = heap_create(NULL);
+    Heap *h2 = heap_create(NULL);
+    char *brk_before = sbrk(0);
+    word_t *a1 = heap_alloc(h1, 64);
+    word_t *a2 = heap_alloc(h2, 64);
+    /* Each heap has buckets and memory of its own. */
+    assert(sbrk(0) == brk_before);
+    assert(h1->buckets[bucket_idx(64)] == hdr(a1));
+    assert(h2->buckets[bucket_idx(64)] == hdr(a2));
+    assert((char *)a2 < heap_backend(h1)->base ||
+           (char *)a2 >= heap_backend(h1)->end);
+    /* Freed blocks stay in the bucket of their own heap. */
+    heap_free(h1, a1);
+    assert(h1->buckets[bucket_idx(64)] == hdr(a1));
+    assert(hdr(a1)->used == FALSE);
+    assert(h2->buckets[bucket_idx(64)] == hdr(a2));
+    assert(heap_alloc(h1, 64) == a1);
+    /* So do the stacks. */
+    conf.stack_max = 64;
+    word_t *a3 = heap_alloc(h1, 16);
+    heap_free(h1, a3);
+    assert(heap_alloc(h2, 16) != a3);
+    assert(heap_alloc(h1, 16) == a3);
+    conf.stack_max = 0;
+    /* Resetting frees all blocks of a heap at once. */
+    heap_reset(h1);
+    assert(h1->buckets[bucket_idx(64)] == NULL);
+    assert(h2->buckets[bucket_idx(64)] != NULL);
+    assert(hdr(a2)->used == TRUE);
+    assert(heap_alloc(h1, 64) != NULL);
+    heap_destroy(h1);
+    heap_destroy(h2);
+  }
+
+  {
+    dbg("TEST: Regions\n");
+    RegionPool pool = REGION_POOL_INITIALIZER(REGION_CHUNK_SIZE);
+    Region r1, r2;
+    region_init(&r1, &pool);
+    region_init(&r2, &pool);
+    /* Blocks are taken one after the other. */
+    char *b1 = region_alloc(&r1, 10);
+    char *b2 = region_alloc(&r1, 24);
+    assert(b2 == b1 + 16);
+    assert(region_alloc(&r1, 0) == NULL);
+    region_free(&r1, b1);
+    assert(region_alloc(&r1, 8) == b2 + 24);
+    /* Full chunks are chained. */
+    size_t room = REGION_CHUNK_SIZE - REGION_HEADER;
+    char *b3 = region_alloc(&r1, room);
+    assert(b3 == region_chunk_start(r1.last));
+    assert(r1.count == 2 && r1.first->next == r1.last);
+    /* Blocks larger than a chunk get one of their own. */
+    char *b4 = region_alloc(&r1, 3 * REGION_CHUNK_SIZE);
+    memset(b4, 1, 3 * REGION_CHUNK_SIZE);
+    assert(r1.large != NULL && r1.count == 2);
+    /* Resetting starts over in the first chunk. */
+    region_reset(&r1);
+    assert(r1.large == NULL);
+    assert(region_alloc(&r1, 10) == b1);
+    assert(region_alloc(&r1, room) == b3);
+    assert(pool.mapped == 2);
+    /* Released chunks go to the pool, and other regions get them. */
+    region_release(&r1);
+    assert(r1.first == NULL && pool.count == 2);
+    char *b5 = region_alloc(&r2, 16);
+    assert(region_chunk_start(r2.first) == b5);
+    assert(b5 == b1 || b5 == b3);
+    assert(pool.count == 1 && pool.mapped == 2);
+    region_release(&r2);
+    assert(pool.count == 2);
+    assert(region_pool_trim(&pool, 1) == 1);
+    assert(pool.count == 1 && pool.mapped == 1);
+    assert(region_pool_trim(&pool, 0) == 1);
+    /* Without a pool, a region uses REGION_POOL. */
+    region_init(&r1, NULL);
+    assert(region_alloc(&r1, 1) != NULL);
+    region_release(&r1);
+    assert(region_pool.count == 1);
+  }
+
   return 0;
 }
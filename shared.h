@@ -0,0 +1,300 @@
+#ifndef __SHARED_H_
+#define __SHARED_H_
+
+#include <errno.h>    /* EOWNERDEAD */
+#include <pthread.h>  /* pthread_mutex_t */
+#include <stddef.h>   /* size_t */
+#include <stdint.h>   /* uint64_t */
+#include <sys/mman.h> /* memfd_create, mmap */
+#include <sys/stat.h> /* fstat */
+#include <unistd.h>   /* ftruncate, close */
+
+#include "conf.h"
+#include "os.h"
+
+/*
+ * Shared arenas. A shared arena is a heap in a memfd (see
+ * memfd_create(2)) that cooperating processes map, each at an address
+ * of its own. A process that gets the file descriptor (by fork, over
+ * a Unix socket or through /proc/<pid>/fd) opens the arena with
+ * SHARED_ARENA_OPEN. All processes can allocate and free blocks in it.
+ * A block is handed over by its offset in the arena (SHARED_OFFSET),
+ * which the other process turns back into a pointer (SHARED_PTR). The
+ * data itself is never copied.
+ *
+ * Since the arena is mapped at different addresses, none of its
+ * metadata holds a pointer. Blocks link to each other by offset. The
+ * free list is kept in address order, so that a freed block can be
+ * merged with its neighbours. The arena's lock is a robust,
+ * process-shared mutex: if a process dies while it holds the lock,
+ * the next process to take it gets it anyway. If the process died in
+ * the middle of an allocation or a free, the free list may be half
+ * linked, so the arena is marked as broken: from then on, SHARED_ALLOC
+ * returns NULL and SHARED_FREE does nothing, in every process. Its
+ * blocks can still be read and written, but the arena should be
+ * replaced with a new one.
+ *
+ * The size of an arena is fixed when it's created. Growing it would
+ * mean remapping it in every process.
+ */
+
+#define SHARED_MAGIC 0x6172656e61736864ull
+
+typedef struct {
+  pthread_mutex_t lock;
+  uint64_t magic;   /* SHARED_MAGIC once the arena is set up. */
+  size_t size;      /* Bytes in the arena, including this header. */
+  size_t top;       /* Offset of the end of the last block. */
+  size_t free_list; /* Offset of the first free block, or 0. */
+  int busy;         /* Set while an operation is underway. */
+  int broken;       /* Set if a process died while BUSY was set. */
+} SharedHeader;
+
+typedef struct {
+  size_t size; /* Bytes of the block, without this header. */
+  size_t used;
+  size_t prev; /* Offsets of the neighbours in the free list, or 0. */
+  size_t next;
+} SharedBlock;
+
+typedef struct {
+  SharedHeader *hdr; /* Where this process mapped the arena. */
+  int fd;
+} SharedArena;
+
+/* The block at offset OFF of SA. */
+SharedBlock *shared_block(SharedArena *sa, size_t off) {
+  return (SharedBlock *)((char *)sa->hdr + off);
+}
+
+/* The offset of BLK in SA. */
+size_t shared_block_off(SharedArena *sa, SharedBlock *blk) {
+  return (char *)blk - (char *)sa->hdr;
+}
+
+/* Turn a pointer into SA into an offset that every process can use. */
+size_t shared_offset(SharedArena *sa, void *mem) {
+  return (char *)mem - (char *)sa->hdr;
+}
+
+/* Turn an offset into SA back into a pointer. */
+void *shared_ptr(SharedArena *sa, size_t off) { return (char *)sa->hdr + off; }
+
+/* Map the memfd FD of SIZE bytes into SA. Return 0 on success. */
+int shared_map(SharedArena *sa, int fd, size_t size) {
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+  sa->hdr = map;
+  sa->fd = fd;
+  return 0;
+}
+
+/*
+ * Create a shared arena of SIZE bytes, called NAME (for /proc only).
+ * Return 0 on success.
+ */
+int shared_arena_create(SharedArena *sa, const char *name, size_t size) {
+  size = page_up(size);
+  if (size < page_size())
+    return -1;
+
+  int fd = memfd_create(name, MFD_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  if (ftruncate(fd, size) != 0 || shared_map(sa, fd, size) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&sa->hdr->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  sa->hdr->size = size;
+  sa->hdr->top = (sizeof(SharedHeader) + sizeof(size_t) - 1) &
+                 ~(sizeof(size_t) - 1);
+  sa->hdr->free_list = 0;
+  sa->hdr->busy = sa->hdr->broken = 0;
+  sa->hdr->magic = SHARED_MAGIC;
+  return 0;
+}
+
+/*
+ * Map the shared arena in the memfd FD, which another process created.
+ * Return 0 on success.
+ */
+int shared_arena_open(SharedArena *sa, int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SharedHeader))
+    return -1;
+  if (shared_map(sa, fd, st.st_size) != 0)
+    return -1;
+  if (sa->hdr->magic != SHARED_MAGIC || sa->hdr->size != (size_t)st.st_size) {
+    munmap(sa->hdr, st.st_size);
+    return -1;
+  }
+  return 0;
+}
+
+/* Unmap SA from this process and close its file descriptor. */
+void shared_arena_close(SharedArena *sa) {
+  munmap(sa->hdr, sa->hdr->size);
+  close(sa->fd);
+  sa->hdr = NULL;
+  sa->fd = -1;
+}
+
+/*
+ * Lock SA for an operation. Return -1 if SA is broken, in which case
+ * the lock is held all the same.
+ */
+int shared_lock(SharedArena *sa) {
+  if (pthread_mutex_lock(&sa->hdr->lock) == EOWNERDEAD) {
+    /* The last owner died. Only between operations is SA consistent. */
+    if (sa->hdr->busy)
+      sa->hdr->broken = 1;
+    pthread_mutex_consistent(&sa->hdr->lock);
+  }
+  if (sa->hdr->broken)
+    return -1;
+  sa->hdr->busy = 1;
+  return 0;
+}
+
+void shared_unlock(SharedArena *sa) {
+  sa->hdr->busy = 0;
+  pthread_mutex_unlock(&sa->hdr->lock);
+}
+
+/* Remove BLK from the free list of SA. */
+void shared_unlink(SharedArena *sa, SharedBlock *blk) {
+  if (blk->prev != 0)
+    shared_block(sa, blk->prev)->next = blk->next;
+  else
+    sa->hdr->free_list = blk->next;
+  if (blk->next != 0)
+    shared_block(sa, blk->next)->prev = blk->prev;
+  blk->prev = blk->next = 0;
+}
+
+/*
+ * Allocate SIZE bytes in SA, from the free block that fits best or
+ * from the unused memory at the top. Return NULL if there's no room.
+ */
+void *shared_alloc(SharedArena *sa, size_t size) {
+  /* Rounding up a larger size could wrap around. */
+  if (size == 0 || size > sa->hdr->size)
+    return NULL;
+  size = (size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+
+  if (shared_lock(sa) != 0) {
+    shared_unlock(sa);
+    return NULL;
+  }
+  SharedBlock *best = NULL;
+  for (size_t off = sa->hdr->free_list; off != 0;) {
+    SharedBlock *blk = shared_block(sa, off);
+    if (blk->size >= size && (best == NULL || blk->size < best->size))
+      best = blk;
+    off = blk->next;
+  }
+
+  SharedBlock *blk = best;
+  if (blk != NULL) {
+    shared_unlink(sa, blk);
+    /* Split off the rest if it's large enough for another block. */
+    if (blk->size >= size + sizeof(SharedBlock) + conf.min_split) {
+      SharedBlock *rest = (SharedBlock *)((char *)(blk + 1) + size);
+      rest->size = blk->size - size - sizeof(SharedBlock);
+      rest->used = 0;
+      rest->prev = rest->next = 0;
+      blk->size = size;
+      /* REST takes BLK's place in the list, which is in address order. */
+      size_t rest_off = shared_block_off(sa, rest);
+      size_t *link = &sa->hdr->free_list;
+      while (*link != 0 && *link < rest_off) {
+        rest->prev = *link;
+        link = &shared_block(sa, *link)->next;
+      }
+      rest->next = *link;
+      if (rest->next != 0)
+        shared_block(sa, rest->next)->prev = rest_off;
+      *link = rest_off;
+    }
+  } else if (sa->hdr->top + sizeof(SharedBlock) + size <= sa->hdr->size) {
+    blk = shared_block(sa, sa->hdr->top);
+    blk->size = size;
+    blk->prev = blk->next = 0;
+    sa->hdr->top += sizeof(SharedBlock) + size;
+  }
+
+  if (blk != NULL)
+    blk->used = 1;
+  shared_unlock(sa);
+  return blk == NULL ? NULL : blk + 1;
+}
+
+/*
+ * Free MEM, which SHARED_ALLOC returned in any of the processes that
+ * use SA. It's merged with the free blocks right before and after it.
+ */
+void shared_free(SharedArena *sa, void *mem) {
+  if (mem == NULL)
+    return;
+
+  SharedBlock *blk = (SharedBlock *)mem - 1;
+  size_t off = shared_block_off(sa, blk);
+  if (shared_lock(sa) != 0) {
+    shared_unlock(sa);
+    return;
+  }
+  blk->used = 0;
+
+  /* Find BLK's place in the list. */
+  size_t prev = 0;
+  size_t next = sa->hdr->free_list;
+  while (next != 0 && next < off) {
+    prev = next;
+    next = shared_block(sa, next)->next;
+  }
+
+  /* Merge with the next block or link to it. */
+  if (next != 0 && off + sizeof(SharedBlock) + blk->size == next) {
+    SharedBlock *nblk = shared_block(sa, next);
+    blk->size += sizeof(SharedBlock) + nblk->size;
+    next = nblk->next;
+  }
+  blk->next = next;
+  if (next != 0)
+    shared_block(sa, next)->prev = off;
+
+  /* Merge with the previous block or link to it. */
+  SharedBlock *pblk = prev != 0 ? shared_block(sa, prev) : NULL;
+  if (pblk != NULL && prev + sizeof(SharedBlock) + pblk->size == off) {
+    pblk->size += sizeof(SharedBlock) + blk->size;
+    pblk->next = blk->next;
+    if (blk->next != 0)
+      shared_block(sa, blk->next)->prev = prev;
+    blk = pblk;
+    off = prev;
+  } else {
+    blk->prev = prev;
+    if (pblk != NULL)
+      pblk->next = off;
+    else
+      sa->hdr->free_list = off;
+  }
+
+  /* A free block at the top goes back to the unused memory. */
+  if (off + sizeof(SharedBlock) + blk->size == sa->hdr->top) {
+    shared_unlink(sa, blk);
+    sa->hdr->top = off;
+  }
+  shared_unlock(sa);
+}
+
+#endif /* __SHARED_H_ */
@@ -11,5 +11,5 @@ if [ -z "$2" ]; then
     echo "$0: expected a command to run"
 fi
 
-clang -O0 -g -W -Wall -Wextra -shared -fPIC "$1" -o malloc.so
+clang -O0 -g -W -Wall -Wextra -pthread -shared -fPIC "$1" -o malloc.so
 LD_PRELOAD=./malloc.so "$2"